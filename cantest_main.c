@@ -26,20 +26,28 @@
 #include <nuttx/config.h>
 
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <nuttx/can/can.h>
+#include <nuttx/compiler.h>
 #include <poll.h>
 #include <pthread.h>
 #include <sched.h>
 #include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "system/readline.h"
 
@@ -51,10 +59,952 @@
 #define FLAG_UNRECOGNIZED 2
 #define FLAG_GETOPT_ERR   4
 
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_RXBUFSIZE
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_RXBUFSIZE 2048
+#endif
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_OUTBUFSIZE
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_OUTBUFSIZE 2048
+#endif
+
+/* Longest line fmt_printf() renders, longest fmt_frame() tag, longest
+ * rendered frame, and the fill level above which frames are skipped
+ * (leaving room for status lines).
+ */
+
+#define FMT_LINE_MAX      128
+#define FMT_TAG_MAX       24
+#define FMT_FRAME_MAX     (FMT_TAG_MAX + 63 + 3 * CAN_MAXDATALEN)
+#define FMT_FRAME_LIMIT   (CONFIG_INDUSTRY_ETCETERA_CANTEST_OUTBUFSIZE * 3 / 4)
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE 4096
+#endif
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_TRIGGER_DEPTH
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_TRIGGER_DEPTH 256
+#endif
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_RTRING_BITS
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_RTRING_BITS 8
+#endif
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_CANTEST_IDTAB_BITS
+#  define CONFIG_INDUSTRY_ETCETERA_CANTEST_IDTAB_BITS 7
+#endif
+
+/* Per-ID hash tables (see idtab_find()) */
+
+#define IDTAB_BITS        CONFIG_INDUSTRY_ETCETERA_CANTEST_IDTAB_BITS
+#define IDTAB_SIZE        (1 << IDTAB_BITS)
+#define IDTAB_EMPTY       0xfffffffful
+#define IDTAB_EXT         (1ul << 31)
+
+/* Sniffer view: screen lines above the table, the mask type with one bit
+ * per payload byte, and the longest row (every byte highlighted on its
+ * own costs 10 characters).
+ */
+
+#define SNIFF_HEADER_LINES 2
+#define SNIFF_ALL_BYTES   ((sniff_mask_t)-1)
+#define SNIFF_ROW_MAX     (48 + 10 * CAN_MAXDATALEN)
+
+/* TX generator settings */
+
+#define TXGEN_BATCH_MAX   32
+
+#define TXGEN_ID_FIXED     0
+#define TXGEN_ID_INCREMENT 1
+#define TXGEN_ID_RANDOM    2
+
+#define TXGEN_DATA_ZERO    0
+#define TXGEN_DATA_COUNTER 1
+#define TXGEN_DATA_RANDOM  2
+#define TXGEN_DATA_FIXED   3
+
+/* Default interval between error-frame summaries */
+
+#define ERRSTATS_INTERVAL_MS 1000
+
+/* Most round trips the RTR benchmark records */
+
+#define RTRBENCH_MAX      1000
+
+/* Most IDs the filter optimizer accepts (and so most filters it emits) */
+
+#define FILTOPT_MAX_IDS   64
+
+/* Frames-per-read buckets of the RX queue latency mode: 1, 2-3, 4-7, ... */
+
+#define RXLAT_READ_BUCKETS 10
+
+/* Real-time receive mode: ring size (a power of two), receive thread
+ * poll() timeout, and printer thread sleep between drains
+ */
+
+#define RTRX_RING_SIZE    (1 << CONFIG_INDUSTRY_ETCETERA_CANTEST_RTRING_BITS)
+#define RTRX_TICK_MS      10
+#define RTRX_PRINT_MS     20
+
+/* Cyclic transmit scheduler: most messages in the table, longest sleep
+ * between stop checks, and delay before the first transmission
+ */
+
+#define CYCTX_MAX_MSGS    32
+#define CYCTX_MAX_SLEEP_MS 100
+#define CYCTX_LEAD_MS     10
+
+/* ISO-TP benchmark: protocol control information, flow status, N_Bs/N_Cr
+ * timeout, retransmissions per message, sender poll() period while waiting
+ * for flow control, and default IDs
+ */
+
+#define ISOTP_PAD         0xcc
+#define ISOTP_MAX_LEN     4095
+#define ISOTP_PCI_SF      0x00
+#define ISOTP_PCI_FF      0x10
+#define ISOTP_PCI_CF      0x20
+#define ISOTP_PCI_FC      0x30
+#define ISOTP_FC_CTS      0
+#define ISOTP_FC_WAIT     1
+#define ISOTP_FC_OVFL     2
+#define ISOTP_TIMEOUT_MS  1000
+#define ISOTP_MAX_RETRIES 3
+#define ISOTP_POLL_MS     10
+#define ISOTP_DATA_ID     0x6f0
+#define ISOTP_FC_ID       0x6f8
+
+#define ISOTP_ROLE_TX     (1 << 0)
+#define ISOTP_ROLE_RX     (1 << 1)
+
+/* Fuzz load test: largest DLC generated (with CAN FD, codes above 8 mean
+ * FD lengths), most controller IDs mixed in, status gap in periods that
+ * counts as a silence, report interval, and default status ID
+ */
+
+#ifdef CONFIG_CAN_FD
+#  define FUZZ_MAX_DLC    8
+#else
+#  define FUZZ_MAX_DLC    15
+#endif
+#define FUZZ_MAX_IDS      16
+#define FUZZ_SILENCE_PERIODS 10
+#define FUZZ_REPORT_MS    1000
+#define FUZZ_STATUS_ID    0x100
+
+/* Most filters remembered for setup info */
+
+#define FILTREC_MAX       32
+
+/* Bitrate sweep: test frame ID, most bitrates or sample points, and the
+ * pause after each bit timing change
+ */
+
+#define SWEEP_ID          0x7e1
+#define SWEEP_MAX_VALUES  8
+#define SWEEP_SETTLE_MS   20
+
+/* Wakeup stress test. Writers send STRESS_ID frames carrying a sequence
+ * number and their send time; sequence numbers are tracked in a bitmap.
+ */
+
+#define STRESS_ID         0x7f0
+#define STRESS_MAX_THREADS 8
+#define STRESS_MAX_SEQ    32768
+#define STRESS_POLL_TIMEOUT_MS 500
+
+/* Sequence check: counter values remembered per ID to tell duplicates
+ * from reordered frames
+ */
+
+#define SEQ_WINDOW        64
+
+/* Loopback self-test: test frame ID, most rate steps, and how long to
+ * wait for the last frames of a step
+ */
+
+#define SELFTEST_ID       0x7e0
+#define SELFTEST_MAX_STEPS 32
+#define SELFTEST_SETTLE_MS 50
+
+/* Gateway rule table size and rule actions */
+
+#define GW_MAX_RULES      16
+
+#define GW_PASS           0
+#define GW_DROP           1
+#define GW_REWRITE        2
+
+/* Trigger capture. TRIG_DEPTH frames are kept in g_trigring; the tick
+ * that detects gaps and dumps completed windows runs every TRIG_TICK_MS.
+ */
+
+#define TRIG_DEPTH        CONFIG_INDUSTRY_ETCETERA_CANTEST_TRIGGER_DEPTH
+#define TRIG_TICK_MS      10
+#define TRIG_DATA_MAX     8
+#define TRIG_NOFRAME      0xfffffffful
+#define TRIG_GAP_MARKER   "--- trigger: periodic ID missing ---\n"
+
+#define TRIG_MATCH        0  /* ID and data mask match */
+#define TRIG_ERROR        1  /* Error frame of a given class */
+#define TRIG_GAP          2  /* Periodic ID missing for too long */
+
+#define TRIG_IDLE         0
+#define TRIG_ARMED        1
+#define TRIG_POST         2  /* Fired, capturing post-trigger frames */
+#define TRIG_DONE         3  /* Window complete, waiting to be dumped */
+
+/* DBC decoder limits. The dispatch table has 2^DBC_HASH_BITS slots and
+ * must be comfortably larger than DBC_MAX_MESSAGES for a perfect hash to
+ * be found quickly.
+ */
+
+#define DBC_MAX_MESSAGES  32
+#define DBC_MAX_SIGNALS   128
+#define DBC_HASH_BITS     7
+#define DBC_HASH_ATTEMPTS 1000
+#define DBC_SLOT_EMPTY    0xff
+#define DBC_NAME_MAX      32
+#define DBC_UNIT_MAX      8
+#define DBC_LINE_MAX      160
+
+/* Longest rendered signal value: sign, ten digits, point and two decimals
+ * (values are clamped to what fits a 32-bit count of hundredths)
+ */
+
+#define DBC_VALUE_MAX     14
+
+/* Log2 latency histogram buckets (see lathist_add()) */
+
+#define LATHIST_BUCKETS   22
+
+/* Capture file format: a struct capture_filehdr_s followed by back-to-back
+ * struct capture_rec_s records, each CAPTURE_RECLEN(payload bytes) long.
+ * cr_dlc holds the data length code in its low bits plus the CAN FD flags;
+ * see capture_nbytes(). All fields are in the target's native byte order.
+ */
+
+#define CAPTURE_MAGIC     0x4e414343  /* "CCAN" read as little-endian */
+#define CAPTURE_VERSION   1
+
+#define CAPTURE_ID_EXT    (1ul << 31) /* Extended ID */
+#define CAPTURE_ID_RTR    (1ul << 30) /* Remote request */
+#define CAPTURE_ID_ERR    (1ul << 29) /* Error frame, ID holds CAN_ERROR_* */
+#define CAPTURE_ID_MASK   0x1ffffffful
+
+#define CAPTURE_DLC_FD    0x80        /* CAN FD frame */
+#define CAPTURE_DLC_BRS   0x40        /* Sent with bit rate switching */
+#define CAPTURE_DLC_MASK  0x0f
+#define CAPTURE_MAXDATA   64          /* Independent of CONFIG_CAN_FD */
+
+#define CAPTURE_RECLEN(nbytes) \
+  (offsetof(struct capture_rec_s, cr_data) + (nbytes))
+
+/* Replay: frames due within REPLAY_BATCH_US of the first frame of a batch
+ * go out in the same write(). The replay starts REPLAY_LEAD_US after the
+ * file is opened so the first deadlines are not already missed.
+ */
+
+#define REPLAY_BATCH_US   100
+#define REPLAY_LEAD_US    10000
+
+/* Replay reads the capture file through the whole capture double buffer,
+ * used as one flat buffer.
+ */
+
+#define REPLAY_BUFSIZE \
+  (2 * CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE)
+
+/* Longest CAN device path plus terminator ("/dev/can0" to "/dev/can9999"
+ * and similar) and most buses polled at once
+ */
+
+#define CANDEV_NAMELEN    16
+#define MULTIBUS_MAX      4
+
+/* Interval between statistics reports in the batched receive mode */
+
+#define RX_REPORT_MS      1000
+
 /****************************************************************************
  * Private Types
  ****************************************************************************/
 
+/* Console output formatter. Frames are rendered into buf and written out
+ * in one write() per batch.
+ */
+
+struct fmt_s
+{
+  char          buf[CONFIG_INDUSTRY_ETCETERA_CANTEST_OUTBUFSIZE];
+  size_t        len;
+  uint32_t      skipped;  /* Frames dropped because the console was behind */
+  int           oflags;   /* Console flags saved by fmt_begin() */
+  bool          nonblock;
+};
+
+/* Capture file header and records (see CAPTURE_MAGIC) */
+
+begin_packed_struct struct capture_filehdr_s
+{
+  uint32_t      cf_magic;       /* CAPTURE_MAGIC */
+  uint16_t      cf_version;     /* CAPTURE_VERSION */
+  uint16_t      cf_flags;       /* Reserved, 0 */
+} end_packed_struct;
+
+begin_packed_struct struct capture_rec_s
+{
+  uint32_t      cr_delta;       /* Microseconds since the previous record */
+  uint32_t      cr_id;          /* Message ID | CAPTURE_ID_* flags */
+  uint8_t       cr_dlc;         /* Data length code | CAPTURE_DLC_* */
+  uint8_t       cr_data[CAPTURE_MAXDATA];
+} end_packed_struct;
+
+/* State of a capture session. The receive loop fills one block of
+ * g_capbuf while the writer thread writes the other. Records straddle the
+ * block boundary, so every block but the last is written out whole.
+ */
+
+struct capture_s
+{
+  int           cs_fd;          /* Capture file */
+  int           cs_blk;         /* Block being filled */
+  size_t        cs_fill;        /* Bytes used in that block */
+  size_t        cs_len[2];      /* Bytes to write, per block */
+  sem_t         cs_full;        /* Blocks ready for the writer */
+  sem_t         cs_empty;       /* Blocks free for the receive loop */
+  uint64_t      cs_start_us;
+  uint64_t      cs_last_us;     /* Timestamp of the previous record */
+  uint32_t      cs_frames;      /* Frames recorded */
+  uint32_t      cs_dropped;     /* Frames dropped because both blocks were
+                                 * waiting to be written */
+  uint32_t      cs_overflows;   /* Driver RX overflow reports */
+  uint32_t      cs_written;     /* Bytes written (by the writer thread) */
+  int           cs_werror;      /* errno of a failed write, or 0 */
+};
+
+/* State of a replay session. Records are parsed in place from rp_buf. */
+
+struct replay_s
+{
+  int           rp_fd;          /* Capture file */
+  FAR uint8_t  *rp_buf;         /* REPLAY_BUFSIZE bytes (g_capbuf) */
+  size_t        rp_fill;        /* Bytes in the read buffer */
+  size_t        rp_pos;         /* Next record in the read buffer */
+  bool          rp_eof;
+  int           rp_error;       /* errno of a failed read, or 0 */
+};
+
+/* Per-ID row of the sniffer view */
+
+/* One bit per payload byte */
+
+#ifdef CONFIG_CAN_FD
+typedef uint64_t sniff_mask_t;
+#else
+typedef uint8_t sniff_mask_t;
+#endif
+
+struct sniffrow_s
+{
+  uint8_t       sr_data[CAN_MAXDATALEN]; /* Last payload */
+  uint8_t       sr_dlc;
+  uint8_t       sr_nbytes;      /* Payload length for sr_dlc */
+  bool          sr_rtr;
+  sniff_mask_t  sr_changed;     /* Bytes changed since the last repaint */
+  sniff_mask_t  sr_lit;         /* Bytes shown highlighted on screen */
+  int           sr_line;        /* Screen line of the row */
+  uint32_t      sr_count;
+};
+
+struct sniffer_s
+{
+  uint32_t      sn_keys[IDTAB_SIZE];
+  struct sniffrow_s sn_rows[IDTAB_SIZE];
+  uint64_t      sn_window_us;   /* Start of the current rate window */
+  uint32_t      sn_frames;      /* Frames in the current window */
+  uint32_t      sn_errframes;
+  uint32_t      sn_untracked;   /* Frames of IDs beyond sn_maxrows */
+  int           sn_nrows;       /* Rows assigned so far */
+  int           sn_maxrows;
+  bool          sn_clear;       /* Screen needs clearing */
+};
+
+/* Per-ID statistics kept by the "cantop" mode */
+
+struct idstat_s
+{
+  uint64_t      is_last_us;     /* Timestamp of the previous frame */
+  uint64_t      is_sum_us;      /* Sum of periods */
+  uint64_t      is_sumsq;       /* Sum of squared periods */
+  uint32_t      is_count;       /* Frames since the mode started */
+  uint32_t      is_window;      /* Frames since the last redraw */
+  uint32_t      is_min_us;
+  uint32_t      is_max_us;
+  uint8_t       is_dlc;         /* DLC of the most recent frame */
+};
+
+struct cantop_s
+{
+  uint32_t      ct_keys[IDTAB_SIZE];
+  struct idstat_s ct_stats[IDTAB_SIZE];
+  uint16_t      ct_order[IDTAB_SIZE]; /* Slots sorted for display */
+  uint64_t      ct_window_us;   /* Start of the current window */
+  uint64_t      ct_bits;        /* Bit times used in the current window */
+  uint32_t      ct_frames;      /* Frames in the current window */
+  uint32_t      ct_errframes;
+  uint32_t      ct_untracked;   /* Frames whose ID did not fit the table */
+  uint32_t      ct_bitrate;
+  int           ct_rows;
+};
+
+/* Settings and error counts for the TX traffic generator */
+
+struct txgen_s
+{
+  uint32_t      tg_id;          /* Base ID */
+  uint32_t      tg_idrange;     /* Distinct IDs for the non-fixed patterns */
+  uint32_t      tg_prng;        /* prng_next() state */
+  uint32_t      tg_lostarb;     /* Lost arbitration reports */
+  uint32_t      tg_txoverflow;  /* TX overflow reports */
+  uint32_t      tg_txtimeout;   /* TX timeout reports */
+  uint8_t       tg_idmode;      /* TXGEN_ID_* */
+  uint8_t       tg_payload;     /* TXGEN_DATA_* */
+  uint8_t       tg_fill;        /* Byte for TXGEN_DATA_FIXED */
+  uint8_t       tg_dlc;
+  bool          tg_extid;
+  bool          tg_fd;          /* Send CAN FD frames */
+  bool          tg_brs;         /* With bit rate switching */
+};
+
+/* Input and output of the filter optimizer */
+
+struct filtopt_s
+{
+  uint32_t      fo_ids[FILTOPT_MAX_IDS];   /* IDs to accept */
+  uint32_t      fo_fid[FILTOPT_MAX_IDS];   /* Filter IDs */
+  uint32_t      fo_fmask[FILTOPT_MAX_IDS]; /* Filter masks (1 = must match) */
+  uint32_t      fo_idmask;      /* All ID bits: CAN_MAX_STD/EXTMSGID */
+  int           fo_nids;
+  int           fo_nfilters;
+  int           fo_limit;       /* Filters available in the bank */
+  bool          fo_extended;
+};
+
+/* Error frame bit definitions and counters */
+
+struct errbit_s
+{
+  uint32_t      eb_bit;
+  FAR const char *eb_name;
+};
+
+struct errstats_s
+{
+  uint32_t      es_class[10];   /* Per CAN_ERROR_* bit */
+  uint32_t      es_ctrl[6];     /* Per CAN_ERROR1_* bit */
+  uint32_t      es_prot[8];     /* Per CAN_ERROR2_* bit */
+  uint32_t      es_frames;      /* Error frames since the last summary */
+  uint32_t      es_interval_ms; /* Minimum time between summaries */
+  uint64_t      es_last_report;
+  uint64_t      es_passive_since; /* Start of error-passive period, or 0 */
+  uint64_t      es_busoff_since;  /* Start of bus-off period, or 0 */
+  uint64_t      es_passive_us;  /* Completed error-passive time */
+  uint64_t      es_busoff_us;   /* Completed bus-off time */
+};
+
+/* Per-ID and global state of the sequence-checked receive mode */
+
+struct seqstat_s
+{
+  uint64_t      ss_window;      /* Bit n: counter value next - 1 - n seen */
+  uint32_t      ss_valid;       /* Window bits that are known; older values
+                                 * were never counted as lost */
+  uint32_t      ss_next;        /* Expected counter value */
+  uint32_t      ss_received;
+  int32_t       ss_lost;        /* Skipped values not (yet) seen late */
+  uint32_t      ss_dups;
+  uint32_t      ss_reordered;   /* Arrived after a later value */
+  uint32_t      ss_resets;      /* Counter jumped back past the window */
+};
+
+struct seqcheck_s
+{
+  uint32_t      sc_keys[IDTAB_SIZE];
+  struct seqstat_s sc_stats[IDTAB_SIZE];
+  struct seqstat_s sc_all;      /* With sc_shared */
+  FAR struct rx_loop_s *sc_rx;
+  uint32_t      sc_mask;        /* Counter modulus - 1 */
+  uint8_t       sc_offset;      /* Counter field position and format */
+  uint8_t       sc_width;
+  bool          sc_bigendian;
+  bool          sc_shared;      /* One counter across all IDs */
+  uint32_t      sc_short;       /* Frames too short for the field */
+  uint32_t      sc_untracked;
+  uint32_t      sc_overflows;   /* Driver RX overflow reports */
+  uint32_t      sc_loss_intervals;
+  uint32_t      sc_ovf_intervals;  /* ... of which with RX overflows */
+  uint32_t      sc_full_intervals; /* ... with full reads only */
+
+  /* Current report interval */
+
+  uint64_t      sc_last_us;
+  uint32_t      sc_last_frames;
+  uint32_t      sc_last_full;
+  int32_t       sc_wlost;
+  uint32_t      sc_wdups;
+  uint32_t      sc_woverflows;
+};
+
+/* Trigger capture ring entry and state */
+
+struct trig_ent_s
+{
+  uint64_t      te_ts_us;
+  struct can_msg_s te_msg;
+};
+
+struct trig_s
+{
+  int           tr_type;        /* TRIG_MATCH, TRIG_ERROR or TRIG_GAP */
+  int           tr_state;       /* TRIG_IDLE ... TRIG_DONE */
+  uint32_t      tr_key;         /* ID to match, in idtab_key() form */
+  uint32_t      tr_idmask;      /* Significant ID bits (TRIG_MATCH) */
+  uint8_t       tr_data[TRIG_DATA_MAX];
+  uint8_t       tr_dmask[TRIG_DATA_MAX];
+  uint32_t      tr_errclass;    /* CAN_ERROR_* bits (TRIG_ERROR) */
+  uint32_t      tr_gap_us;      /* Longest allowed period (TRIG_GAP) */
+  uint64_t      tr_last_us;     /* Previous frame of the periodic ID */
+  bool          tr_seen;        /* tr_last_us is valid */
+  bool          tr_rearm;
+  uint32_t      tr_head;        /* Next ring slot to write */
+  uint32_t      tr_count;       /* Valid ring entries */
+  uint32_t      tr_post;        /* Frames to capture after the trigger */
+  uint32_t      tr_remaining;   /* Post-trigger frames still to capture */
+  uint32_t      tr_trig_idx;    /* Ring slot of the trigger frame */
+  uint64_t      tr_trig_us;     /* Time of the trigger */
+  uint32_t      tr_fired;
+};
+
+/* Compiled DBC database. Signals of a message are stored contiguously. */
+
+struct dbc_sig_s
+{
+  uint64_t      ds_mask;        /* (1 << length) - 1 */
+  float         ds_factor;
+  float         ds_offset;
+  uint8_t       ds_shift;       /* Right shift of the payload word */
+  uint8_t       ds_len;
+  bool          ds_bigendian;   /* Extract from the big-endian word */
+  bool          ds_signed;
+  char          ds_name[DBC_NAME_MAX];
+  char          ds_unit[DBC_UNIT_MAX];
+};
+
+struct dbc_msg_s
+{
+  uint32_t      dm_key;         /* ID, with IDTAB_EXT for extended IDs */
+  uint16_t      dm_first;       /* Index of the first signal */
+  uint16_t      dm_nsigs;
+  uint16_t      dm_textmax;     /* Longest decoded line */
+  char          dm_name[DBC_NAME_MAX];
+};
+
+struct dbc_s
+{
+  struct dbc_msg_s db_msgs[DBC_MAX_MESSAGES];
+  struct dbc_sig_s db_sigs[DBC_MAX_SIGNALS];
+  uint8_t       db_slots[1 << DBC_HASH_BITS]; /* Hash slot to message */
+  uint32_t      db_mult;        /* Perfect hash multiplier */
+  uint32_t      db_unknown;     /* Frames with IDs not in the file */
+  int           db_nmsgs;
+  int           db_nsigs;
+};
+
+/* Latency histogram with log2 buckets */
+
+struct lathist_s
+{
+  uint32_t      lh_buckets[LATHIST_BUCKETS];
+  uint32_t      lh_count;
+  uint32_t      lh_min;
+  uint32_t      lh_max;
+  uint64_t      lh_sum;
+};
+
+/* One rate step of the loopback self-test */
+
+struct selftest_step_s
+{
+  uint32_t      st_rate;        /* Offered frames/s */
+  uint32_t      st_ms;          /* Duration */
+  uint32_t      st_first_seq;   /* Sequence number of the first frame */
+  uint32_t      st_sent;
+  uint32_t      st_received;
+  uint32_t      st_stray;       /* Late frames from an earlier step */
+  uint32_t      st_txfull;      /* write() found the TX queue full */
+  uint32_t      st_overflows;   /* Driver RX overflow reports */
+  uint64_t      st_elapsed_us;
+  struct lathist_s st_latency;
+};
+
+/* RX queue latency mode. The rl_count/sum/max/peak fields cover the
+ * current report interval.
+ */
+
+struct rxlat_s
+{
+  struct lathist_s rl_total;    /* Timestamp to read() delay */
+  uint32_t      rl_perread[RXLAT_READ_BUCKETS];
+  uint32_t      rl_count;
+  uint64_t      rl_sum;
+  uint32_t      rl_max;
+  uint32_t      rl_peak;        /* Most frames returned by one read() */
+  uint32_t      rl_peak_total;
+  uint32_t      rl_future;      /* Timestamps later than the read */
+  uint32_t      rl_overflows;   /* Driver RX overflow reports */
+};
+
+/* Real-time receive mode. rt_head is written only by the receive thread
+ * and rt_tail only by the printer thread; the counters are read after
+ * both threads have been joined.
+ */
+
+struct rtrx_s
+{
+  atomic_uint   rt_head;        /* Next slot the receive thread fills */
+  atomic_uint   rt_tail;        /* Next slot the printer consumes */
+  atomic_bool   rt_stop;
+  pthread_t     rt_receiver;
+  pthread_t     rt_printer;
+  int           rt_canfd;
+  int           rt_error;       /* errno that stopped the receive thread */
+  bool          rt_print;       /* Print frames, or only count them */
+  uint32_t      rt_frames;
+  uint32_t      rt_wakeups;     /* poll() returns with frames pending */
+  uint32_t      rt_dropped;     /* Ring full */
+  uint32_t      rt_peak;        /* Highest ring fill */
+  struct lathist_s rt_timer;    /* poll() timeout lateness */
+  struct lathist_s rt_wakeup;   /* Frame timestamp to thread running */
+};
+
+/* Cyclic transmit scheduler. ct_heap holds indexes into ct_msgs ordered
+ * as a min-heap by cm_due; only the scheduler thread touches it.
+ */
+
+struct cyctx_msg_s
+{
+  struct can_msg_s cm_msg;
+  uint32_t      cm_period_us;
+  uint32_t      cm_offset_us;
+  uint64_t      cm_due;         /* Next nominal transmission time */
+  uint64_t      cm_last_us;     /* Previous actual transmission, or 0 */
+  uint32_t      cm_sent;
+  uint32_t      cm_missed;      /* Skipped periods and rejected frames */
+  uint64_t      cm_jitter_sum;  /* Sum of |interval - period| */
+  uint32_t      cm_jitter_max;
+  uint32_t      cm_late_max;    /* Worst send time after due time */
+};
+
+struct cyctx_s
+{
+  struct cyctx_msg_s ct_msgs[CYCTX_MAX_MSGS];
+  uint8_t       ct_heap[CYCTX_MAX_MSGS];
+  int           ct_nmsgs;
+  int           ct_canfd;
+  uint32_t      ct_tick_us;     /* Frames due this close together share a
+                                 * write() */
+  atomic_bool   ct_stop;
+  pthread_t     ct_thread;
+  uint32_t      ct_frames;
+  uint32_t      ct_writes;
+  uint32_t      ct_txfull;      /* Frames the TX queue did not accept */
+  struct lathist_s ct_late;
+};
+
+/* ISO-TP benchmark. Everything before it_canfd is cleared between sweep
+ * runs; the fields from it_canfd on are the configuration.
+ */
+
+enum isotp_tx_state_e
+{
+  ISOTP_TX_IDLE = 0,            /* First frame not yet accepted */
+  ISOTP_TX_WAIT_FC,
+  ISOTP_TX_SENDING,
+  ISOTP_TX_RETRY,               /* Timed out or aborted: send again */
+  ISOTP_TX_DONE,
+  ISOTP_TX_FAILED               /* Given up after ISOTP_MAX_RETRIES */
+};
+
+enum isotp_rx_state_e
+{
+  ISOTP_RX_IDLE = 0,
+  ISOTP_RX_RECEIVING
+};
+
+struct isotp_tx_s
+{
+  enum isotp_tx_state_e tx_state;
+  uint32_t      tx_msgno;
+  int           tx_offset;      /* Payload bytes sent */
+  uint8_t       tx_sn;          /* Next sequence number */
+  uint8_t       tx_bs;          /* Block size from flow control */
+  int           tx_block_left;
+  uint32_t      tx_stmin_us;
+  uint64_t      tx_next_cf;     /* Earliest time for the next CF */
+  uint64_t      tx_deadline;    /* Flow control timeout (N_Bs) */
+  int           tx_retries;
+};
+
+struct isotp_rx_s
+{
+  enum isotp_rx_state_e rx_state;
+  int           rx_len;
+  int           rx_got;
+  uint8_t       rx_sn;
+  uint8_t       rx_msgno;       /* From the first payload byte */
+  bool          rx_corrupt;
+  int           rx_block_left;
+  uint64_t      rx_deadline;    /* Consecutive frame timeout (N_Cr) */
+};
+
+struct isotp_s
+{
+  struct isotp_tx_s it_tx;
+  struct isotp_rx_s it_rx;
+  uint64_t      it_start;
+  uint64_t      it_tx_end;
+  uint64_t      it_tx_bytes;
+  uint64_t      it_rx_first;    /* First frame received */
+  uint64_t      it_rx_last;     /* Last message completed */
+  uint64_t      it_rx_bytes;    /* Payload received intact */
+  uint32_t      it_rx_msgs;
+  uint32_t      it_corrupt;     /* Messages failing the pattern check */
+  uint32_t      it_seq_errors;
+  uint32_t      it_len_errors;  /* SF/FF with an invalid length */
+  uint32_t      it_rx_aborted;  /* Receptions abandoned part way */
+  uint32_t      it_retries;     /* Messages sent again */
+  uint32_t      it_timeouts;    /* Flow control not received in time */
+  uint32_t      it_aborts;      /* Overflow flow status received */
+  uint32_t      it_failed;      /* Messages given up after retries */
+  uint32_t      it_fc_waits;
+  uint32_t      it_frames;
+  uint32_t      it_txfull;      /* Frames the TX queue did not accept */
+
+  int           it_canfd;
+  uint32_t      it_tx_id;       /* Data frames */
+  uint32_t      it_rx_id;       /* Flow control frames */
+  int           it_msglen;
+  uint32_t      it_nmsgs;
+  uint8_t       it_bs;          /* Flow control sent by the receiver */
+  uint8_t       it_stmin;
+};
+
+/* Fuzz load test settings, generator state and counters */
+
+struct fuzz_s
+{
+  uint32_t      fz_seed;
+  uint32_t      fz_prng;        /* prng_next() state */
+  uint32_t      fz_bitrate;
+  uint32_t      fz_ids[FUZZ_MAX_IDS];   /* Controller IDs to mix in */
+  int           fz_nids;
+  uint32_t      fz_id_pct;      /* Share of frames using fz_ids */
+  uint32_t      fz_status_id;
+  bool          fz_status_ext;
+  uint32_t      fz_period_us;
+  int           fz_counter;     /* Status counter byte, or -1 */
+
+  uint32_t      fz_generated;
+  uint32_t      fz_ext;
+  uint32_t      fz_rtr;
+  uint32_t      fz_sent;
+  uint32_t      fz_txfull;      /* Frames the TX queue did not accept */
+  uint64_t      fz_bits;        /* Bit times of the frames sent */
+
+  uint32_t      fz_status;      /* Status frames received */
+  uint64_t      fz_status_last;
+  uint8_t       fz_count_last;
+  bool          fz_have_count;
+  uint32_t      fz_missed;      /* Periods without a status frame */
+  uint32_t      fz_resets;      /* Counter stood still or jumped ahead */
+  uint32_t      fz_silences;
+  uint32_t      fz_max_gap;
+  struct lathist_s fz_jitter;   /* |gap - period| */
+
+  uint32_t      fz_errframes;
+  uint32_t      fz_lostarb;
+  uint32_t      fz_rxoverflow;
+  uint32_t      fz_txoverflow;
+  uint32_t      fz_busoff;
+};
+
+/* A filter added during this session */
+
+struct filtrec_s
+{
+  uint32_t      fr_id1;
+  uint32_t      fr_id2;         /* Mask, second ID or range end */
+  int           fr_index;       /* Filter number returned by the driver */
+  uint8_t       fr_type;        /* CAN_FILTER_* */
+  bool          fr_extended;
+  bool          fr_used;
+};
+
+/* One step of the bitrate sweep */
+
+struct sweep_res_s
+{
+  uint32_t      sr_rate;        /* Frames/s to send */
+  uint32_t      sr_ms;          /* Duration */
+  uint32_t      sr_sent;
+  uint32_t      sr_txfail;      /* write() failed, e.g. TX queue full */
+  uint32_t      sr_received;    /* Data frames from other nodes */
+  uint32_t      sr_errframes;
+  uint32_t      sr_noack;       /* Error frames reporting no ACK */
+  uint32_t      sr_busoff;      /* Error frames reporting bus-off */
+};
+
+/* Gateway filter/rewrite rule. IDs are in idtab_key() form. */
+
+struct gw_rule_s
+{
+  uint32_t      gr_key;
+  uint32_t      gr_mask;        /* Significant bits of gr_key */
+  uint32_t      gr_newkey;      /* Replacement ID (GW_REWRITE) */
+  uint8_t       gr_dirs;        /* Bit 0: A to B, bit 1: B to A */
+  uint8_t       gr_action;      /* GW_PASS, GW_DROP or GW_REWRITE */
+};
+
+/* One side of the gateway. Statistics are for frames received here. */
+
+struct gw_port_s
+{
+  int           gp_fd;
+  FAR uint8_t  *gp_buf;         /* This port's share of g_rxbuf */
+  size_t        gp_bufsize;
+  uint32_t      gp_rx;
+  uint32_t      gp_fwd;
+  uint32_t      gp_wfwd;        /* Forwarded since the last report */
+  uint32_t      gp_filtered;    /* Dropped by a rule */
+  uint32_t      gp_txdrop;      /* Dropped because the other TX was full */
+  uint32_t      gp_errframes;
+  uint32_t      gp_wakeups;     /* Wakeups that found frames queued */
+  uint32_t      gp_depth_sum;   /* Frames drained, summed over wakeups */
+  uint32_t      gp_max_depth;   /* Most frames drained in one wakeup */
+  uint32_t      gp_full_reads;
+  struct lathist_s gp_latency;
+};
+
+struct gateway_s
+{
+  struct gw_port_s gw_ports[2];
+  struct gw_rule_s gw_rules[GW_MAX_RULES];
+  int           gw_nrules;
+  bool          gw_default_pass; /* Forward frames matching no rule */
+  uint64_t      gw_report_us;
+};
+
+/* One bus of a multi-bus receive session. md_buf is the bus's share of
+ * g_rxbuf, holding what the last read() returned.
+ */
+
+struct multibus_dev_s
+{
+  char          md_name[CANDEV_NAMELEN];
+  int           md_fd;
+  FAR uint8_t  *md_buf;
+  size_t        md_bufsize;
+  size_t        md_len;         /* Bytes returned by the last read() */
+  size_t        md_offset;      /* Next unmerged frame in md_buf */
+  uint64_t      md_read_us;     /* When the last read() returned */
+  uint64_t      md_bits;        /* Bit times since the last report */
+  uint32_t      md_frames;      /* Frames since the last report */
+  uint32_t      md_errors;      /* Error frames since the last report */
+  uint32_t      md_bitrate;
+};
+
+struct multibus_s
+{
+  struct multibus_dev_s mb_devs[MULTIBUS_MAX];
+  int           mb_ndevs;
+  uint64_t      mb_report_us;
+};
+
+/* Wakeup stress test state */
+
+struct stress_s;
+
+struct stress_thread_s
+{
+  pthread_t     th_thread;
+  FAR struct stress_s *th_test;
+  FAR const char *th_role;
+  volatile bool th_done;        /* Reader/poller has exited */
+  uint32_t      th_frames;      /* Frames consumed or sent */
+  uint32_t      th_wakeups;     /* poll()/read() returns with data */
+  uint32_t      th_missed;      /* poll() timeouts with frames queued */
+  uint32_t      th_errors;
+  uint32_t      th_overflows;   /* RX overflow reports seen */
+  struct lathist_s th_latency;
+  uint8_t       th_buf[8 * CAN_MSGLEN(CAN_MAXDATALEN)];
+};
+
+struct stress_s
+{
+  int           ss_fd;
+  volatile bool ss_stop;
+  uint32_t      ss_rate;        /* Frames/s per writer */
+  uint64_t      ss_start_us;
+  uint64_t      ss_end_us;
+  pthread_mutex_t ss_lock;      /* Protects the fields below */
+  uint32_t      ss_sent;        /* Next sequence number */
+  volatile uint32_t ss_received;
+  uint32_t      ss_duplicates;
+  uint32_t      ss_seen[STRESS_MAX_SEQ / 32];
+  struct stress_thread_s ss_threads[STRESS_MAX_THREADS];
+};
+
+/* Callbacks used by rx_loop(). on_batch is handed the raw buffer returned
+ * by each read(), on_frame is called once for every frame in it, and on_tick
+ * is called every tick_ms milliseconds (if tick_ms is nonzero).
+ */
+
+typedef void (*rx_batch_cb_t)(FAR uint8_t *buf, int buflen, FAR void *arg);
+typedef void (*rx_frame_cb_t)(FAR const struct can_msg_s *msg,
+                              uint64_t ts_us, FAR void *arg);
+typedef void (*rx_tick_cb_t)(uint64_t now_us, FAR void *arg);
+
+struct rx_loop_s
+{
+  int           canfd;
+  uint32_t      tick_ms;
+  rx_batch_cb_t on_batch;
+  rx_frame_cb_t on_frame;
+  rx_tick_cb_t  on_tick;
+  FAR void     *arg;
+
+  /* Running totals, updated by rx_loop() */
+
+  uint32_t      wakeups;        /* poll() wakeups with frames pending */
+  uint32_t      reads;          /* Successful read() calls */
+  uint32_t      frames;         /* Frames drained */
+  uint32_t      bytes;          /* Bytes returned by read() */
+  uint64_t      payload;        /* Payload bytes of the frames drained */
+  uint32_t      max_per_wakeup; /* Most frames drained in one wakeup */
+  uint32_t      full_reads;     /* Reads that filled the whole buffer */
+};
+
+struct rx_rate_s
+{
+  FAR struct rx_loop_s *rx;
+  bool          print;
+  uint64_t      last_us;
+  uint32_t      last_frames;
+  uint32_t      last_wakeups;
+  uint64_t      last_payload;
+  uint32_t      overflows;
+};
 
 /****************************************************************************
  * Private Function Prototypes
@@ -66,21 +1016,303 @@ int nsh_main(int argc, char **argv);
 
 static void print_help(void);
 static int filter_candevs(const struct dirent *file);
+static void fmt_begin(void);
+static void fmt_end(void);
+static void fmt_flush(bool all);
+static FAR char *fmt_reserve(size_t len, size_t limit);
+static void fmt_puts(FAR const char *str);
+static void fmt_printf(FAR const char *format, ...);
+static FAR char *fmt_dec(FAR char *dst, uint32_t val);
+static void fmt_frame(FAR const struct can_msg_s *msg,
+                      FAR const char *tag);
 #ifdef CONFIG_CAN_ERRORS
-static void print_errframe(const struct can_msg_s *msg);
+static void errstats_count(FAR const struct errbit_s *table,
+                           FAR uint32_t *counts, uint32_t bits);
+static void errstats_add(FAR struct errstats_s *es,
+                         FAR const struct can_msg_s *msg, uint64_t ts_us);
+static void errstats_recovered(FAR struct errstats_s *es, uint64_t ts_us);
+static void errstats_print_bits(FAR const char *title,
+                                FAR const struct errbit_s *table,
+                                FAR uint32_t *counts);
+static void errstats_report(FAR struct errstats_s *es, uint64_t now,
+                            bool force);
+static void errstats_reset(FAR struct errstats_s *es);
+static void errmon_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                         FAR void *arg);
+static void errmon_tick(uint64_t now, FAR void *arg);
 #endif
+static void test_error_monitor(int canfd);
+static int can_set_loopback(int canfd, bool enable,
+                            FAR struct canioc_connmodes_s *saved);
+static void stress_consume(FAR struct stress_thread_s *thd,
+                           FAR uint8_t *buf, int buflen, uint64_t poll_us,
+                           uint64_t read_us);
+static FAR void *stress_reader(FAR void *arg);
+static FAR void *stress_poller(FAR void *arg);
+static FAR void *stress_writer(FAR void *arg);
+static int stress_start(FAR struct stress_thread_s *thd,
+                        FAR void *(*entry)(FAR void *), int priority);
+static void test_poll_stress(int canfd);
+static inline uint32_t dbc_hash(uint32_t key, uint32_t mult);
+static int dbc_build_hash(FAR struct dbc_s *dbc);
+static int dbc_add_signal(FAR struct dbc_s *dbc, int start, int len,
+                          bool bigendian, bool is_signed, float factor,
+                          float offset, FAR const char *name,
+                          FAR const char *unit);
+static int dbc_load(FAR const char *path);
+static inline int64_t dbc_extract(FAR const struct dbc_sig_s *sig,
+                                  uint64_t le, uint64_t be);
+static void dbc_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                      FAR void *arg);
+static void dbc_tick(uint64_t now, FAR void *arg);
+static void test_dbc_decode(int canfd);
+static int prompt_hexbytes(FAR const char *prompt, FAR uint8_t *buf,
+                           int max);
+static bool trig_match(FAR struct trig_s *tr,
+                       FAR const struct can_msg_s *msg, uint64_t ts_us);
+static void trig_fire(FAR struct trig_s *tr, uint64_t ts_us,
+                      uint32_t index);
+static void trig_dump(FAR struct trig_s *tr);
+static void trig_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                       FAR void *arg);
+static void trig_tick(uint64_t now, FAR void *arg);
+static void test_trigger_capture(int canfd);
+static bool gw_route(FAR struct gateway_s *gw, int dir,
+                     FAR struct can_msg_s *msg);
+static void gw_flush(FAR struct gw_port_s *in, FAR struct gw_port_s *out,
+                     size_t len, int nmsgs, FAR const uint64_t *ts);
+static int gw_forward(FAR struct gateway_s *gw, int dir);
+static void gw_read_rules(FAR struct gateway_s *gw);
+static void gw_report(FAR struct gateway_s *gw, uint64_t now, bool final);
+static void test_gateway(int canfd);
+static bool seq_extract(FAR const struct seqcheck_s *sc,
+                        FAR const struct can_msg_s *msg,
+                        FAR uint32_t *seq);
+static void seq_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                      FAR void *arg);
+static void seq_tick(uint64_t now, FAR void *arg);
+static void test_seq_receive(int canfd);
+static void selftest_drain(int canfd, FAR struct selftest_step_s *step);
+static void selftest_step(int canfd, FAR struct selftest_step_s *step,
+                          FAR uint32_t *seq);
+static void test_loopback_selftest(int canfd);
+static void filtrec_add(bool extended, int index, uint32_t id1, uint32_t id2,
+                        uint8_t type);
+static void filtrec_del(bool extended, int index);
+static void print_bittiming(FAR const struct canioc_bittiming_s *bt);
+static int prompt_list(FAR const char *prompt, FAR const char *def,
+                       FAR long *vals, int max);
+static void sweep_step(int canfd, FAR struct sweep_res_s *res);
+static void test_bitrate_sweep(int canfd,
+                               FAR const struct canioc_bittiming_s *orig);
+static void test_setup_info(int canfd);
+#ifdef CONFIG_CAN_TIMESTAMP
+static void rxlat_batch(FAR uint8_t *buf, int buflen, FAR void *arg);
+static void rxlat_tick(uint64_t now, FAR void *arg);
+#endif
+static void test_rx_latency(int canfd);
+static int fifo_thread_start(FAR pthread_t *thread,
+                             FAR void *(*entry)(FAR void *), FAR void *arg,
+                             int priority);
+static void rtrx_push(FAR struct rtrx_s *rt, FAR const struct can_msg_s *msg);
+static FAR void *rtrx_receiver(FAR void *arg);
+static FAR void *rtrx_printer(FAR void *arg);
+static void test_rt_receive(int canfd);
+static void cyctx_sift_down(FAR struct cyctx_s *ct, int i);
+static void cyctx_send(FAR struct cyctx_s *ct, uint64_t now);
+static FAR void *cyctx_thread(FAR void *arg);
+static int cyctx_read_table(FAR struct cyctx_s *ct);
+static void cyctx_report(FAR struct cyctx_s *ct, uint64_t elapsed_us);
+static void test_cyclic_tx(int canfd);
+static uint32_t isotp_stmin_us(uint8_t stmin);
+static uint8_t isotp_stmin_byte(uint32_t us);
+static int isotp_send(FAR struct isotp_s *it, uint32_t id,
+                      FAR const uint8_t *data, int len);
+static void isotp_tx_start(FAR struct isotp_s *it, uint64_t now);
+static void isotp_tx_fc(FAR struct isotp_s *it,
+                        FAR const struct can_msg_s *msg, uint64_t now);
+static void isotp_tx_poll(FAR struct isotp_s *it, uint64_t now);
+static void isotp_rx_check(FAR struct isotp_s *it,
+                           FAR const uint8_t *data, int n);
+static void isotp_rx_done(FAR struct isotp_s *it, uint64_t now);
+static void isotp_send_fc(FAR struct isotp_s *it, uint64_t now);
+static void isotp_rx_frame(FAR struct isotp_s *it,
+                           FAR const struct can_msg_s *msg, uint64_t now);
+static int isotp_run(FAR struct isotp_s *it, int roles);
+static uint32_t isotp_report(FAR const struct isotp_s *it, int roles);
+static void test_isotp(int canfd);
+static void fuzz_fill(FAR struct fuzz_s *fz, FAR struct can_msg_s *msg);
+static void fuzz_status(FAR struct fuzz_s *fz,
+                        FAR const struct can_msg_s *msg, uint64_t ts);
+static void fuzz_receive(int canfd, FAR struct fuzz_s *fz);
+static void fuzz_report(FAR const struct fuzz_s *fz, uint64_t now,
+                        uint64_t start);
+static void test_fuzz_load(int canfd);
 static void print_canmsgs(uint8_t *msgs, int buflen);
 static void test_basic_receive(const int canfd);
+static uint64_t now_us(void);
+static uint64_t rx_frame_time(FAR const struct can_msg_s *msg,
+                              uint64_t read_us);
+static int rx_read_stdin_quit(void);
+static int rx_loop(FAR struct rx_loop_s *rx);
+static void test_batched_receive(int canfd);
+static FAR void *capture_writer(FAR void *arg);
+static void capture_pass(FAR struct capture_s *cap);
+static void capture_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                          FAR void *arg);
+static void capture_tick(uint64_t now, FAR void *arg);
+static int run_capture(int canfd, FAR const char *path);
+static uint8_t capture_nbytes(uint8_t cr_dlc);
+static FAR const struct capture_rec_s *
+replay_next(FAR struct replay_s *rp);
+static size_t replay_msg(FAR const struct capture_rec_s *rec,
+                         FAR struct can_msg_s *msg);
+static int run_replay(int canfd, FAR const char *path, uint32_t speed);
+static long prompt_long(FAR const char *prompt, long def);
+static uint32_t isqrt64(uint64_t val);
+static inline uint8_t canmsg_nbytes(FAR const struct can_msg_s *msg);
+static uint32_t canmsg_bits(FAR const struct can_msg_s *msg);
+static uint32_t prng_next(FAR uint32_t *state);
+static void lathist_add(FAR struct lathist_s *hist, uint32_t us);
+static void lathist_print(FAR const struct lathist_s *hist,
+                          FAR const char *name);
+static int idtab_find(FAR uint32_t *keys, uint32_t key, bool insert);
+static uint32_t idtab_key(FAR const struct can_msg_s *msg);
+static void test_cantop(int canfd);
+static void sniffer_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                          FAR void *arg);
+static bool sniffer_row(uint32_t key, FAR const struct sniffrow_s *row,
+                        sniff_mask_t lit);
+static void sniffer_tick(uint64_t now, FAR void *arg);
+static void test_sniffer(int canfd);
+static int find_candevs(char names[][CANDEV_NAMELEN], int max);
+static void multibus_report(FAR struct multibus_s *mb, uint64_t now);
+static int multibus_drain(FAR struct multibus_dev_s *bus);
+static FAR struct can_msg_s *multibus_next(FAR struct multibus_dev_s *bus,
+                                           FAR uint64_t *ts_us);
+static int test_multibus(char names[][CANDEV_NAMELEN], int ndevs);
 static void test_add_std_filter(int canfd);
 static int parse_mask(const char *msk, void *fltr_ptr, bool extended);
 static void test_rtr_transaction(int canfd);
+static void test_tx_generator(int canfd);
+static int rtrbench_compare(FAR const void *a, FAR const void *b);
+static void test_rtr_benchmark(int canfd);
+static uint32_t filtopt_wanted(FAR const struct filtopt_s *opt,
+                               uint32_t id, uint32_t mask);
+static uint64_t filtopt_unwanted(FAR const struct filtopt_s *opt,
+                                 uint32_t id, uint32_t mask);
+static void filtopt_compile(FAR struct filtopt_s *opt);
+static int filtopt_read_ids(FAR struct filtopt_s *opt);
+static void test_filter_optimizer(int canfd);
 
 /****************************************************************************
  * Private Data
  ****************************************************************************/
 
+/* Releases the stress test threads together */
+
 static sem_t g_poll_test_sem;
 
+static struct fmt_s g_fmt;
+static const char g_hexdigits[] = "0123456789abcdef";
+
+/* Payload bytes for each CAN FD data length code. The capture file format
+ * uses this mapping regardless of CONFIG_CAN_FD.
+ */
+
+static const uint8_t g_dlc2bytes[16] =
+{
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+#ifdef CONFIG_CAN_ERRORS
+static struct errstats_s g_errstats;
+
+static const struct errbit_s g_errclass_bits[] =
+{
+  { CAN_ERROR_TXTIMEOUT,    "TX timeout" },
+  { CAN_ERROR_LOSTARB,      "Lost arbitration" },
+  { CAN_ERROR_CONTROLLER,   "Controller" },
+  { CAN_ERROR_PROTOCOL,     "Protocol" },
+  { CAN_ERROR_TRANSCEIVER,  "Transceiver" },
+  { CAN_ERROR_NOACK,        "No ACK" },
+  { CAN_ERROR_BUSOFF,       "Bus off" },
+  { CAN_ERROR_BUSERROR,     "Bus error" },
+  { CAN_ERROR_RESTARTED,    "Restarted" },
+  { CAN_ERROR_INTERNAL,     "Stack-internal" },
+  { 0, NULL }
+};
+
+static const struct errbit_s g_errctrl_bits[] =
+{
+  { CAN_ERROR1_RXOVERFLOW,  "RX overflow" },
+  { CAN_ERROR1_TXOVERFLOW,  "TX overflow" },
+  { CAN_ERROR1_RXWARNING,   "RX warning" },
+  { CAN_ERROR1_TXWARNING,   "TX warning" },
+  { CAN_ERROR1_RXPASSIVE,   "RX passive" },
+  { CAN_ERROR1_TXPASSIVE,   "TX passive" },
+  { 0, NULL }
+};
+
+static const struct errbit_s g_errprot_bits[] =
+{
+  { CAN_ERROR2_BIT,         "Single bit" },
+  { CAN_ERROR2_FORM,        "Framing format" },
+  { CAN_ERROR2_STUFF,       "Bit stuffing" },
+  { CAN_ERROR2_BIT0,        "Send dominant failed" },
+  { CAN_ERROR2_BIT1,        "Send recessive failed" },
+  { CAN_ERROR2_OVERLOAD,    "Bus overload" },
+  { CAN_ERROR2_ACTIVE,      "Active error announcement" },
+  { CAN_ERROR2_TX,          "General TX" },
+  { 0, NULL }
+};
+#endif
+
+/* Shared by all receive modes built on rx_loop() */
+
+static uint8_t g_rxbuf[CONFIG_INDUSTRY_ETCETERA_CANTEST_RXBUFSIZE]
+  aligned_data(4);
+
+/* Capture double buffer. Aligned so that block writes to the SD card do
+ * not need to be bounced by the driver.
+ */
+
+static uint8_t g_capbuf[2][CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE]
+  aligned_data(32);
+
+static struct cantop_s g_cantop;
+static struct sniffer_s g_sniffer;
+
+static struct multibus_s g_multibus;
+
+static struct stress_s g_stress;
+
+static struct dbc_s g_dbc;
+
+static struct trig_s g_trig;
+static struct trig_ent_s g_trigring[TRIG_DEPTH];
+
+static struct gateway_s g_gateway;
+static struct seqcheck_s g_seqcheck;
+static struct selftest_step_s g_selftest;
+static struct selftest_step_s g_selftest_best;
+
+static uint32_t g_rtr_samples[RTRBENCH_MAX];
+
+static struct filtopt_s g_filtopt;
+static struct filtrec_s g_filtrec[FILTREC_MAX];
+#ifdef CONFIG_CAN_TIMESTAMP
+static struct rxlat_s g_rxlat;
+#endif
+static struct rtrx_s g_rtrx;
+static struct can_msg_s g_rtrxring[RTRX_RING_SIZE];
+static struct cyctx_s g_cyctx;
+static struct isotp_s g_isotp;
+static struct fuzz_s g_fuzz;
+
+static uint8_t g_txbuf[TXGEN_BATCH_MAX * CAN_MSGLEN(CAN_MAXDATALEN)]
+  aligned_data(4);
+
 /****************************************************************************
  * Public Data
  ****************************************************************************/
@@ -101,9 +1333,22 @@ static void print_help(void)
 {
   printf( "cantest - validate NuttX CAN drivers and the ETCetera CAN support.\n"
           "Usage: cantest [--help|-h] [--dev|-d <device>]\n"
-          "       --help: Print this information.\n"
-          "       --dev:  Use CAN device <device>. The default behavior is to\n"
-          "               search /dev and select the first available device.\n");
+          "               [--capture|-c <file>] [--all|-a]\n"
+          "               [--replay|-r <file> [--speed|-s <percent>]]\n"
+          "       --help:    Print this information.\n"
+          "       --dev:     Use CAN device <device>. The default is to\n"
+          "                  search /dev and select the first available\n"
+          "                  device.\n"
+          "       --capture: Record received frames to <file> in binary\n"
+          "                  capture format instead of showing the menu.\n"
+          "       --all:     Receive from every CAN device in /dev at once,\n"
+          "                  merging the frames in timestamp order, instead\n"
+          "                  of showing the menu.\n"
+          "       --replay:  Transmit the frames of a capture <file> with\n"
+          "                  their recorded timing instead of showing the\n"
+          "                  menu.\n"
+          "       --speed:   Replay speed in percent of real time (default\n"
+          "                  100).\n");
 }
 
 /****************************************************************************
@@ -132,790 +1377,9273 @@ static int filter_candevs(const struct dirent *file)
 }
 
 /****************************************************************************
- * Name: print_errframe
+ * Name: fmt_begin
  *
  * Description:
- *   Prints human-readable error messages for the frame to standard output.
+ *   Puts the console into non-blocking mode for the duration of a receive
+ *   session so that a slow serial or telnet console can never stall frame
+ *   capture. Frames that do not fit in the output buffer are skipped and
+ *   counted instead.
+ ****************************************************************************/
+
+static void fmt_begin(void)
+{
+  fflush(stdout);
+
+  g_fmt.len = 0;
+  g_fmt.skipped = 0;
+  g_fmt.oflags = fcntl(STDOUT_FILENO, F_GETFL);
+
+  if (g_fmt.oflags >= 0 &&
+      fcntl(STDOUT_FILENO, F_SETFL, g_fmt.oflags | O_NONBLOCK) >= 0)
+    {
+      g_fmt.nonblock = true;
+    }
+}
+
+/****************************************************************************
+ * Name: fmt_end
  *
- * Input parameters:
- *   msg - Pointer to struct can_msg_s with msg->cm_hdr.ch_error set.
+ * Description:
+ *   Writes out whatever is still buffered, restores blocking console output
+ *   and reports how many frames were skipped.
  ****************************************************************************/
 
-#ifdef CONFIG_CAN_ERRORS
-static void print_errframe(const struct can_msg_s *msg)
+static void fmt_end(void)
 {
-  if (msg->cm_hdr.ch_error)
+  if (g_fmt.nonblock)
     {
-      printf("Error report:\n");
+      fcntl(STDOUT_FILENO, F_SETFL, g_fmt.oflags);
+      g_fmt.nonblock = false;
+    }
 
-      if (msg->cm_hdr.ch_id & CAN_ERROR_TXTIMEOUT)
-        {
-          printf("  TX timeout\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_LOSTARB)
-        {
-          printf("  Lost arbitration\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER)
-        {
-          printf("  Controller error(s): ");
-          if (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW)
-            {
-              printf("RX overflow, ");
-            }
-          if (msg->cm_data[1] & CAN_ERROR1_TXOVERFLOW)
-            {
-              printf("TX overflow, ");
-            }
-          if (msg->cm_data[1] & CAN_ERROR1_RXWARNING)
-            {
-              printf("RX warning level, ");
-            }
-          if (msg->cm_data[1] & CAN_ERROR1_TXWARNING)
-            {
-              printf("TX warning level, ");
-            }
-          if (msg->cm_data[1] & CAN_ERROR1_RXPASSIVE)
-            {
-              printf("RX passive level, ");
-            }
-          if (msg->cm_data[1] & CAN_ERROR1_TXPASSIVE)
-            {
-              printf("TX passive level");
-            }
-          if (!msg->cm_data[1])
-            {
-              printf("Unspecified");
-            }
-          printf("\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_PROTOCOL)
-        {
-          printf("  Protocol error(s): ");
-          if (msg->cm_data[2] & CAN_ERROR2_BIT)
-            {
-              printf("Single bit error, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_FORM)
-            {
-              printf("Framing format, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_STUFF)
-            {
-              printf("Bit-stuffing error, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_BIT0)
-            {
-              printf("Send dominant failed, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_BIT1)
-            {
-              printf("Send recessive failed, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_OVERLOAD)
-            {
-              printf("Bus overload, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_ACTIVE)
-            {
-              printf("Active error announcement, ");
-            }
-          if (msg->cm_data[2] & CAN_ERROR2_TX)
-            {
-              printf("General TX error");
-            }
-          if (!msg->cm_data[2])
-            {
-              printf("Unspecified");
-            }
-          printf("\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_TRANSCEIVER)
-        {
-          printf("  Transceiver error\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_NOACK)
-        {
-          printf("  No ACK received\n");
-        }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_BUSOFF)
+  fmt_flush(true);
+
+  if (g_fmt.skipped > 0)
+    {
+      printf("%" PRIu32 " frames not printed because the console could not "
+             "keep up.\n", g_fmt.skipped);
+      g_fmt.skipped = 0;
+    }
+}
+
+/****************************************************************************
+ * Name: fmt_flush
+ *
+ * Description:
+ *   Writes the output buffer to standard output with one write(). In
+ *   non-blocking mode whatever the console does not accept stays buffered
+ *   for the next flush.
+ *
+ * Input parameters:
+ *   all - Keep writing until the buffer is empty (or an error occurs).
+ ****************************************************************************/
+
+static void fmt_flush(bool all)
+{
+  ssize_t ret;
+  size_t done = 0;
+
+  while (done < g_fmt.len)
+    {
+      ret = write(STDOUT_FILENO, g_fmt.buf + done, g_fmt.len - done);
+      if (ret < 0 && errno == EINTR)
         {
-          printf("  Bus off\n");
+          continue;
         }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_BUSERROR)
+      else if (ret <= 0)
         {
-          printf("  Bus error\n");
+          break;
         }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_RESTARTED)
+
+      done += ret;
+      if (!all)
         {
-          printf("  Controller restarted\n");
+          break;
         }
-      if (msg->cm_hdr.ch_id & CAN_ERROR_INTERNAL)
+    }
+
+  if (done > 0)
+    {
+      memmove(g_fmt.buf, g_fmt.buf + done, g_fmt.len - done);
+      g_fmt.len -= done;
+    }
+}
+
+/****************************************************************************
+ * Name: fmt_reserve
+ *
+ * Description:
+ *   Makes room for len more bytes in the output buffer, flushing if needed.
+ *
+ * Input parameters:
+ *   len   - Number of bytes needed
+ *   limit - Highest buffer fill level allowed. Frames are limited to
+ *           FMT_FRAME_LIMIT so that status messages still fit when the
+ *           console falls behind.
+ *
+ * Returned value:
+ *   Pointer to the free space, or NULL if the console is too far behind.
+ ****************************************************************************/
+
+static FAR char *fmt_reserve(size_t len, size_t limit)
+{
+  if (g_fmt.len + len > limit)
+    {
+      fmt_flush(!g_fmt.nonblock);
+      if (g_fmt.len + len > limit)
         {
-          printf("  Stack-internal error\n");
+          return NULL;
         }
     }
-  else
+
+  return g_fmt.buf + g_fmt.len;
+}
+
+/****************************************************************************
+ * Name: fmt_puts
+ *
+ * Description:
+ *   Appends a string to the output buffer.
+ ****************************************************************************/
+
+static void fmt_puts(FAR const char *str)
+{
+  size_t len = strlen(str);
+  FAR char *dst;
+
+  dst = fmt_reserve(len, sizeof(g_fmt.buf));
+  if (dst != NULL)
     {
-      printf("Not an error frame.\n");
+      memcpy(dst, str, len);
+      g_fmt.len += len;
     }
 
-  fflush(stdout);
+  /* Outside of a receive session output is not batched */
+
+  if (!g_fmt.nonblock)
+    {
+      fmt_flush(true);
+    }
 }
-#endif /* CONFIG_CAN_ERRORS */
 
 /****************************************************************************
- * Name: print_canmsgs
+ * Name: fmt_printf
  *
  * Description:
- *   Treats the buffer as a packed array of struct can_msg_s. (i.e. unused
- *   data bits from the first struct are part of the next struct.
+ *   printf() into the output buffer. Used for status lines during receive
+ *   sessions, where stdio must not be used on the non-blocking console.
+ ****************************************************************************/
+
+static void fmt_printf(FAR const char *format, ...)
+{
+  char line[FMT_LINE_MAX];
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+
+  fmt_puts(line);
+}
+
+/****************************************************************************
+ * Name: fmt_dec
  *
- * Input paramters:
- *   msgs - Packed array of struct can_msg_s returned by read().
- *   buflen - Number of bytes returned by read() (not the actual size of the
- *            buffer)
+ * Description:
+ *   Renders an unsigned number in decimal.
+ *
+ * Returned value:
+ *   Pointer just past the last digit written.
  ****************************************************************************/
 
-static void print_canmsgs(uint8_t *msgs, int buflen)
+static FAR char *fmt_dec(FAR char *dst, uint32_t val)
 {
-  int offset = 0;
-  struct can_msg_s *msg;
+  char tmp[10];
+  int n = 0;
 
-  while (true)
+  do
     {
-      msg = (struct can_msg_s *)((uint8_t *)msgs + offset);
-      offset += CAN_MSGLEN(msg->cm_hdr.ch_dlc);
+      tmp[n++] = '0' + val % 10;
+      val /= 10;
+    }
+  while (val != 0);
 
-      /* Offset is the position of the first byte of the next frame in the
-       * buffer, so it is also the length of the messages read so far.
-       */
+  while (n > 0)
+    {
+      *dst++ = tmp[--n];
+    }
 
-      if (offset > buflen)
-        {
-          break;
-        }
+  return dst;
+}
 
-#ifdef CONFIG_CAN_ERRORS
-      if (msg->cm_hdr.ch_error)
-      {
-        print_errframe(msg);
-        continue;
-      }
-#endif
+/****************************************************************************
+ * Name: fmt_frame
+ *
+ * Description:
+ *   Renders one data or remote frame as a line of text using table-driven
+ *   hex conversion. The frame is skipped (and counted) if the console is
+ *   too far behind to take it.
+ *
+ * Input parameters:
+ *   msg - The frame
+ *   tag - Text to start the line with (such as the source bus), or NULL
+ ****************************************************************************/
 
-      if (msg->cm_hdr.ch_rtr)
-        {
-          printf("RMT ");
-        }
-      else
-        {
-          printf("DAT ");
-        }
+static void fmt_frame(FAR const struct can_msg_s *msg,
+                      FAR const char *tag)
+{
+  FAR char *line;
+  FAR char *p;
+  size_t len;
+  int i;
+
+  line = fmt_reserve(FMT_FRAME_MAX, FMT_FRAME_LIMIT);
+  if (line == NULL)
+    {
+      ++g_fmt.skipped;
+      return;
+    }
+
+  p = line;
+
+  if (tag != NULL)
+    {
+      len = strnlen(tag, FMT_TAG_MAX - 1);
+      memcpy(p, tag, len);
+      p += len;
+    }
+
+  memcpy(p, msg->cm_hdr.ch_rtr ? "RMT " : "DAT ", 4);
+  p += 4;
 
 #ifdef CONFIG_CAN_EXTID
-      if (msg->cm_hdr.ch_extid)
-      {
-        printf("EXT ");
-      }
-      else
-      {
-        printf("STD ");
-      }
+  memcpy(p, msg->cm_hdr.ch_extid ? "EXT " : "STD ", 4);
 #else
-      printf("STD ");
+  memcpy(p, "STD ", 4);
+#endif
+  p += 4;
+
+#ifdef CONFIG_CAN_FD
+  if (msg->cm_hdr.ch_edl)
+    {
+      memcpy(p, msg->cm_hdr.ch_brs ? "FD BRS " : "FD ",
+             msg->cm_hdr.ch_brs ? 7 : 3);
+      p += msg->cm_hdr.ch_brs ? 7 : 3;
+    }
 #endif
 
-      printf("ID (dec): %lu DLC (dec): %hhu",
-            msg->cm_hdr.ch_id, msg->cm_hdr.ch_dlc);
+  memcpy(p, "ID (dec): ", 10);
+  p = fmt_dec(p + 10, msg->cm_hdr.ch_id);
+  memcpy(p, " DLC (dec): ", 12);
+  p = fmt_dec(p + 12, msg->cm_hdr.ch_dlc);
+
+  if (!msg->cm_hdr.ch_rtr)
+    {
+      memcpy(p, " DATA (hex):", 12);
+      p += 12;
 
-      if (! msg->cm_hdr.ch_rtr)
+      for (i = 0; i < canmsg_nbytes(msg); ++i)
         {
-          printf(" DATA (hex):");
-          for (int i = 0; i < msg->cm_hdr.ch_dlc; ++i)
-          {
-            printf(" %x", msg->cm_data[i]);
-          }
+          *p++ = ' ';
+          *p++ = g_hexdigits[msg->cm_data[i] >> 4];
+          *p++ = g_hexdigits[msg->cm_data[i] & 0x0f];
         }
-
-      printf("\n");
-      fflush(stdout);
     }
+
+  *p++ = '\n';
+  g_fmt.len += p - line;
 }
 
 /****************************************************************************
- * Name: test_basic_receive
+ * Name: errstats_count
  *
  * Description:
- *   Prints CAN messages until the user types "q"
+ *   Adds one to the counter of every bit of a table that is set in bits.
  *
  * Input parameters:
- *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ *   table  - Bit definitions, terminated by a NULL name
+ *   counts - One counter per table entry
+ *   bits   - Bits reported by the error frame
  ****************************************************************************/
 
-static void test_basic_receive(const int canfd)
+#ifdef CONFIG_CAN_ERRORS
+static void errstats_count(FAR const struct errbit_s *table,
+                           FAR uint32_t *counts, uint32_t bits)
 {
-  struct pollfd fds[] = {
-    {.fd = canfd,         .events = POLLIN, .revents = 0},
-    {.fd = STDIN_FILENO,  .events = POLLIN, .revents = 0}
-  };
-  int ret;
-  struct can_msg_s msgbuf;
-  char input;
-  static int cnt = 0;
+  int i;
 
-  printf("Listening for CAN frames. Type Q to quit.\n");
-  while (true)
+  for (i = 0; bits != 0 && table[i].eb_name != NULL; ++i)
     {
-      ret = poll(fds, 2, -1);
-      if (ret < 0)
-        {
-          printf("poll() failed: %d\n", errno);
-          break;
-        }
-      else if (ret == 0)
-        {
-          printf("poll() returned 0 unexpectedly.\n");
-          break;
-        }
-      else
+      if (bits & table[i].eb_bit)
         {
-          ++cnt;
-
-          for (int i = 0; i < 2; ++i)
-            {
-              if (fds[i].revents & ~POLLIN)
-                {
-                  printf("poll() set unexpected flags %x on fd %d",
-                        fds[i].revents, fds[i].fd);
-                  break;
-                }
-            }
-
-          if (fds[0].revents & POLLIN)
-            {
-              ret = read(canfd, &msgbuf, sizeof(struct can_msg_s));
-              if (ret < CAN_MSGLEN(0) || ret > sizeof(struct can_msg_s))
-                {
-                  printf("read() of CAN device returned %d, \n", ret);
-                  if (ret < 0)
-                    {
-                      printf("errno is %d\n", errno);
-                    }
-                  break;
-                }
-              else
-                {
-                  print_canmsgs((uint8_t *)&msgbuf, ret);
-                }
-            }
-          if (fds[1].revents & POLLIN)
-            {
-              ret = read(STDIN_FILENO, &input, sizeof(char));
-              if (ret != 1)
-                {
-                  printf("read() of stdin returned %d, \n", ret);
-                  if (ret < 0)
-                    {
-                      printf("errno is %d\n", errno);
-                    }
-                  break;
-                }
-              else
-              {
-                if (input == 'Q' || input == 'q')
-                  {
-                    printf("Quit.\n");
-                    break;
-                  }
-              }
-            }
+          ++counts[i];
+          bits &= ~table[i].eb_bit;
         }
     }
 }
 
 /****************************************************************************
- * Name: test_add_std_filter
+ * Name: errstats_add
  *
  * Description:
- *   Allows user to add filters (this removes the default accept-anything
- *   filter)
+ *   Decodes an error frame into the error counters and tracks the time the
+ *   controller spends error-passive and bus-off. Error-passive starts with
+ *   a controller report with either passive bit set and ends with a report
+ *   of the warning state only, which means the error counters dropped
+ *   below the passive limit. Reports that say nothing about the state
+ *   (such as an RX overflow) leave it alone. Bus-off starts with a bus-off
+ *   report. Both end when the controller reports that it restarted.
  *
  * Input parameters:
- *   canfd - Open file descriptor for the CAN device (not related to FDCAN)
+ *   es    - Error statistics
+ *   msg   - Frame with msg->cm_hdr.ch_error set
+ *   ts_us - Time the frame was received
  ****************************************************************************/
 
-static void test_add_std_filter(int canfd)
+static void errstats_add(FAR struct errstats_s *es,
+                         FAR const struct can_msg_s *msg, uint64_t ts_us)
 {
-  int ret;
-  char selection[13] = {0};
-  struct canioc_stdfilter_s filter;
+  uint32_t id = msg->cm_hdr.ch_id;
 
-  fputs("Standard mask filter: enter a message ID as 1's and 0's with\n"
-        "don't cares represented by X's. (example: 11X001X)\n"
-        "Unspecified bits are treated as must-match leading zeros.\n", stdout);
+  ++es->es_frames;
+  errstats_count(g_errclass_bits, es->es_class, id);
 
-  while (true)
+  if (id & CAN_ERROR_CONTROLLER)
     {
-      fputs("Enter a filter, or Q to quit: ", stdout);
-      fflush(stdout);
-      std_readline(selection, 13);
+      errstats_count(g_errctrl_bits, es->es_ctrl, msg->cm_data[1]);
 
-      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+      if (msg->cm_data[1] & (CAN_ERROR1_RXPASSIVE | CAN_ERROR1_TXPASSIVE))
         {
-          puts("Quit");
-          break;
+          if (es->es_passive_since == 0)
+            {
+              es->es_passive_since = ts_us;
+            }
         }
-      else
+      else if ((msg->cm_data[1] & (CAN_ERROR1_RXWARNING |
+                                    CAN_ERROR1_TXWARNING)) != 0 &&
+               es->es_passive_since != 0)
         {
-          ret = parse_mask(selection, &filter, false);
-          if (ret < 0)
-            {
-              printf("Error parsing mask: %d\n", errno);
-            }
-
-          ret = ioctl(canfd, CANIOC_ADD_STDFILTER, &filter);
-          if (ret < 0)
-            {
-              printf("Error adding filter: %d\n", errno);
-            }
-          else
-            {
-              printf("Added filter %d.\n", ret);
-            }
+          es->es_passive_us += ts_us - es->es_passive_since;
+          es->es_passive_since = 0;
         }
     }
+
+  if (id & CAN_ERROR_PROTOCOL)
+    {
+      errstats_count(g_errprot_bits, es->es_prot, msg->cm_data[2]);
+    }
+
+  if ((id & CAN_ERROR_BUSOFF) && es->es_busoff_since == 0)
+    {
+      es->es_busoff_since = ts_us;
+    }
+
+  if (id & CAN_ERROR_RESTARTED)
+    {
+      errstats_recovered(es, ts_us);
+    }
 }
 
 /****************************************************************************
- * Name: test_add_ext_filter
+ * Name: errstats_recovered
  *
  * Description:
- *   Allows the user to add filters (this removes the default accept-antyhing
- *   filter)
- *
- * Input parameters:
- *   canfd - Open file descriptor for the CAN device (not related to FDCAN)
+ *   Ends any error-passive or bus-off period. Called when the controller
+ *   reports a restart, and when a data frame arrives while bus-off (which
+ *   the controller can only receive once it is back on the bus).
  ****************************************************************************/
 
-#ifdef CONFIG_CAN_EXTID
-static void test_add_ext_filter(int canfd)
+static void errstats_recovered(FAR struct errstats_s *es, uint64_t ts_us)
 {
-  int ret;
-  char selection[31] = {0};
-  struct canioc_extfilter_s filter;
-
-  fputs("Extended mask filter: enter a message ID as 1's and 0's with\n"
-        "don't cares represented by X's (example: 11X001X) \n"
-        "Unspecified bits are treated as must-match leading zeros.\n", stdout);
+  if (es->es_passive_since != 0)
+    {
+      es->es_passive_us += ts_us - es->es_passive_since;
+      es->es_passive_since = 0;
+    }
 
-  while (true)
+  if (es->es_busoff_since != 0)
     {
-      fputs("Enter a filter, or Q to quit: ", stdout);
-      fflush(stdout);
-      std_readline(selection, 13);
+      es->es_busoff_us += ts_us - es->es_busoff_since;
+      es->es_busoff_since = 0;
+    }
+}
 
-      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+/****************************************************************************
+ * Name: errstats_print_bits
+ *
+ * Description:
+ *   Renders the non-zero counters of a table as "name count, ..." and
+ *   clears them.
+ ****************************************************************************/
+
+static void errstats_print_bits(FAR const char *title,
+                                FAR const struct errbit_s *table,
+                                FAR uint32_t *counts)
+{
+  bool first = true;
+  int i;
+
+  for (i = 0; table[i].eb_name != NULL; ++i)
+    {
+      if (counts[i] == 0)
         {
-          puts("Quit");
-          break;
+          continue;
         }
-      else
-        {
-          ret = parse_mask(selection, &filter, true);
-          if (ret < 0)
-            {
-              printf("Error parsing mask: %d\n", errno);
-              continue;
-            }
 
-          ret = ioctl(canfd, CANIOC_ADD_EXTFILTER, &filter);
-          if (ret < 0)
-            {
-              printf("Error adding filter: %d\n", errno);
-            }
-          else
-            {
-              printf("Added filter %d.\n", ret);
-            }
-        }
+      fmt_printf("%s%s %" PRIu32, first ? title : ", ", table[i].eb_name,
+                 counts[i]);
+      counts[i] = 0;
+      first = false;
+    }
+
+  if (!first)
+    {
+      fmt_puts("\n");
     }
 }
-#endif
 
 /****************************************************************************
- * Name: test_rtr_transaction
+ * Name: errstats_report
  *
  * Description:
+ *   Prints a summary of the error frames received since the previous
+ *   summary, at most once per es_interval_ms. Nothing is printed while
+ *   there is nothing to report.
  *
  * Input parameters:
- *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
- *
+ *   es    - Error statistics
+ *   now   - Current monotonic time from now_us()
+ *   force - Print even if the interval has not elapsed
  ****************************************************************************/
 
-static void test_rtr_transaction(int canfd)
+static void errstats_report(FAR struct errstats_s *es, uint64_t now,
+                            bool force)
 {
-  int ret;
-  long id;
-  char selection[31] = {0};
-  struct can_msg_s    xpectd_msg;
-  struct canioc_rtr_s rmt_req = {
-    .ci_timeout = {
-      .tv_sec = 10,
-      .tv_nsec = 1000
-    },
-    .ci_msg = &xpectd_msg
-  };
+  uint64_t passive_us;
+  uint64_t busoff_us;
 
-  while (true)
+  if (!force && now - es->es_last_report <
+                (uint64_t)es->es_interval_ms * 1000)
     {
-      fputs("Enter X for extended ID, S for standard ID, followed by the\n"
-            "message ID in decimal. (e.g. S1520) Enter Q to quit: ", stdout);
-      fflush(stdout);
-      std_readline(selection, 31);
+      return;
+    }
 
-      switch (selection[0])
-      {
-        case 'X':
-#ifdef CONFIG_CAN_EXTID
-          xpectd_msg.cm_hdr.ch_extid = true;
-          break;
-#else
-          puts("Extended ID support disabled in this build.");
-          continue;
-#endif
-        case 'S':
-#ifdef CONFIG_CAN_EXTID
-          xpectd_msg.cm_hdr.ch_extid = false;
-#endif
-          break;
-        case 'Q':
-        case 'q':
-          puts("Quit");
-          return;
-        default:
-          puts("Unexpected starting character.");
-          continue;
-      }
+  if (es->es_frames == 0 && es->es_passive_since == 0 &&
+      es->es_busoff_since == 0)
+    {
+      es->es_last_report = now;
+      return;
+    }
 
-      if (selection[1] < '0' || selection[1] > '9')
-        {
-          puts("Not a valid message ID.");
-          continue;
-        }
+  passive_us = es->es_passive_us;
+  if (es->es_passive_since != 0)
+    {
+      passive_us += now - es->es_passive_since;
+    }
 
-      id = atol(selection + 1);
+  busoff_us = es->es_busoff_us;
+  if (es->es_busoff_since != 0)
+    {
+      busoff_us += now - es->es_busoff_since;
+    }
 
-#ifdef CONFIG_CAN_EXTID
-      if (!xpectd_msg.cm_hdr.ch_extid && id > CAN_MAX_STDMSGID)
-        {
-          puts("Standard message ID too large.");
-          continue;
-        }
-      else if (xpectd_msg.cm_hdr.ch_extid && id > CAN_MAX_EXTMSGID)
-        {
-          puts("Extended message ID too large.");
-          continue;
-        }
-#else
-      if (id > CAN_MAX_STDMSGID)
-      {
-        puts("Standard message ID too large.");
-        continue;
-      }
-#endif
+  fmt_printf("-- %" PRIu32 " error frames in %" PRIu32 " ms; "
+             "error-passive %" PRIu32 " ms%s, bus-off %" PRIu32 " ms%s\n",
+             es->es_frames, (uint32_t)((now - es->es_last_report) / 1000),
+             (uint32_t)(passive_us / 1000),
+             es->es_passive_since ? " (now)" : "",
+             (uint32_t)(busoff_us / 1000),
+             es->es_busoff_since ? " (now)" : "");
 
-      xpectd_msg.cm_hdr.ch_id = id;
+  errstats_print_bits("   ", g_errclass_bits, es->es_class);
+  errstats_print_bits("   Controller: ", g_errctrl_bits, es->es_ctrl);
+  errstats_print_bits("   Protocol: ", g_errprot_bits, es->es_prot);
 
-      fputs("Enter the data length code to request in decimal,\n"
-            "or Q to quit: ", stdout);
-      fflush(stdout);
-      std_readline(selection, 31);
+  es->es_frames = 0;
+  es->es_last_report = now;
+}
 
-      if (selection[0] < '0' || selection[0] > '9')
-      {
-        if (selection[0] == 'q' || selection[0] == 'Q')
-          {
-            return;
-          }
-        else
-          {
-            puts("Not a valid DLC");
-            continue;
-          }
-      }
+/****************************************************************************
+ * Name: errstats_reset
+ *
+ * Description:
+ *   Clears the error statistics at the start of a receive session, keeping
+ *   the configured summary interval.
+ ****************************************************************************/
 
-      xpectd_msg.cm_hdr.ch_dlc = atoi(selection);
+static void errstats_reset(FAR struct errstats_s *es)
+{
+  uint32_t interval_ms = es->es_interval_ms;
 
-      if (xpectd_msg.cm_hdr.ch_dlc > 8)
-      {
-        puts("DLC too large.");
-        continue;
-      }
+  memset(es, 0, sizeof(*es));
+  es->es_interval_ms = interval_ms ? interval_ms : ERRSTATS_INTERVAL_MS;
+  es->es_last_report = now_us();
+}
 
-      puts("Sending request and waiting for response...");
-      fflush(stdout);
-      ret = ioctl(canfd, CANIOC_RTR, &rmt_req);
+/****************************************************************************
+ * Name: errmon_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the error-frame monitor.
+ ****************************************************************************/
 
-      if (ret < 0)
-      {
-        printf("Request failed: %d\n", errno);
-      }
-      else
-      {
-        puts("Response received:");
-        print_canmsgs((uint8_t *)&xpectd_msg,
-                      CAN_MSGLEN(xpectd_msg.cm_hdr.ch_dlc));
-      }
+static void errmon_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                         FAR void *arg)
+{
+  FAR struct errstats_s *es = arg;
+
+  if (msg->cm_hdr.ch_error)
+    {
+      errstats_add(es, msg, ts_us);
+    }
+  else if (es->es_busoff_since != 0)
+    {
+      errstats_recovered(es, ts_us);
     }
 }
 
 /****************************************************************************
- * Name: parse_mask
+ * Name: errmon_tick
  *
  * Description:
- *   Converts a string like 11X001X into an ID and mask in the passed filter
- *   struct. If the string is shorter than the number of bits in the message
- *   ID, then it is the same as if they had been explicitly specified as 0's.
+ *   rx_loop() tick callback for the error-frame monitor.
+ ****************************************************************************/
+
+static void errmon_tick(uint64_t now, FAR void *arg)
+{
+  errstats_report(arg, now, true);
+}
+#endif /* CONFIG_CAN_ERRORS */
+
+/****************************************************************************
+ * Name: test_error_monitor
  *
- * Input parameters:
- *   msk      - User input string
- *   fltr_ptr - Pointer to either struct canioc_stdfilter_s or
- *              struct canioc_extfilter_s
- *   extended - Whether to interpret the struct and the filter as extended or
- *              standard
+ * Description:
+ *   Receives without printing data frames and summarizes error frames at
+ *   a user-selected interval. The interval is also used by the other
+ *   receive modes, which report errors the same way.
  *
- * Return value: 0 on success, -1 with errno set if an error occurred.
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
  ****************************************************************************/
 
-static int parse_mask(const char *msk, void *fltr_ptr, bool extended)
+static void test_error_monitor(int canfd)
 {
-  int i;
-  struct canioc_stdfilter_s *sfilter = fltr_ptr;
-  if (!extended)
+#ifdef CONFIG_CAN_ERRORS
+  FAR struct errstats_s *es = &g_errstats;
+  struct rx_loop_s rx;
+  int ret;
+
+  es->es_interval_ms = prompt_long("Summary interval in ms",
+                                   es->es_interval_ms ?
+                                   es->es_interval_ms : ERRSTATS_INTERVAL_MS);
+  if (es->es_interval_ms == 0)
     {
-      memset(sfilter, 0, sizeof(struct canioc_stdfilter_s));
-      sfilter->sf_type = CAN_FILTER_MASK;
+      es->es_interval_ms = ERRSTATS_INTERVAL_MS;
     }
 
-#ifdef CONFIG_CAN_EXTID
-  struct canioc_extfilter_s *xfilter = fltr_ptr;
-  if (extended)
+  errstats_reset(es);
+
+  memset(&rx, 0, sizeof(rx));
+  rx.canfd = canfd;
+  rx.tick_ms = es->es_interval_ms;
+  rx.on_frame = errmon_frame;
+  rx.on_tick = errmon_tick;
+  rx.arg = es;
+
+  printf("Monitoring error frames. Type Q to quit.\n");
+  fflush(stdout);
+
+  ret = rx_loop(&rx);
+  if (ret != 0)
     {
-      memset(xfilter, 0, sizeof(struct canioc_extfilter_s));
-      xfilter->xf_type = CAN_FILTER_MASK;
+      printf("Receive loop ended with error %d\n", ret);
     }
 #else
-  if (extended)
-    {
-      errno = EINVAL;
-      return -1;
-    }
+  puts("Error reporting (CONFIG_CAN_ERRORS) is disabled in this build.");
 #endif
+}
 
-  if (msk[0] == '\0' || msk[0] == '\r' || msk[0] == '\n')
-    {
-      puts("No filter given.");
-      errno = EINVAL;
-      return -1;
-    }
+/****************************************************************************
+ * Name: print_canmsgs
+ *
+ * Description:
+ *   Treats the buffer as a packed array of struct can_msg_s. (i.e. unused
+ *   data bits from the first struct are part of the next struct.
+ *   The frames are rendered into the output formatter and written with a
+ *   single write() per call. Error frames are counted in g_errstats and
+ *   summarized at most once per summary interval.
+ *
+ * Input paramters:
+ *   msgs - Packed array of struct can_msg_s returned by read().
+ *   buflen - Number of bytes returned by read() (not the actual size of the
+ *            buffer)
+ ****************************************************************************/
 
-  for (i = 0; msk[i] != '\0' && msk[i] != '\r' && msk[i] != '\n'; ++i)
+static void print_canmsgs(uint8_t *msgs, int buflen)
+{
+  int offset = 0;
+  struct can_msg_s *msg;
+
+  /* Anything still sitting in stdio's buffer goes out ahead of the frames */
+
+  fflush(stdout);
+
+  while (true)
     {
-      if ((extended && i > 28) || (!extended && i > 10))
+      msg = (struct can_msg_s *)((uint8_t *)msgs + offset);
+      offset += CAN_MSGLEN(canmsg_nbytes(msg));
+
+      /* Offset is the position of the first byte of the next frame in the
+       * buffer, so it is also the length of the messages read so far.
+       */
+
+      if (offset > buflen)
+        {
+          break;
+        }
+
+#ifdef CONFIG_CAN_ERRORS
+      if (msg->cm_hdr.ch_error)
       {
-        puts("Unexpected extra characters at end of filter.");
-        errno = EINVAL;
-        return -1;
+        errstats_add(&g_errstats, msg, rx_frame_time(msg, now_us()));
+        continue;
+      }
+      else if (g_errstats.es_busoff_since != 0)
+      {
+        errstats_recovered(&g_errstats, rx_frame_time(msg, now_us()));
       }
+#endif
 
-      switch (msk[i])
+      fmt_frame(msg, NULL);
+    }
+
+#ifdef CONFIG_CAN_ERRORS
+  errstats_report(&g_errstats, now_us(), false);
+#endif
+
+  fmt_flush(!g_fmt.nonblock);
+}
+
+/****************************************************************************
+ * Name: test_basic_receive
+ *
+ * Description:
+ *   Prints CAN messages until the user types "q"
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_basic_receive(const int canfd)
+{
+  struct pollfd fds[] = {
+    {.fd = canfd,         .events = POLLIN, .revents = 0},
+    {.fd = STDIN_FILENO,  .events = POLLIN, .revents = 0}
+  };
+  int ret;
+  int timeout;
+  struct can_msg_s msgbuf;
+  char input;
+  static int cnt = 0;
+
+  printf("Listening for CAN frames. Type Q to quit.\n");
+  fmt_begin();
+
+#ifdef CONFIG_CAN_ERRORS
+  errstats_reset(&g_errstats);
+  timeout = g_errstats.es_interval_ms;
+#else
+  timeout = -1;
+#endif
+
+  while (true)
+    {
+      ret = poll(fds, 2, timeout);
+      if (ret < 0)
         {
-          case '1':
-              if (extended)
-                {
-#ifdef CONFIG_CAN_EXTID
-                  xfilter->xf_id1 |= 1 << (28 - i);
+          fmt_printf("poll() failed: %d\n", errno);
+          break;
+        }
+      else if (ret == 0)
+        {
+#ifdef CONFIG_CAN_ERRORS
+          /* Summarize errors even when no more frames arrive */
+
+          errstats_report(&g_errstats, now_us(), false);
+          fmt_flush(false);
+          continue;
+#else
+          fmt_printf("poll() returned 0 unexpectedly.\n");
+          break;
 #endif
-                }
-              else
+        }
+      else
+        {
+          ++cnt;
+
+          for (int i = 0; i < 2; ++i)
+            {
+              if (fds[i].revents & ~POLLIN)
                 {
-                  sfilter->sf_id1 |= 1 << (10 - i);
+                  fmt_printf("poll() set unexpected flags %x on fd %d",
+                        fds[i].revents, fds[i].fd);
+                  break;
                 }
+            }
 
-              /* id2 stores the mask... the bit must be set regardless whether
-              * this is a 0 or a 1, so fall through.
-              */
-
-          case '0':
-              if (extended)
+          if (fds[0].revents & POLLIN)
+            {
+              ret = read(canfd, &msgbuf, sizeof(struct can_msg_s));
+              if (ret < CAN_MSGLEN(0) || ret > sizeof(struct can_msg_s))
                 {
-#ifdef CONFIG_CAN_EXTID
-                  xfilter->xf_id2 |= 1 << (28 - i);
-#endif
+                  fmt_printf("read() of CAN device returned %d, \n", ret);
+                  if (ret < 0)
+                    {
+                      fmt_printf("errno is %d\n", errno);
+                    }
+                  break;
                 }
               else
                 {
-                  sfilter->sf_id2 |= 1 << (10 - i);
+                  print_canmsgs((uint8_t *)&msgbuf, ret);
+                }
+            }
+          if (fds[1].revents & POLLIN)
+            {
+              ret = read(STDIN_FILENO, &input, sizeof(char));
+              if (ret != 1)
+                {
+                  fmt_printf("read() of stdin returned %d, \n", ret);
+                  if (ret < 0)
+                    {
+                      fmt_printf("errno is %d\n", errno);
+                    }
+                  break;
                 }
+              else
+              {
+                if (input == 'Q' || input == 'q')
+                  {
+                    fmt_printf("Quit.\n");
+                    break;
+                  }
+              }
+            }
+        }
+    }
 
-              break;
+  fmt_end();
+}
 
-          case 'X':
-          case 'x':
-              /* Don't care - leave mask bit as zero */
-              break;
+/****************************************************************************
+ * Name: now_us
+ *
+ * Description:
+ *   Returns the monotonic clock in microseconds.
+ ****************************************************************************/
 
-          default:
-              printf("Unexpected character in filter: %c\n", msk[i]);
-              errno = EINVAL;
-              return -1;
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/****************************************************************************
+ * Name: rx_frame_time
+ *
+ * Description:
+ *   Returns the best available receive time of a frame. With
+ *   CONFIG_CAN_TIMESTAMP the driver stamps each frame with the system
+ *   (monotonic) clock when it comes off the controller; otherwise the time
+ *   read() returned is the best we have.
+ *
+ * Input parameters:
+ *   msg     - The received frame
+ *   read_us - now_us() sampled right after the read() that returned msg
+ ****************************************************************************/
+
+static uint64_t rx_frame_time(FAR const struct can_msg_s *msg,
+                              uint64_t read_us)
+{
+#ifdef CONFIG_CAN_TIMESTAMP
+  return (uint64_t)msg->cm_hdr.ch_ts.tv_sec * 1000000 +
+         msg->cm_hdr.ch_ts.tv_usec;
+#else
+  return read_us;
+#endif
+}
+
+/****************************************************************************
+ * Name: prompt_long
+ *
+ * Description:
+ *   Prompts for a number. Accepts decimal, or hex with a 0x prefix.
+ *
+ * Input parameters:
+ *   prompt - Text to print before the default value
+ *   def    - Value returned if the user just presses enter
+ *
+ * Returned value:
+ *   The number entered, or def.
+ ****************************************************************************/
+
+static long prompt_long(FAR const char *prompt, long def)
+{
+  char line[16] = {0};
+  FAR char *end;
+  long val;
+
+  printf("%s [%ld]: ", prompt, def);
+  fflush(stdout);
+
+  if (std_readline(line, sizeof(line)) <= 0)
+    {
+      return def;
+    }
+
+  val = strtol(line, &end, 0);
+  if (end == line)
+    {
+      return def;
+    }
+
+  return val;
+}
+
+/****************************************************************************
+ * Name: isqrt64
+ *
+ * Description:
+ *   Integer square root, rounded down.
+ ****************************************************************************/
+
+static uint32_t isqrt64(uint64_t val)
+{
+  uint64_t bit = (uint64_t)1 << 62;
+  uint64_t res = 0;
+
+  while (bit > val)
+    {
+      bit >>= 2;
+    }
+
+  while (bit != 0)
+    {
+      if (val >= res + bit)
+        {
+          val -= res + bit;
+          res = (res >> 1) + bit;
+        }
+      else
+        {
+          res >>= 1;
+        }
+
+      bit >>= 2;
+    }
+
+  return (uint32_t)res;
+}
+
+/****************************************************************************
+ * Name: canmsg_nbytes
+ *
+ * Description:
+ *   Returns the payload length of a frame in bytes. With CAN FD, data
+ *   length codes 9-15 stand for 12-64 bytes; classic frames never carry
+ *   more than 8.
+ ****************************************************************************/
+
+static inline uint8_t canmsg_nbytes(FAR const struct can_msg_s *msg)
+{
+#ifdef CONFIG_CAN_FD
+  return g_dlc2bytes[msg->cm_hdr.ch_dlc & 0x0f];
+#else
+  return msg->cm_hdr.ch_dlc > 8 ? 8 : msg->cm_hdr.ch_dlc;
+#endif
+}
+
+/****************************************************************************
+ * Name: canmsg_bits
+ *
+ * Description:
+ *   Estimates the number of bit times a frame occupies on the bus,
+ *   including the interframe space. Bit stuffing is counted at its worst
+ *   case of one stuff bit per four bits of the stuffed region (SOF through
+ *   CRC), so bus load computed from this is an upper bound. CAN FD frames
+ *   are counted entirely at the nominal bit rate, which overstates the
+ *   load of frames sent with bit rate switching.
+ *
+ * Input parameters:
+ *   msg - The frame
+ *
+ * Returned value:
+ *   Bit times, or 0 for error reports (which are not frames on the wire).
+ ****************************************************************************/
+
+static uint32_t canmsg_bits(FAR const struct can_msg_s *msg)
+{
+  uint32_t stuffed;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      return 0;
+    }
+#endif
+
+  /* SOF, arbitration, control and CRC fields */
+
+  stuffed = 34;
+#ifdef CONFIG_CAN_EXTID
+  if (msg->cm_hdr.ch_extid)
+    {
+      stuffed = 54;
+    }
+#endif
+
+#ifdef CONFIG_CAN_FD
+  if (msg->cm_hdr.ch_edl)
+    {
+      /* FD adds the FDF, BRS and ESI bits and a longer CRC with a stuff
+       * bit count (17-bit CRC up to 16 bytes, 21-bit above).
+       */
+
+      stuffed += 3 + 4 + (canmsg_nbytes(msg) > 16 ? 21 : 17) - 15;
+    }
+#endif
+
+  if (!msg->cm_hdr.ch_rtr)
+    {
+      stuffed += 8 * canmsg_nbytes(msg);
+    }
+
+  /* CRC delimiter, ACK, EOF and intermission are never stuffed */
+
+  return stuffed + (stuffed - 1) / 4 + 13;
+}
+
+/****************************************************************************
+ * Name: prng_next
+ *
+ * Description:
+ *   xorshift32 pseudo-random number generator. Deterministic for a given
+ *   seed so that generated traffic can be reproduced.
+ *
+ * Input parameters:
+ *   state - Generator state; must not be zero
+ ****************************************************************************/
+
+static uint32_t prng_next(FAR uint32_t *state)
+{
+  uint32_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/****************************************************************************
+ * Name: lathist_add
+ *
+ * Description:
+ *   Adds a sample to a latency histogram. Bucket n counts samples in
+ *   [2^(n-1), 2^n) microseconds; the last bucket also takes everything
+ *   larger.
+ ****************************************************************************/
+
+static void lathist_add(FAR struct lathist_s *hist, uint32_t us)
+{
+  int bucket = 0;
+
+  while (bucket < LATHIST_BUCKETS - 1 && (us >> bucket) != 0)
+    {
+      ++bucket;
+    }
+
+  ++hist->lh_buckets[bucket];
+
+  if (hist->lh_count == 0 || us < hist->lh_min)
+    {
+      hist->lh_min = us;
+    }
+
+  if (us > hist->lh_max)
+    {
+      hist->lh_max = us;
+    }
+
+  hist->lh_sum += us;
+  ++hist->lh_count;
+}
+
+/****************************************************************************
+ * Name: lathist_print
+ *
+ * Description:
+ *   Prints the summary and the non-empty buckets of a latency histogram.
+ *
+ * Input parameters:
+ *   hist - The histogram
+ *   name - What was measured, e.g. "write() latency"
+ ****************************************************************************/
+
+static void lathist_print(FAR const struct lathist_s *hist,
+                          FAR const char *name)
+{
+  int i;
+
+  if (hist->lh_count == 0)
+    {
+      printf("%s: no samples\n", name);
+      return;
+    }
+
+  printf("%s: %" PRIu32 " samples, min %" PRIu32 " us, mean %" PRIu32
+         " us, max %" PRIu32 " us\n", name, hist->lh_count, hist->lh_min,
+         (uint32_t)(hist->lh_sum / hist->lh_count), hist->lh_max);
+
+  for (i = 0; i < LATHIST_BUCKETS; ++i)
+    {
+      if (hist->lh_buckets[i] == 0)
+        {
+          continue;
+        }
+
+      if (i == 0)
+        {
+          printf("  %8s us", "0");
+        }
+      else if (i == LATHIST_BUCKETS - 1)
+        {
+          printf("  >= %5lu us", 1ul << (i - 1));
+        }
+      else
+        {
+          printf("  %8lu us", 1ul << (i - 1));
+        }
+
+      printf(": %8" PRIu32 " (%3" PRIu32 "%%)\n", hist->lh_buckets[i],
+             (uint32_t)((uint64_t)hist->lh_buckets[i] * 100 /
+                        hist->lh_count));
+    }
+}
+
+/****************************************************************************
+ * Name: idtab_find
+ *
+ * Description:
+ *   Looks up a message ID in a fixed-size open-addressing hash table with
+ *   linear probing. The modes that keep per-ID state use this with a keys
+ *   array and a parallel array of their own entries, so no heap is needed.
+ *
+ * Input parameters:
+ *   keys   - IDTAB_SIZE keys, initialized to IDTAB_EMPTY
+ *   key    - The ID, with IDTAB_EXT set for extended IDs (see idtab_key())
+ *   insert - Claim an empty slot if the key is not present
+ *
+ * Returned value:
+ *   Slot index, or -1 if the key is not present (or the table is full).
+ ****************************************************************************/
+
+static int idtab_find(FAR uint32_t *keys, uint32_t key, bool insert)
+{
+  uint32_t slot;
+  int probes;
+
+  slot = (key * 2654435761u) >> (32 - IDTAB_BITS);
+
+  for (probes = 0; probes < IDTAB_SIZE; ++probes)
+    {
+      if (keys[slot] == key)
+        {
+          return slot;
+        }
+      else if (keys[slot] == IDTAB_EMPTY)
+        {
+          if (!insert)
+            {
+              return -1;
+            }
+
+          keys[slot] = key;
+          return slot;
+        }
+
+      slot = (slot + 1) & (IDTAB_SIZE - 1);
+    }
+
+  return -1;
+}
+
+/****************************************************************************
+ * Name: idtab_key
+ *
+ * Description:
+ *   Returns the idtab_find() key for a frame.
+ ****************************************************************************/
+
+static uint32_t idtab_key(FAR const struct can_msg_s *msg)
+{
+#ifdef CONFIG_CAN_EXTID
+  if (msg->cm_hdr.ch_extid)
+    {
+      return msg->cm_hdr.ch_id | IDTAB_EXT;
+    }
+#endif
+
+  return msg->cm_hdr.ch_id;
+}
+
+/****************************************************************************
+ * Name: rx_read_stdin_quit
+ *
+ * Description:
+ *   Reads one character from standard input after poll() reported it
+ *   readable.
+ *
+ * Returned value:
+ *   1 if the user typed Q, 0 for any other character, -1 on error.
+ ****************************************************************************/
+
+static int rx_read_stdin_quit(void)
+{
+  char input;
+  int ret;
+
+  ret = read(STDIN_FILENO, &input, sizeof(char));
+  if (ret != 1)
+    {
+      fmt_printf("read() of stdin returned %d, \n", ret);
+      if (ret < 0)
+        {
+          fmt_printf("errno is %d\n", errno);
+        }
+      return -1;
+    }
+
+  return (input == 'Q' || input == 'q') ? 1 : 0;
+}
+
+/****************************************************************************
+ * Name: rx_loop
+ *
+ * Description:
+ *   High-throughput receive loop shared by the receive modes. Each poll()
+ *   wakeup drains every queued frame: the CAN device is switched to
+ *   non-blocking mode and read() is repeated into g_rxbuf until the driver
+ *   returns less than a full buffer or EAGAIN. Runs until the user types Q.
+ *
+ * Input parameters:
+ *   rx - Loop configuration and callbacks. The statistics fields are reset
+ *        on entry and hold the totals on return.
+ *
+ * Returned value:
+ *   0 if the user quit, otherwise a positive errno value.
+ ****************************************************************************/
+
+static int rx_loop(FAR struct rx_loop_s *rx)
+{
+  struct pollfd fds[] = {
+    {.fd = rx->canfd,     .events = POLLIN, .revents = 0},
+    {.fd = STDIN_FILENO,  .events = POLLIN, .revents = 0}
+  };
+  FAR struct can_msg_s *msg;
+  uint64_t next_tick;
+  uint64_t now;
+  uint32_t nframes;
+  int timeout;
+  int oflags;
+  int offset;
+  int msglen;
+  int ret;
+  int err = 0;
+
+  rx->wakeups = 0;
+  rx->reads = 0;
+  rx->frames = 0;
+  rx->bytes = 0;
+  rx->payload = 0;
+  rx->max_per_wakeup = 0;
+  rx->full_reads = 0;
+
+  oflags = fcntl(rx->canfd, F_GETFL);
+  if (oflags < 0 || fcntl(rx->canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      return errno;
+    }
+
+  fmt_begin();
+  next_tick = now_us() + (uint64_t)rx->tick_ms * 1000;
+
+  while (true)
+    {
+      timeout = -1;
+      if (rx->tick_ms != 0)
+        {
+          now = now_us();
+          timeout = now >= next_tick ? 0 : (next_tick - now + 999) / 1000;
+        }
+
+      ret = poll(fds, 2, timeout);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          err = errno;
+          fmt_printf("poll() failed: %d\n", err);
+          break;
+        }
+
+      if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLHUP | POLLNVAL))
+        {
+          fmt_printf("poll() set unexpected flags %x/%x\n",
+                 fds[0].revents, fds[1].revents);
+          err = EIO;
+          break;
+        }
+
+      if (fds[0].revents & POLLIN)
+        {
+          nframes = 0;
+
+          while (true)
+            {
+              ret = read(rx->canfd, g_rxbuf, sizeof(g_rxbuf));
+              if (ret < 0)
+                {
+                  if (errno != EAGAIN && errno != EINTR)
+                    {
+                      err = errno;
+                      fmt_printf("read() of CAN device failed: %d\n", err);
+                    }
+                  break;
+                }
+              else if (ret < CAN_MSGLEN(0))
+                {
+                  fmt_printf("read() of CAN device returned %d\n", ret);
+                  err = EIO;
+                  break;
+                }
+
+              now = now_us();
+              ++rx->reads;
+              rx->bytes += ret;
+
+              if (rx->on_batch != NULL)
+                {
+                  rx->on_batch(g_rxbuf, ret, rx->arg);
+                }
+
+              for (offset = 0; offset + CAN_MSGLEN(0) <= ret;
+                   offset += msglen)
+                {
+                  msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+                  msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+                  if (offset + msglen > ret)
+                    {
+                      break;
+                    }
+
+                  ++nframes;
+#ifdef CONFIG_CAN_ERRORS
+                  if (!msg->cm_hdr.ch_error)
+#endif
+                    {
+                      rx->payload += canmsg_nbytes(msg);
+                    }
+
+                  if (rx->on_frame != NULL)
+                    {
+                      rx->on_frame(msg, rx_frame_time(msg, now), rx->arg);
+                    }
+                }
+
+              /* The driver copies out as many frames as fit, so if there
+               * is room left for the largest frame the queue is empty.
+               */
+
+              if (ret + CAN_MSGLEN(CAN_MAXDATALEN) <= sizeof(g_rxbuf))
+                {
+                  break;
+                }
+
+              ++rx->full_reads;
+            }
+
+          if (err != 0)
+            {
+              break;
+            }
+
+          if (nframes > 0)
+            {
+              ++rx->wakeups;
+              rx->frames += nframes;
+              if (nframes > rx->max_per_wakeup)
+                {
+                  rx->max_per_wakeup = nframes;
+                }
+            }
+        }
+
+      if (fds[1].revents & POLLIN)
+        {
+          ret = rx_read_stdin_quit();
+          if (ret < 0)
+            {
+              err = EIO;
+              break;
+            }
+          else if (ret > 0)
+            {
+              fmt_printf("Quit.\n");
+              break;
+            }
+        }
+
+      if (rx->tick_ms != 0 && rx->on_tick != NULL)
+        {
+          now = now_us();
+          if (now >= next_tick)
+            {
+              rx->on_tick(now, rx->arg);
+              next_tick += (uint64_t)rx->tick_ms * 1000;
+              if (next_tick < now)
+                {
+                  next_tick = now + (uint64_t)rx->tick_ms * 1000;
+                }
+            }
+        }
+    }
+
+  fmt_end();
+  fcntl(rx->canfd, F_SETFL, oflags);
+  return err;
+}
+
+/****************************************************************************
+ * Name: rx_rate_batch
+ *
+ * Description:
+ *   rx_loop() batch callback for the batched receive mode.
+ ****************************************************************************/
+
+static void rx_rate_batch(FAR uint8_t *buf, int buflen, FAR void *arg)
+{
+  FAR struct rx_rate_s *rate = arg;
+
+  if (rate->print)
+    {
+      print_canmsgs(buf, buflen);
+    }
+}
+
+/****************************************************************************
+ * Name: rx_rate_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the batched receive mode. Counts driver
+ *   RX overflow reports so dropped frames show up in the statistics.
+ ****************************************************************************/
+
+static void rx_rate_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                          FAR void *arg)
+{
+#ifdef CONFIG_CAN_ERRORS
+  FAR struct rx_rate_s *rate = arg;
+
+  if (msg->cm_hdr.ch_error && (msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+      (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+    {
+      ++rate->overflows;
+    }
+
+  /* print_canmsgs() does the error accounting when frames are printed */
+
+  if (msg->cm_hdr.ch_error && !rate->print)
+    {
+      errstats_add(&g_errstats, msg, ts_us);
+    }
+#endif
+}
+
+/****************************************************************************
+ * Name: rx_rate_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the batched receive mode. Prints the frame
+ *   and wakeup rates since the previous report.
+ ****************************************************************************/
+
+static void rx_rate_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct rx_rate_s *rate = arg;
+  uint32_t elapsed_ms;
+  uint32_t frames;
+  uint32_t wakeups;
+  uint64_t payload;
+
+  elapsed_ms = (now - rate->last_us) / 1000;
+  payload = rate->rx->payload - rate->last_payload;
+  frames = rate->rx->frames - rate->last_frames;
+  wakeups = rate->rx->wakeups - rate->last_wakeups;
+
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  fmt_printf("%" PRIu32 " frames/s, %" PRIu32 " payload B/s, %" PRIu32
+             " wakeups/s, %" PRIu32 ".%" PRIu32 " frames/wakeup (max %"
+             PRIu32 "), %" PRIu32 " RX overflows, %" PRIu32
+             " not printed\n",
+             (uint32_t)((uint64_t)frames * 1000 / elapsed_ms),
+             (uint32_t)(payload * 1000 / elapsed_ms),
+             (uint32_t)((uint64_t)wakeups * 1000 / elapsed_ms),
+             wakeups ? frames / wakeups : 0,
+             wakeups ? (frames * 10 / wakeups) % 10 : 0,
+             rate->rx->max_per_wakeup, rate->overflows, g_fmt.skipped);
+
+#ifdef CONFIG_CAN_ERRORS
+  errstats_report(&g_errstats, now, false);
+#endif
+
+  rate->last_us = now;
+  rate->last_frames = rate->rx->frames;
+  rate->last_wakeups = rate->rx->wakeups;
+  rate->last_payload = rate->rx->payload;
+}
+
+/****************************************************************************
+ * Name: test_batched_receive
+ *
+ * Description:
+ *   High-throughput receive: drains every queued frame per wakeup into a
+ *   CONFIG_INDUSTRY_ETCETERA_CANTEST_RXBUFSIZE byte buffer and reports
+ *   frames per wakeup and frames per second once a second. Printing the
+ *   frames themselves is optional since the console is usually slower than
+ *   the bus.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_batched_receive(int canfd)
+{
+  char selection[4] = {0};
+  struct rx_rate_s rate;
+  struct rx_loop_s rx;
+  int ret;
+
+  memset(&rate, 0, sizeof(rate));
+  memset(&rx, 0, sizeof(rx));
+
+  fputs("Print every frame? (Y/N): ", stdout);
+  fflush(stdout);
+  std_readline(selection, 4);
+  rate.print = (selection[0] == 'Y' || selection[0] == 'y');
+
+  rx.canfd = canfd;
+  rx.tick_ms = RX_REPORT_MS;
+  rx.on_batch = rx_rate_batch;
+  rx.on_frame = rx_rate_frame;
+  rx.on_tick = rx_rate_tick;
+  rx.arg = &rate;
+
+  printf("Batched receive with a %d byte buffer. Type Q to quit.\n",
+         (int)sizeof(g_rxbuf));
+  fflush(stdout);
+
+  rate.rx = &rx;
+  rate.last_us = now_us();
+#ifdef CONFIG_CAN_ERRORS
+  errstats_reset(&g_errstats);
+#endif
+  ret = rx_loop(&rx);
+
+  printf("Totals: %" PRIu32 " frames in %" PRIu32 " wakeups (%" PRIu32
+         " reads, %" PRIu32 " full buffers), max %" PRIu32
+         " frames/wakeup, %" PRIu32 " RX overflows\n",
+         rx.frames, rx.wakeups, rx.reads, rx.full_reads, rx.max_per_wakeup,
+         rate.overflows);
+  printf("Payload: %" PRIu32 " bytes, %" PRIu32 " bytes/frame average\n",
+         (uint32_t)rx.payload, rx.frames ?
+         (uint32_t)(rx.payload / rx.frames) : 0);
+
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+}
+
+/****************************************************************************
+ * Name: capture_writer
+ *
+ * Description:
+ *   Capture writer thread. Writes each block handed over by capture_frame()
+ *   to the capture file and returns it to the free pool, so that flash
+ *   write latency is absorbed here instead of in the receive loop.
+ *
+ * Input parameters:
+ *   arg - Pointer to the struct capture_s of the session
+ ****************************************************************************/
+
+static FAR void *capture_writer(FAR void *arg)
+{
+  FAR struct capture_s *cap = arg;
+  ssize_t ret;
+  size_t done;
+  int blk = 0;
+
+  while (true)
+    {
+      while (sem_wait(&cap->cs_full) < 0 && errno == EINTR);
+
+      if (cap->cs_len[blk] == 0)
+        {
+          /* An empty block is the request to stop */
+
+          break;
+        }
+
+      for (done = 0; done < cap->cs_len[blk]; done += ret)
+        {
+          ret = write(cap->cs_fd, g_capbuf[blk] + done,
+                      cap->cs_len[blk] - done);
+          if (ret < 0)
+            {
+              if (errno == EINTR)
+                {
+                  ret = 0;
+                  continue;
+                }
+
+              cap->cs_werror = errno;
+              break;
+            }
+        }
+
+      cap->cs_written += done;
+      cap->cs_len[blk] = 0;
+      blk ^= 1;
+      sem_post(&cap->cs_empty);
+    }
+
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: capture_pass
+ *
+ * Description:
+ *   Passes the block being filled to the writer thread and starts filling
+ *   the other one. The caller must already own the other block, taken from
+ *   cs_empty.
+ ****************************************************************************/
+
+static void capture_pass(FAR struct capture_s *cap)
+{
+  cap->cs_len[cap->cs_blk] = cap->cs_fill;
+  sem_post(&cap->cs_full);
+
+  cap->cs_blk ^= 1;
+  cap->cs_fill = 0;
+}
+
+/****************************************************************************
+ * Name: capture_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for capture mode. Appends one variable-length
+ *   record to the current block; a record that does not fit is split, its
+ *   head filling the block exactly before the block is swapped. If the
+ *   writer is still busy with the other block the frame is dropped rather
+ *   than stalling the receive loop.
+ ****************************************************************************/
+
+static void capture_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                          FAR void *arg)
+{
+  FAR struct capture_s *cap = arg;
+  struct capture_rec_s rec;
+  uint64_t delta;
+  uint32_t id;
+  size_t len;
+  size_t head;
+  bool split;
+
+  len = CAPTURE_RECLEN(canmsg_nbytes(msg));
+
+  /* Claim the other block before touching this one, so that a frame is
+   * either recorded whole or dropped.
+   */
+
+  split = cap->cs_fill + len >
+          CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE;
+  if (split && sem_trywait(&cap->cs_empty) < 0)
+    {
+      ++cap->cs_dropped;
+      return;
+    }
+
+  id = msg->cm_hdr.ch_id;
+#ifdef CONFIG_CAN_EXTID
+  if (msg->cm_hdr.ch_extid)
+    {
+      id |= CAPTURE_ID_EXT;
+    }
+#endif
+  if (msg->cm_hdr.ch_rtr)
+    {
+      id |= CAPTURE_ID_RTR;
+    }
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      id |= CAPTURE_ID_ERR;
+
+      if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+          (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+        {
+          ++cap->cs_overflows;
+        }
+    }
+#endif
+
+  delta = ts_us > cap->cs_last_us ? ts_us - cap->cs_last_us : 0;
+  cap->cs_last_us = ts_us;
+
+  rec.cr_delta = delta > UINT32_MAX ? UINT32_MAX : delta;
+  rec.cr_id = id;
+  rec.cr_dlc = msg->cm_hdr.ch_dlc;
+#ifdef CONFIG_CAN_FD
+  if (msg->cm_hdr.ch_edl)
+    {
+      rec.cr_dlc |= CAPTURE_DLC_FD;
+      if (msg->cm_hdr.ch_brs)
+        {
+          rec.cr_dlc |= CAPTURE_DLC_BRS;
+        }
+    }
+#endif
+  memcpy(rec.cr_data, msg->cm_data, canmsg_nbytes(msg));
+
+  head = 0;
+  if (split)
+    {
+      head = CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE - cap->cs_fill;
+      memcpy(g_capbuf[cap->cs_blk] + cap->cs_fill, &rec, head);
+      cap->cs_fill += head;
+      capture_pass(cap);
+    }
+
+  memcpy(g_capbuf[cap->cs_blk] + cap->cs_fill, (FAR uint8_t *)&rec + head,
+         len - head);
+  cap->cs_fill += len - head;
+  ++cap->cs_frames;
+}
+
+/****************************************************************************
+ * Name: capture_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for capture mode. Prints the capture rate.
+ ****************************************************************************/
+
+static void capture_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct capture_s *cap = arg;
+  uint32_t elapsed_ms = (now - cap->cs_start_us) / 1000;
+  uint32_t kbps;
+
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  kbps = (uint32_t)((uint64_t)cap->cs_written * 1000 / 1024 / elapsed_ms);
+  fmt_printf("%" PRIu32 " frames, %" PRIu32 " KiB/s to disk, %" PRIu32
+             " dropped, %" PRIu32 " RX overflows\n", cap->cs_frames, kbps,
+             cap->cs_dropped, cap->cs_overflows);
+}
+
+/****************************************************************************
+ * Name: run_capture
+ *
+ * Description:
+ *   Writes received frames to a binary capture file until the user types
+ *   Q. See struct capture_rec_s for the record format.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device
+ *   path  - Capture file to create
+ *
+ * Returned value:
+ *   OK on success, otherwise a positive errno value.
+ ****************************************************************************/
+
+static int run_capture(int canfd, FAR const char *path)
+{
+  FAR struct capture_filehdr_s *hdr;
+  struct capture_s cap;
+  struct rx_loop_s rx;
+  pthread_t writer;
+  uint32_t elapsed_ms;
+  uint32_t rate;
+  int ret;
+
+  memset(&cap, 0, sizeof(cap));
+  memset(&rx, 0, sizeof(rx));
+
+  cap.cs_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (cap.cs_fd < 0)
+    {
+      printf("Error opening capture file %s: %d\n", path, errno);
+      return errno;
+    }
+
+  /* The file header goes at the start of block 0 rather than in a write
+   * of its own, so the blocks stay aligned to the start of the file.
+   */
+
+  hdr = (FAR struct capture_filehdr_s *)g_capbuf[0];
+  hdr->cf_magic = CAPTURE_MAGIC;
+  hdr->cf_version = CAPTURE_VERSION;
+  hdr->cf_flags = 0;
+  cap.cs_fill = sizeof(*hdr);
+
+  sem_init(&cap.cs_full, 0, 0);
+  sem_init(&cap.cs_empty, 0, 1);
+
+  ret = pthread_create(&writer, NULL, capture_writer, &cap);
+  if (ret != 0)
+    {
+      printf("Error starting capture writer thread: %d\n", ret);
+      close(cap.cs_fd);
+      return ret;
+    }
+
+  rx.canfd = canfd;
+  rx.tick_ms = RX_REPORT_MS;
+  rx.on_frame = capture_frame;
+  rx.on_tick = capture_tick;
+  rx.arg = &cap;
+
+  printf("Capturing to %s in %d byte blocks. Type Q to stop.\n", path,
+         CONFIG_INDUSTRY_ETCETERA_CANTEST_CAPTURE_BLKSIZE);
+  fflush(stdout);
+
+  cap.cs_start_us = now_us();
+  cap.cs_last_us = cap.cs_start_us;
+  ret = rx_loop(&rx);
+
+  /* Flush the partial block, then hand over an empty one to stop */
+
+  if (cap.cs_fill > 0)
+    {
+      while (sem_wait(&cap.cs_empty) < 0 && errno == EINTR);
+      capture_pass(&cap);
+    }
+
+  while (sem_wait(&cap.cs_empty) < 0 && errno == EINTR);
+  capture_pass(&cap);
+  pthread_join(writer, NULL);
+
+  elapsed_ms = (now_us() - cap.cs_start_us) / 1000;
+  rate = elapsed_ms ? (uint64_t)cap.cs_written * 1000 / elapsed_ms : 0;
+
+  printf("Captured %" PRIu32 " frames, %" PRIu32 " bytes in %" PRIu32
+         " ms: %" PRIu32 ".%02" PRIu32 " MB/s sustained\n"
+         "%" PRIu32 " frames dropped (writer behind), %" PRIu32
+         " RX overflow reports\n",
+         cap.cs_frames, cap.cs_written, elapsed_ms, rate / 1000000,
+         rate / 10000 % 100, cap.cs_dropped, cap.cs_overflows);
+
+  if (cap.cs_werror != 0)
+    {
+      printf("Error writing capture file: %d\n", cap.cs_werror);
+      ret = cap.cs_werror;
+    }
+
+  fsync(cap.cs_fd);
+  close(cap.cs_fd);
+  sem_destroy(&cap.cs_full);
+  sem_destroy(&cap.cs_empty);
+  return ret;
+}
+
+/****************************************************************************
+ * Name: capture_nbytes
+ *
+ * Description:
+ *   Returns the payload length of a capture record. Data length codes
+ *   above 8 mean 8 bytes unless the record is flagged as CAN FD.
+ ****************************************************************************/
+
+static uint8_t capture_nbytes(uint8_t cr_dlc)
+{
+  if (cr_dlc & CAPTURE_DLC_FD)
+    {
+      return g_dlc2bytes[cr_dlc & CAPTURE_DLC_MASK];
+    }
+
+  return (cr_dlc & CAPTURE_DLC_MASK) > 8 ? 8 : (cr_dlc & CAPTURE_DLC_MASK);
+}
+
+/****************************************************************************
+ * Name: replay_next
+ *
+ * Description:
+ *   Returns the next record of a capture file being replayed, refilling
+ *   the read buffer from the file as needed. Only one buffer's worth of
+ *   the file is held in memory at a time.
+ *
+ * Input parameters:
+ *   rp - Replay session
+ *
+ * Returned value:
+ *   Pointer to the record in the read buffer, or NULL at the end of the
+ *   file or on error (rp_error is set for errors).
+ ****************************************************************************/
+
+static FAR const struct capture_rec_s *
+replay_next(FAR struct replay_s *rp)
+{
+  FAR const struct capture_rec_s *rec;
+  size_t avail;
+  size_t len;
+  ssize_t ret;
+
+  while (true)
+    {
+      avail = rp->rp_fill - rp->rp_pos;
+      if (avail >= CAPTURE_RECLEN(0))
+        {
+          rec = (FAR const struct capture_rec_s *)(rp->rp_buf + rp->rp_pos);
+          if (rec->cr_dlc & ~(CAPTURE_DLC_FD | CAPTURE_DLC_BRS |
+                              CAPTURE_DLC_MASK))
+            {
+              rp->rp_error = EINVAL;
+              return NULL;
+            }
+
+          len = CAPTURE_RECLEN(capture_nbytes(rec->cr_dlc));
+          if (avail >= len)
+            {
+              rp->rp_pos += len;
+              return rec;
+            }
+        }
+
+      if (rp->rp_eof)
+        {
+          if (avail != 0)
+            {
+              printf("Ignoring truncated record at the end of the file\n");
+            }
+
+          return NULL;
+        }
+
+      /* Move the partial record to the front and refill */
+
+      memmove(rp->rp_buf, rp->rp_buf + rp->rp_pos, avail);
+      rp->rp_fill = avail;
+      rp->rp_pos = 0;
+
+      ret = read(rp->rp_fd, rp->rp_buf + rp->rp_fill,
+                 REPLAY_BUFSIZE - rp->rp_fill);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          rp->rp_error = errno;
+          return NULL;
+        }
+
+      rp->rp_eof = ret == 0;
+      rp->rp_fill += ret;
+    }
+}
+
+/****************************************************************************
+ * Name: replay_msg
+ *
+ * Description:
+ *   Converts a capture record into a frame to transmit.
+ *
+ * Returned value:
+ *   The frame length in bytes, or 0 if the record cannot be transmitted
+ *   (error frames, or extended IDs or FD frames the build does not
+ *   support).
+ ****************************************************************************/
+
+static size_t replay_msg(FAR const struct capture_rec_s *rec,
+                         FAR struct can_msg_s *msg)
+{
+  if (rec->cr_id & CAPTURE_ID_ERR)
+    {
+      return 0;
+    }
+
+#ifndef CONFIG_CAN_EXTID
+  if (rec->cr_id & CAPTURE_ID_EXT)
+    {
+      return 0;
+    }
+#endif
+
+#ifndef CONFIG_CAN_FD
+  if (rec->cr_dlc & CAPTURE_DLC_FD)
+    {
+      return 0;
+    }
+#endif
+
+  memset(&msg->cm_hdr, 0, sizeof(msg->cm_hdr));
+  msg->cm_hdr.ch_id = rec->cr_id & CAPTURE_ID_MASK;
+  msg->cm_hdr.ch_rtr = (rec->cr_id & CAPTURE_ID_RTR) != 0;
+#ifdef CONFIG_CAN_EXTID
+  msg->cm_hdr.ch_extid = (rec->cr_id & CAPTURE_ID_EXT) != 0;
+#endif
+  msg->cm_hdr.ch_dlc = rec->cr_dlc & CAPTURE_DLC_MASK;
+#ifdef CONFIG_CAN_FD
+  msg->cm_hdr.ch_edl = (rec->cr_dlc & CAPTURE_DLC_FD) != 0;
+  msg->cm_hdr.ch_brs = (rec->cr_dlc & CAPTURE_DLC_BRS) != 0;
+#endif
+  memcpy(msg->cm_data, rec->cr_data, capture_nbytes(rec->cr_dlc));
+
+  return CAN_MSGLEN(capture_nbytes(rec->cr_dlc));
+}
+
+/****************************************************************************
+ * Name: run_replay
+ *
+ * Description:
+ *   Retransmits a capture file with its original inter-frame timing scaled
+ *   by a speed factor. Each frame's due time is computed from the start of
+ *   the replay rather than from the previous frame, and the thread sleeps
+ *   to that absolute deadline, so scheduling errors do not accumulate.
+ *   Frames due within REPLAY_BATCH_US of each other are sent with a single
+ *   write(). Error frames are counted but not sent.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device
+ *   path  - Capture file written by --capture
+ *   speed - Replay speed in percent of real time
+ *
+ * Returned value:
+ *   OK on success, otherwise a positive errno value.
+ ****************************************************************************/
+
+static int run_replay(int canfd, FAR const char *path, uint32_t speed)
+{
+  struct pollfd stdin_pfd =
+    {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+  struct capture_filehdr_s hdr;
+  FAR const struct capture_rec_s *rec;
+  struct replay_s rp;
+  struct lathist_s late;
+  struct timespec deadline;
+  uint64_t start;
+  uint64_t rec_us = 0;
+  uint64_t due;
+  uint64_t batch_due = 0;
+  uint64_t now;
+  uint32_t sent = 0;
+  uint32_t skipped = 0;
+  uint32_t writes = 0;
+  uint32_t early = 0;
+  size_t len = 0;
+  size_t done;
+  size_t n;
+  ssize_t ret = 0;
+
+  if (speed == 0)
+    {
+      puts("Speed must be at least 1%.");
+      return EINVAL;
+    }
+
+  memset(&rp, 0, sizeof(rp));
+  memset(&late, 0, sizeof(late));
+  rp.rp_buf = (FAR uint8_t *)g_capbuf;
+
+  rp.rp_fd = open(path, O_RDONLY);
+  if (rp.rp_fd < 0)
+    {
+      printf("Error opening capture file %s: %d\n", path, errno);
+      return errno;
+    }
+
+  if (read(rp.rp_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.cf_magic != CAPTURE_MAGIC || hdr.cf_version != CAPTURE_VERSION)
+    {
+      printf("%s is not a version %d capture file\n", path,
+             CAPTURE_VERSION);
+      close(rp.rp_fd);
+      return EINVAL;
+    }
+
+  printf("Replaying %s at %" PRIu32 "%% speed. Type Q to stop.\n", path,
+         speed);
+  fflush(stdout);
+
+  start = now_us() + REPLAY_LEAD_US;
+
+  while (true)
+    {
+      rec = replay_next(&rp);
+
+      if (rec != NULL)
+        {
+          rec_us += rec->cr_delta;
+          due = start + rec_us * 100 / speed;
+        }
+
+      /* Send the pending batch once the next frame is not due with it */
+
+      if (len > 0 &&
+          (rec == NULL || due - batch_due > REPLAY_BATCH_US ||
+           len + CAN_MSGLEN(CAN_MAXDATALEN) > sizeof(g_txbuf)))
+        {
+          deadline.tv_sec = batch_due / 1000000;
+          deadline.tv_nsec = (batch_due % 1000000) * 1000;
+          while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                                 NULL) == EINTR);
+
+          now = now_us();
+          if (now < batch_due)
+            {
+              ++early;
+            }
+          else
+            {
+              lathist_add(&late, (uint32_t)(now - batch_due));
+            }
+
+          for (done = 0; done < len; done += ret)
+            {
+              ret = write(canfd, g_txbuf + done, len - done);
+              if (ret < 0)
+                {
+                  if (errno == EINTR)
+                    {
+                      ret = 0;
+                      continue;
+                    }
+
+                  break;
+                }
+            }
+
+          if (ret < 0)
+            {
+              printf("write() failed: %d\n", errno);
+              break;
+            }
+
+          ++writes;
+          len = 0;
+
+          if (poll(&stdin_pfd, 1, 0) > 0 && rx_read_stdin_quit() != 0)
+            {
+              break;
+            }
+        }
+
+      if (rec == NULL)
+        {
+          break;
+        }
+
+      n = replay_msg(rec, (FAR struct can_msg_s *)(g_txbuf + len));
+      if (n == 0)
+        {
+          ++skipped;
+          continue;
+        }
+
+      if (len == 0)
+        {
+          batch_due = due;
+        }
+
+      len += n;
+      ++sent;
+    }
+
+  close(rp.rp_fd);
+
+  if (rp.rp_error != 0)
+    {
+      printf("Error reading capture file: %d\n", rp.rp_error);
+    }
+
+  now = now_us();
+  printf("Sent %" PRIu32 " frames in %" PRIu32 " write()s, skipped %"
+         PRIu32 " error or unsupported frames\n", sent, writes, skipped);
+  printf("Recording spans %" PRIu32 " ms, replay took %" PRIu32
+         " ms (expected %" PRIu32 " ms)\n", (uint32_t)(rec_us / 1000),
+         (uint32_t)((now - start) / 1000),
+         (uint32_t)(rec_us * 100 / speed / 1000));
+  lathist_print(&late, "Batch lateness against the recording");
+  if (early != 0)
+    {
+      printf("%" PRIu32 " batches sent early\n", early);
+    }
+
+  return rp.rp_error;
+}
+
+/****************************************************************************
+ * Name: cantop_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the statistics mode. Updates the per-ID
+ *   counters and period statistics and the bus load totals.
+ ****************************************************************************/
+
+static void cantop_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                         FAR void *arg)
+{
+  FAR struct cantop_s *top = arg;
+  FAR struct idstat_s *st;
+  uint32_t period;
+  int slot;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      ++top->ct_errframes;
+      return;
+    }
+#endif
+
+  top->ct_bits += canmsg_bits(msg);
+  ++top->ct_frames;
+
+  slot = idtab_find(top->ct_keys, idtab_key(msg), true);
+  if (slot < 0)
+    {
+      ++top->ct_untracked;
+      return;
+    }
+
+  st = &top->ct_stats[slot];
+  if (st->is_count > 0)
+    {
+      period = ts_us - st->is_last_us;
+      if (st->is_count == 1 || period < st->is_min_us)
+        {
+          st->is_min_us = period;
+        }
+
+      if (period > st->is_max_us)
+        {
+          st->is_max_us = period;
+        }
+
+      st->is_sum_us += period;
+      st->is_sumsq += (uint64_t)period * period;
+    }
+
+  st->is_last_us = ts_us;
+  st->is_dlc = msg->cm_hdr.ch_dlc;
+  ++st->is_count;
+  ++st->is_window;
+}
+
+/****************************************************************************
+ * Name: cantop_compare
+ *
+ * Description:
+ *   qsort() comparator ordering slots by frames in the current window,
+ *   then by ID.
+ ****************************************************************************/
+
+static int cantop_compare(FAR const void *a, FAR const void *b)
+{
+  FAR const struct cantop_s *top = &g_cantop;
+  uint16_t sa = *(FAR const uint16_t *)a;
+  uint16_t sb = *(FAR const uint16_t *)b;
+
+  if (top->ct_stats[sa].is_window != top->ct_stats[sb].is_window)
+    {
+      return top->ct_stats[sa].is_window < top->ct_stats[sb].is_window ?
+             1 : -1;
+    }
+
+  return top->ct_keys[sa] < top->ct_keys[sb] ? -1 : 1;
+}
+
+/****************************************************************************
+ * Name: cantop_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the statistics mode. Redraws the table,
+ *   busiest IDs first, then starts a new measurement window.
+ ****************************************************************************/
+
+static void cantop_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct cantop_s *top = arg;
+  FAR struct idstat_s *st;
+  uint32_t elapsed_ms;
+  uint32_t load;
+  uint32_t mean;
+  uint32_t jitter;
+  uint32_t n;
+  int nslots = 0;
+  int i;
+
+  elapsed_ms = (now - top->ct_window_us) / 1000;
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  for (i = 0; i < IDTAB_SIZE; ++i)
+    {
+      if (top->ct_keys[i] != IDTAB_EMPTY)
+        {
+          top->ct_order[nslots++] = i;
+        }
+    }
+
+  qsort(top->ct_order, nslots, sizeof(top->ct_order[0]), cantop_compare);
+
+  /* Load in tenths of a percent */
+
+  load = top->ct_bitrate ?
+         (uint32_t)(top->ct_bits * 1000000 /
+                    ((uint64_t)top->ct_bitrate * elapsed_ms)) : 0;
+
+  fmt_puts("\033[H\033[2J");
+  fmt_printf("Bus load: %" PRIu32 ".%" PRIu32 "%% at %" PRIu32 " bit/s, %"
+             PRIu32 " frames/s, %d IDs, %" PRIu32 " error frames, %" PRIu32
+             " untracked\n",
+             load / 10, load % 10, top->ct_bitrate,
+             (uint32_t)((uint64_t)top->ct_frames * 1000 / elapsed_ms),
+             nslots, top->ct_errframes, top->ct_untracked);
+  fmt_puts("        ID DLC  frames/s   min ms  mean ms   max ms jitter ms\n");
+
+  for (i = 0; i < nslots && i < top->ct_rows; ++i)
+    {
+      st = &top->ct_stats[top->ct_order[i]];
+      n = st->is_count > 1 ? st->is_count - 1 : 0;
+      mean = n ? st->is_sum_us / n : 0;
+      jitter = n ? isqrt64(st->is_sumsq / n - (uint64_t)mean * mean) : 0;
+
+      fmt_printf("%c%9" PRIx32 " %3u %9" PRIu32
+                 " %4" PRIu32 ".%03" PRIu32 " %4" PRIu32 ".%03" PRIu32
+                 " %4" PRIu32 ".%03" PRIu32 " %5" PRIu32 ".%03" PRIu32 "\n",
+                 (top->ct_keys[top->ct_order[i]] & IDTAB_EXT) ? 'x' : ' ',
+                 top->ct_keys[top->ct_order[i]] & ~IDTAB_EXT,
+                 st->is_dlc,
+                 (uint32_t)((uint64_t)st->is_window * 1000 / elapsed_ms),
+                 st->is_min_us / 1000, st->is_min_us % 1000,
+                 mean / 1000, mean % 1000,
+                 st->is_max_us / 1000, st->is_max_us % 1000,
+                 jitter / 1000, jitter % 1000);
+      st->is_window = 0;
+    }
+
+  for (; i < nslots; ++i)
+    {
+      top->ct_stats[top->ct_order[i]].is_window = 0;
+    }
+
+  fmt_puts("Type Q to quit.\n");
+
+  top->ct_window_us = now;
+  top->ct_bits = 0;
+  top->ct_frames = 0;
+}
+
+/****************************************************************************
+ * Name: test_cantop
+ *
+ * Description:
+ *   Bus load and per-ID statistics ("cantop"). Counts frames per ID using
+ *   a fixed-size table and periodically redraws rate, period and jitter
+ *   for the busiest IDs along with the estimated bus utilization.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_cantop(int canfd)
+{
+  FAR struct cantop_s *top = &g_cantop;
+  struct canioc_bittiming_s bt;
+  struct rx_loop_s rx;
+  long bitrate = 500000;
+  int ret;
+
+  memset(top, 0, sizeof(*top));
+  memset(top->ct_keys, 0xff, sizeof(top->ct_keys));
+  memset(&rx, 0, sizeof(rx));
+
+  if (ioctl(canfd, CANIOC_GET_BITTIMING, &bt) >= 0)
+    {
+      bitrate = bt.bt_baud;
+    }
+
+  top->ct_bitrate = prompt_long("Bit rate in bit/s", bitrate);
+  top->ct_rows = prompt_long("Number of IDs to show", 16);
+  rx.tick_ms = prompt_long("Redraw interval in ms", 1000);
+
+  if (rx.tick_ms == 0)
+    {
+      rx.tick_ms = 1000;
+    }
+
+  rx.canfd = canfd;
+  rx.on_frame = cantop_frame;
+  rx.on_tick = cantop_tick;
+  rx.arg = top;
+
+  top->ct_window_us = now_us();
+  ret = rx_loop(&rx);
+
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+}
+
+/****************************************************************************
+ * Name: sniffer_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the sniffer view. Stores the payload of
+ *   each ID and remembers which bytes changed since the last repaint.
+ ****************************************************************************/
+
+static void sniffer_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                          FAR void *arg)
+{
+  FAR struct sniffer_s *sn = arg;
+  FAR struct sniffrow_s *row;
+  int slot;
+  int i;
+
+  ++sn->sn_frames;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      ++sn->sn_errframes;
+      return;
+    }
+#endif
+
+  slot = idtab_find(sn->sn_keys, idtab_key(msg), false);
+  if (slot < 0)
+    {
+      if (sn->sn_nrows == sn->sn_maxrows ||
+          (slot = idtab_find(sn->sn_keys, idtab_key(msg), true)) < 0)
+        {
+          ++sn->sn_untracked;
+          return;
+        }
+
+      /* New IDs get the next screen row and are drawn in full */
+
+      row = &sn->sn_rows[slot];
+      row->sr_line = SNIFF_HEADER_LINES + 1 + sn->sn_nrows++;
+      row->sr_changed = SNIFF_ALL_BYTES;
+    }
+
+  row = &sn->sn_rows[slot];
+
+  if (msg->cm_hdr.ch_dlc != row->sr_dlc ||
+      msg->cm_hdr.ch_rtr != row->sr_rtr)
+    {
+      row->sr_changed = SNIFF_ALL_BYTES;
+    }
+
+  for (i = 0; i < canmsg_nbytes(msg); ++i)
+    {
+      if (msg->cm_data[i] != row->sr_data[i])
+        {
+          row->sr_changed |= (sniff_mask_t)1 << i;
+          row->sr_data[i] = msg->cm_data[i];
+        }
+    }
+
+  row->sr_dlc = msg->cm_hdr.ch_dlc;
+  row->sr_nbytes = canmsg_nbytes(msg);
+  row->sr_rtr = msg->cm_hdr.ch_rtr;
+  ++row->sr_count;
+}
+
+/****************************************************************************
+ * Name: sniffer_row
+ *
+ * Description:
+ *   Renders one table row in place: moves the cursor to the row's line,
+ *   prints the payload with the bytes in "lit" shown in reverse video and
+ *   clears the rest of the line.
+ *
+ * Returned value:
+ *   false if the console is too far behind to take the row.
+ ****************************************************************************/
+
+static bool sniffer_row(uint32_t key, FAR const struct sniffrow_s *row,
+                        sniff_mask_t lit)
+{
+  FAR char *line;
+  FAR char *p;
+  bool on = false;
+  int i;
+
+  line = fmt_reserve(SNIFF_ROW_MAX, FMT_FRAME_LIMIT);
+  if (line == NULL)
+    {
+      return false;
+    }
+
+  p = line + snprintf(line, SNIFF_ROW_MAX,
+                      "\033[%d;1H%c%8" PRIx32 " %3u %10" PRIu32 " ",
+                      row->sr_line, (key & IDTAB_EXT) ? 'x' : ' ',
+                      (uint32_t)(key & ~IDTAB_EXT), row->sr_dlc,
+                      row->sr_count);
+
+  if (row->sr_rtr)
+    {
+      memcpy(p, " remote", 7);
+      p += 7;
+    }
+  else
+    {
+      for (i = 0; i < row->sr_nbytes; ++i)
+        {
+          if ((lit & ((sniff_mask_t)1 << i)) == 0 && on)
+            {
+              memcpy(p, "\033[m", 3);
+              p += 3;
+              on = false;
+            }
+
+          *p++ = ' ';
+
+          if ((lit & ((sniff_mask_t)1 << i)) != 0 && !on)
+            {
+              memcpy(p, "\033[7m", 4);
+              p += 4;
+              on = true;
+            }
+
+          *p++ = g_hexdigits[row->sr_data[i] >> 4];
+          *p++ = g_hexdigits[row->sr_data[i] & 0x0f];
+        }
+    }
+
+  if (on)
+    {
+      memcpy(p, "\033[m", 3);
+      p += 3;
+    }
+
+  memcpy(p, "\033[K", 3);
+  p += 3;
+
+  g_fmt.len += p - line;
+  return true;
+}
+
+/****************************************************************************
+ * Name: sniffer_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the sniffer view. Repaints only the rows
+ *   whose payload changed since the last tick, plus the rows whose
+ *   highlighting from the last tick has to be removed; frame counts of
+ *   other rows are brought up to date with their next repaint. Rows that
+ *   do not fit in the output buffer are repainted on the next tick.
+ ****************************************************************************/
+
+static void sniffer_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct sniffer_s *sn = arg;
+  FAR struct sniffrow_s *row;
+  uint32_t elapsed_ms;
+  int i;
+
+  elapsed_ms = (now - sn->sn_window_us) / 1000;
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  if (sn->sn_clear)
+    {
+      fmt_puts("\033[H\033[2J\033[2;1H");
+      fmt_puts("       ID DLC      count  data\n");
+      sn->sn_clear = false;
+    }
+
+  for (i = 0; i < IDTAB_SIZE; ++i)
+    {
+      row = &sn->sn_rows[i];
+      if (sn->sn_keys[i] == IDTAB_EMPTY ||
+          (row->sr_changed | row->sr_lit) == 0)
+        {
+          continue;
+        }
+
+      if (!sniffer_row(sn->sn_keys[i], row, row->sr_changed))
+        {
+          break;
+        }
+
+      row->sr_lit = row->sr_changed;
+      row->sr_changed = 0;
+    }
+
+  fmt_printf("\033[1;1H%" PRIu32 " frames/s, %d IDs, %" PRIu32
+             " untracked, %" PRIu32 " error frames. Type Q to quit.\033[K"
+             "\033[%d;1H", (uint32_t)((uint64_t)sn->sn_frames * 1000 /
+                                      elapsed_ms),
+             sn->sn_nrows, sn->sn_untracked, sn->sn_errframes,
+             SNIFF_HEADER_LINES + 1 + sn->sn_nrows);
+
+  sn->sn_window_us = now;
+  sn->sn_frames = 0;
+}
+
+/****************************************************************************
+ * Name: test_sniffer
+ *
+ * Description:
+ *   Change-only table view ("sniffer"). Keeps the last payload of each ID
+ *   and updates that ID's row in place with ANSI cursor movement at a
+ *   capped repaint rate, highlighting the bytes that changed. Console
+ *   traffic depends on how much the data changes, not on the frame rate.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_sniffer(int canfd)
+{
+  FAR struct sniffer_s *sn = &g_sniffer;
+  struct rx_loop_s rx;
+  int ret;
+
+  memset(sn, 0, sizeof(*sn));
+  memset(sn->sn_keys, 0xff, sizeof(sn->sn_keys));
+  memset(&rx, 0, sizeof(rx));
+
+  sn->sn_maxrows = prompt_long("Number of IDs to show", 32);
+  rx.tick_ms = prompt_long("Repaint interval in ms", 100);
+
+  if (sn->sn_maxrows <= 0 || sn->sn_maxrows > IDTAB_SIZE)
+    {
+      sn->sn_maxrows = IDTAB_SIZE;
+    }
+
+  if (rx.tick_ms == 0)
+    {
+      rx.tick_ms = 100;
+    }
+
+  rx.canfd = canfd;
+  rx.on_frame = sniffer_frame;
+  rx.on_tick = sniffer_tick;
+  rx.arg = sn;
+
+  sn->sn_clear = true;
+  sn->sn_window_us = now_us();
+  ret = rx_loop(&rx);
+
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+}
+
+/****************************************************************************
+ * Name: find_candevs
+ *
+ * Description:
+ *   Lists the CAN devices in /dev in alphabetical order. Devices whose
+ *   path does not fit in CANDEV_NAMELEN are skipped with a message.
+ *
+ * Input parameters:
+ *   names - Receives up to max paths such as "/dev/can0"
+ *   max   - Size of names
+ *
+ * Returned value:
+ *   Number of devices found (which may exceed max), or -1 with errno set.
+ ****************************************************************************/
+
+static int find_candevs(char names[][CANDEV_NAMELEN], int max)
+{
+  struct dirent **devs;
+  int numdevs;
+  int found = 0;
+  int i;
+
+  numdevs = scandir("/dev", &devs, filter_candevs, alphasort);
+  if (numdevs < 0)
+    {
+      return -1;
+    }
+
+  for (i = 0; i < numdevs; ++i)
+    {
+      if (strlen(devs[i]->d_name) + 5 >= CANDEV_NAMELEN)
+        {
+          printf("Skipping /dev/%s: name too long.\n", devs[i]->d_name);
+        }
+      else
+        {
+          if (found < max)
+            {
+              snprintf(names[found], CANDEV_NAMELEN, "/dev/%.*s",
+                       CANDEV_NAMELEN - 6, devs[i]->d_name);
+            }
+
+          ++found;
+        }
+
+      free(devs[i]);
+    }
+
+  free(devs);
+  return found;
+}
+
+/****************************************************************************
+ * Name: multibus_report
+ *
+ * Description:
+ *   Prints the per-bus frame rate and load since the previous report.
+ ****************************************************************************/
+
+static void multibus_report(FAR struct multibus_s *mb, uint64_t now)
+{
+  FAR struct multibus_dev_s *bus;
+  uint32_t elapsed_ms = (now - mb->mb_report_us) / 1000;
+  uint32_t load;
+  int i;
+
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  fmt_puts("--");
+  for (i = 0; i < mb->mb_ndevs; ++i)
+    {
+      bus = &mb->mb_devs[i];
+      load = bus->md_bitrate ?
+             (uint32_t)(bus->md_bits * 1000000 /
+                        ((uint64_t)bus->md_bitrate * elapsed_ms)) : 0;
+
+      fmt_printf(" %s: %" PRIu32 " frames/s %" PRIu32 ".%" PRIu32
+                 "%% load %" PRIu32 " errors;", bus->md_name + 5,
+                 (uint32_t)((uint64_t)bus->md_frames * 1000 / elapsed_ms),
+                 load / 10, load % 10, bus->md_errors);
+
+      bus->md_bits = 0;
+      bus->md_frames = 0;
+      bus->md_errors = 0;
+    }
+
+  fmt_puts("\n");
+  mb->mb_report_us = now;
+}
+
+/****************************************************************************
+ * Name: multibus_drain
+ *
+ * Description:
+ *   Reads what one device has queued into its share of g_rxbuf.
+ *
+ * Returned value:
+ *   0 on success (including nothing to read), otherwise an errno value.
+ ****************************************************************************/
+
+static int multibus_drain(FAR struct multibus_dev_s *bus)
+{
+  ssize_t ret;
+
+  ret = read(bus->md_fd, bus->md_buf, bus->md_bufsize);
+  if (ret < 0)
+    {
+      return errno == EAGAIN || errno == EINTR ? 0 : errno;
+    }
+
+  bus->md_len = ret;
+  bus->md_offset = 0;
+  bus->md_read_us = now_us();
+  return 0;
+}
+
+/****************************************************************************
+ * Name: multibus_next
+ *
+ * Description:
+ *   Returns the next unconsumed frame in a device's buffer and its receive
+ *   time, or NULL if the buffer is used up.
+ ****************************************************************************/
+
+static FAR struct can_msg_s *multibus_next(FAR struct multibus_dev_s *bus,
+                                           FAR uint64_t *ts_us)
+{
+  FAR struct can_msg_s *msg;
+
+  if (bus->md_offset + CAN_MSGLEN(0) > bus->md_len)
+    {
+      return NULL;
+    }
+
+  msg = (FAR struct can_msg_s *)(bus->md_buf + bus->md_offset);
+  if (bus->md_offset + CAN_MSGLEN(canmsg_nbytes(msg)) > bus->md_len)
+    {
+      return NULL;
+    }
+
+  *ts_us = rx_frame_time(msg, bus->md_read_us);
+  return msg;
+}
+
+/****************************************************************************
+ * Name: test_multibus
+ *
+ * Description:
+ *   Receives from every CAN device in one poll() loop. After each wakeup
+ *   the frames read from all buses are merged by timestamp and printed with
+ *   the name of the bus they came from. Per-bus frame rate and load are
+ *   reported once a second.
+ *
+ *   With CONFIG_CAN_TIMESTAMP the merge uses the driver timestamps and is
+ *   exact within each wakeup. Without it the time each device was read is
+ *   all that is known, so frames from different buses are only ordered to
+ *   the granularity of a wakeup.
+ *
+ * Input parameters:
+ *   names - Device paths
+ *   ndevs - Number of devices
+ *
+ * Returned value:
+ *   OK on success, otherwise a positive errno value.
+ ****************************************************************************/
+
+static int test_multibus(char names[][CANDEV_NAMELEN], int ndevs)
+{
+  FAR struct multibus_s *mb = &g_multibus;
+  FAR struct multibus_dev_s *bus;
+  FAR struct can_msg_s *msg;
+  FAR struct can_msg_s *best_msg;
+  struct pollfd fds[MULTIBUS_MAX + 1];
+  struct canioc_bittiming_s bt;
+  char tag[FMT_TAG_MAX];
+  uint64_t start;
+  uint64_t ts;
+  uint64_t best_ts;
+  uint64_t now;
+  size_t share;
+  int best;
+  int ret;
+  int err = OK;
+  int i;
+
+  memset(mb, 0, sizeof(*mb));
+
+  if (ndevs > MULTIBUS_MAX)
+    {
+      printf("Using the first %d of %d CAN devices.\n", MULTIBUS_MAX,
+             ndevs);
+      ndevs = MULTIBUS_MAX;
+    }
+
+  /* Each bus gets an equal, aligned share of the receive buffer */
+
+  share = (sizeof(g_rxbuf) / ndevs) & ~3;
+
+  for (i = 0; i < ndevs; ++i)
+    {
+      bus = &mb->mb_devs[i];
+      strncpy(bus->md_name, names[i], CANDEV_NAMELEN);
+      bus->md_buf = g_rxbuf + i * share;
+      bus->md_bufsize = share;
+      bus->md_fd = open(bus->md_name, O_RDWR | O_NONBLOCK);
+      if (bus->md_fd < 0)
+        {
+          err = errno;
+          printf("Error opening CAN device %s: %d\n", bus->md_name, err);
+          goto errout;
+        }
+
+      ++mb->mb_ndevs;
+
+      if (ioctl(bus->md_fd, CANIOC_GET_BITTIMING, &bt) >= 0)
+        {
+          bus->md_bitrate = bt.bt_baud;
+        }
+
+      fds[i].fd = bus->md_fd;
+      fds[i].events = POLLIN;
+      printf("Listening on %s (%" PRIu32 " bit/s)\n", bus->md_name,
+             bus->md_bitrate);
+    }
+
+  fds[ndevs].fd = STDIN_FILENO;
+  fds[ndevs].events = POLLIN;
+
+  printf("Type Q to quit.\n");
+  fmt_begin();
+
+  start = now_us();
+  mb->mb_report_us = start;
+
+  while (true)
+    {
+      now = now_us();
+      ret = poll(fds, ndevs + 1, now - mb->mb_report_us >= 1000000 ? 0 :
+                 1000 - (now - mb->mb_report_us) / 1000);
+      if (ret < 0 && errno != EINTR)
+        {
+          err = errno;
+          fmt_printf("poll() failed: %d\n", err);
+          break;
+        }
+
+      for (i = 0; ret > 0 && i < ndevs; ++i)
+        {
+          if (fds[i].revents & POLLIN)
+            {
+              err = multibus_drain(&mb->mb_devs[i]);
+              if (err != OK)
+                {
+                  fmt_printf("read() of %s failed: %d\n",
+                             mb->mb_devs[i].md_name, err);
+                  break;
+                }
+            }
+        }
+
+      if (err != OK)
+        {
+          break;
+        }
+
+      /* k-way merge of everything read in this wakeup */
+
+      while (true)
+        {
+          best = -1;
+          best_msg = NULL;
+          best_ts = UINT64_MAX;
+
+          for (i = 0; i < ndevs; ++i)
+            {
+              msg = multibus_next(&mb->mb_devs[i], &ts);
+              if (msg != NULL && ts < best_ts)
+                {
+                  best = i;
+                  best_msg = msg;
+                  best_ts = ts;
+                }
+            }
+
+          if (best < 0)
+            {
+              break;
+            }
+
+          bus = &mb->mb_devs[best];
+          bus->md_offset += CAN_MSGLEN(canmsg_nbytes(best_msg));
+
+#ifdef CONFIG_CAN_ERRORS
+          if (best_msg->cm_hdr.ch_error)
+            {
+              ++bus->md_errors;
+              continue;
+            }
+#endif
+
+          ++bus->md_frames;
+          bus->md_bits += canmsg_bits(best_msg);
+
+          ts = best_ts > start ? best_ts - start : 0;
+          snprintf(tag, sizeof(tag), "%5" PRIu32 ".%06" PRIu32 " %s ",
+                   (uint32_t)(ts / 1000000), (uint32_t)(ts % 1000000),
+                   bus->md_name + 5);
+          fmt_frame(best_msg, tag);
+        }
+
+      for (i = 0; i < ndevs; ++i)
+        {
+          mb->mb_devs[i].md_len = 0;
+        }
+
+      if (ret > 0 && (fds[ndevs].revents & POLLIN))
+        {
+          ret = rx_read_stdin_quit();
+          if (ret < 0)
+            {
+              err = EIO;
+              break;
+            }
+          else if (ret > 0)
+            {
+              fmt_puts("Quit.\n");
+              break;
+            }
+        }
+
+      now = now_us();
+      if (now - mb->mb_report_us >= 1000000)
+        {
+          multibus_report(mb, now);
+        }
+
+      fmt_flush(false);
+    }
+
+  fmt_end();
+
+errout:
+  for (i = 0; i < mb->mb_ndevs; ++i)
+    {
+      close(mb->mb_devs[i].md_fd);
+    }
+
+  return err;
+}
+
+/****************************************************************************
+ * Name: dbc_hash
+ *
+ * Description:
+ *   Hash used for message dispatch. dbc_build_hash() picks the multiplier
+ *   so that no two loaded messages share a slot.
+ ****************************************************************************/
+
+static inline uint32_t dbc_hash(uint32_t key, uint32_t mult)
+{
+  return (key * mult) >> (32 - DBC_HASH_BITS);
+}
+
+/****************************************************************************
+ * Name: dbc_build_hash
+ *
+ * Description:
+ *   Searches for a multiplier that maps every loaded message ID to its own
+ *   slot of the dispatch table (a perfect hash), then fills the table.
+ *
+ * Returned value:
+ *   0 on success, -1 if no collision-free multiplier was found.
+ ****************************************************************************/
+
+static int dbc_build_hash(FAR struct dbc_s *dbc)
+{
+  uint32_t prng = 0x9e3779b9;
+  uint32_t mult;
+  uint32_t slot;
+  int attempt;
+  int i;
+
+  for (attempt = 0; attempt < DBC_HASH_ATTEMPTS; ++attempt)
+    {
+      mult = prng_next(&prng) | 1;
+      memset(dbc->db_slots, 0xff, sizeof(dbc->db_slots));
+
+      for (i = 0; i < dbc->db_nmsgs; ++i)
+        {
+          slot = dbc_hash(dbc->db_msgs[i].dm_key, mult);
+          if (dbc->db_slots[slot] != DBC_SLOT_EMPTY)
+            {
+              break;
+            }
+
+          dbc->db_slots[slot] = i;
+        }
+
+      if (i == dbc->db_nmsgs)
+        {
+          dbc->db_mult = mult;
+          return 0;
+        }
+    }
+
+  return -1;
+}
+
+/****************************************************************************
+ * Name: dbc_add_signal
+ *
+ * Description:
+ *   Compiles one DBC signal into a shift-and-mask extractor. Intel
+ *   (little-endian, @1) signals are extracted from the payload loaded as a
+ *   little-endian 64-bit word, Motorola (big-endian, @0) signals from the
+ *   payload loaded as a big-endian word, so every signal is one shift and
+ *   one mask at run time.
+ *
+ * Input parameters:
+ *   dbc       - Database being built
+ *   start     - DBC start bit
+ *   len       - Length in bits (1-64)
+ *   bigendian - Motorola byte order
+ *   is_signed - Two's complement signal
+ *   factor    - Scale
+ *   offset    - Offset
+ *   name      - Signal name
+ *   unit      - Unit string
+ *
+ * Returned value:
+ *   0 on success, -1 if the signal is invalid or the table is full.
+ ****************************************************************************/
+
+static int dbc_add_signal(FAR struct dbc_s *dbc, int start, int len,
+                          bool bigendian, bool is_signed, float factor,
+                          float offset, FAR const char *name,
+                          FAR const char *unit)
+{
+  FAR struct dbc_msg_s *msg = &dbc->db_msgs[dbc->db_nmsgs - 1];
+  FAR struct dbc_sig_s *sig;
+  int msb;
+  int shift;
+
+  if (dbc->db_nsigs == DBC_MAX_SIGNALS || len < 1 || len > 64 ||
+      start < 0 || start > 63)
+    {
+      return -1;
+    }
+
+  if (bigendian)
+    {
+      /* DBC numbers Motorola bits by byte, LSB first, with the start bit
+       * being the signal's MSB. Convert to a bit index counted from the MSB
+       * of the big-endian word.
+       */
+
+      msb = (start / 8) * 8 + (7 - start % 8);
+      shift = 64 - (msb + len);
+    }
+  else
+    {
+      shift = start;
+      if (start + len > 64)
+        {
+          return -1;
+        }
+    }
+
+  if (shift < 0)
+    {
+      return -1;
+    }
+
+  sig = &dbc->db_sigs[dbc->db_nsigs++];
+  sig->ds_shift = shift;
+  sig->ds_len = len;
+  sig->ds_mask = len == 64 ? UINT64_MAX : ((uint64_t)1 << len) - 1;
+  sig->ds_bigendian = bigendian;
+  sig->ds_signed = is_signed;
+  sig->ds_factor = factor;
+  sig->ds_offset = offset;
+  snprintf(sig->ds_name, sizeof(sig->ds_name), "%s", name);
+  snprintf(sig->ds_unit, sizeof(sig->ds_unit), "%s", unit);
+
+  ++msg->dm_nsigs;
+  msg->dm_textmax += 2 + strlen(sig->ds_name) + DBC_VALUE_MAX +
+                     strlen(sig->ds_unit);
+  return 0;
+}
+
+/****************************************************************************
+ * Name: dbc_load
+ *
+ * Description:
+ *   Loads the BO_ (message) and SG_ (signal) lines of a DBC file into
+ *   g_dbc. Everything else in the file is ignored. Multiplexed signals are
+ *   not supported and are skipped.
+ *
+ * Input parameters:
+ *   path - DBC file
+ *
+ * Returned value:
+ *   0 on success, -1 on error (a message has been printed).
+ ****************************************************************************/
+
+static int dbc_load(FAR const char *path)
+{
+  FAR struct dbc_s *dbc = &g_dbc;
+  char line[DBC_LINE_MAX];
+  char name[DBC_NAME_MAX];
+  char unit[DBC_UNIT_MAX];
+  unsigned long id;
+  FAR char *p;
+  FAR FILE *f;
+  float factor;
+  float offset;
+  char order;
+  char sign;
+  int lineno = 0;
+  int start;
+  int len;
+
+  memset(dbc, 0, sizeof(*dbc));
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    {
+      printf("Error opening %s: %d\n", path, errno);
+      return -1;
+    }
+
+  while (fgets(line, sizeof(line), f) != NULL)
+    {
+      ++lineno;
+      for (p = line; *p == ' ' || *p == '\t'; ++p);
+
+      if (strncmp(p, "BO_ ", 4) == 0)
+        {
+          if (sscanf(p + 4, "%lu %31[^: ]", &id, name) != 2)
+            {
+              printf("%s:%d: malformed message\n", path, lineno);
+              goto errout;
+            }
+
+          if (dbc->db_nmsgs == DBC_MAX_MESSAGES)
+            {
+              printf("%s:%d: more than %d messages\n", path, lineno,
+                     DBC_MAX_MESSAGES);
+              goto errout;
+            }
+
+          /* DBC marks extended IDs with bit 31 */
+
+          dbc->db_msgs[dbc->db_nmsgs].dm_key =
+            (id & 0x80000000ul) ? ((id & CAN_MAX_EXTMSGID) | IDTAB_EXT) : id;
+          dbc->db_msgs[dbc->db_nmsgs].dm_first = dbc->db_nsigs;
+          dbc->db_msgs[dbc->db_nmsgs].dm_nsigs = 0;
+          snprintf(dbc->db_msgs[dbc->db_nmsgs].dm_name, DBC_NAME_MAX, "%s",
+                   name);
+          dbc->db_msgs[dbc->db_nmsgs].dm_textmax = strlen(name) + 2;
+          ++dbc->db_nmsgs;
+        }
+      else if (strncmp(p, "SG_ ", 4) == 0 && dbc->db_nmsgs > 0)
+        {
+          unit[0] = '\0';
+          if (sscanf(p + 4, "%31s : %d|%d@%c%c (%f,%f) %*s \"%7[^\"]\"",
+                     name, &start, &len, &order, &sign, &factor,
+                     &offset, unit) < 7)
+            {
+              /* Multiplexed signals have an extra token before the colon */
+
+              continue;
+            }
+
+          if (dbc_add_signal(dbc, start, len, order == '0', sign == '-',
+                             factor, offset, name, unit) < 0)
+            {
+              printf("%s:%d: unsupported signal %s\n", path, lineno, name);
+              goto errout;
+            }
+
+          if (dbc->db_msgs[dbc->db_nmsgs - 1].dm_textmax > FMT_FRAME_LIMIT)
+            {
+              printf("%s:%d: too many signals to show on one line\n", path,
+                     lineno);
+              goto errout;
+            }
+        }
+    }
+
+  fclose(f);
+
+  if (dbc->db_nmsgs == 0)
+    {
+      printf("No messages found in %s\n", path);
+      return -1;
+    }
+
+  if (dbc_build_hash(dbc) < 0)
+    {
+      puts("Unable to build a collision-free dispatch table.");
+      return -1;
+    }
+
+  printf("Loaded %d messages with %d signals.\n", dbc->db_nmsgs,
+         dbc->db_nsigs);
+  return 0;
+
+errout:
+  fclose(f);
+  return -1;
+}
+
+/****************************************************************************
+ * Name: dbc_extract
+ *
+ * Description:
+ *   Extracts the raw value of a signal from pre-loaded payload words.
+ *
+ * Input parameters:
+ *   sig - Compiled signal
+ *   le  - Payload as a little-endian 64-bit word
+ *   be  - Payload as a big-endian 64-bit word
+ ****************************************************************************/
+
+static inline int64_t dbc_extract(FAR const struct dbc_sig_s *sig,
+                                  uint64_t le, uint64_t be)
+{
+  uint64_t raw;
+
+  raw = ((sig->ds_bigendian ? be : le) >> sig->ds_shift) & sig->ds_mask;
+
+  if (sig->ds_signed && sig->ds_len < 64 &&
+      (raw & ((uint64_t)1 << (sig->ds_len - 1))))
+    {
+      raw |= ~sig->ds_mask;
+    }
+
+  return (int64_t)raw;
+}
+
+/****************************************************************************
+ * Name: dbc_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the decode mode. Dispatches the frame
+ *   through the perfect hash and renders each signal's engineering value
+ *   into one line, which is skipped (and counted) like fmt_frame() output
+ *   if the console is too far behind.
+ ****************************************************************************/
+
+static void dbc_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                      FAR void *arg)
+{
+  FAR struct dbc_s *dbc = arg;
+  FAR const struct dbc_msg_s *dm;
+  FAR const struct dbc_sig_s *sig;
+  uint64_t le = 0;
+  uint64_t be = 0;
+  uint32_t key;
+  uint32_t slot;
+  uint32_t centi;
+  FAR char *line;
+  FAR char *p;
+  size_t len;
+  float value;
+  int i;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      errstats_add(&g_errstats, msg, ts_us);
+      return;
+    }
+#endif
+
+  key = idtab_key(msg);
+  slot = dbc->db_slots[dbc_hash(key, dbc->db_mult)];
+  if (slot == DBC_SLOT_EMPTY || dbc->db_msgs[slot].dm_key != key)
+    {
+      ++dbc->db_unknown;
+      return;
+    }
+
+  dm = &dbc->db_msgs[slot];
+
+  for (i = 0; i < canmsg_nbytes(msg) && i < 8; ++i)
+    {
+      le |= (uint64_t)msg->cm_data[i] << (8 * i);
+      be |= (uint64_t)msg->cm_data[i] << (8 * (7 - i));
+    }
+
+  line = fmt_reserve(dm->dm_textmax, FMT_FRAME_LIMIT);
+  if (line == NULL)
+    {
+      ++g_fmt.skipped;
+      return;
+    }
+
+  len = strlen(dm->dm_name);
+  memcpy(line, dm->dm_name, len);
+  p = line + len;
+  *p++ = ':';
+
+  for (i = 0; i < dm->dm_nsigs; ++i)
+    {
+      sig = &dbc->db_sigs[dm->dm_first + i];
+
+      *p++ = ' ';
+      len = strlen(sig->ds_name);
+      memcpy(p, sig->ds_name, len);
+      p += len;
+      *p++ = '=';
+
+      /* Printed with two decimals without needing floating-point printf.
+       * Out-of-range values (and NaN) are clamped before the conversion.
+       */
+
+      value = (dbc_extract(sig, le, be) * sig->ds_factor + sig->ds_offset) *
+              100.0f;
+      if (value < 0.0f)
+        {
+          *p++ = '-';
+          value = -value;
+        }
+
+      centi = value >= 4294967295.0f ? UINT32_MAX :
+              value >= 0.0f ? (uint32_t)value : 0;
+
+      p = fmt_dec(p, centi / 100);
+      *p++ = '.';
+      *p++ = '0' + centi % 100 / 10;
+      *p++ = '0' + centi % 10;
+
+      len = strlen(sig->ds_unit);
+      memcpy(p, sig->ds_unit, len);
+      p += len;
+    }
+
+  *p++ = '\n';
+  g_fmt.len += p - line;
+}
+
+/****************************************************************************
+ * Name: dbc_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the decode mode.
+ ****************************************************************************/
+
+static void dbc_tick(uint64_t now, FAR void *arg)
+{
+#ifdef CONFIG_CAN_ERRORS
+  errstats_report(&g_errstats, now, false);
+#endif
+}
+
+/****************************************************************************
+ * Name: test_dbc_decode
+ *
+ * Description:
+ *   Loads a DBC file once, then shows received frames as decoded signal
+ *   values until the user types Q.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_dbc_decode(int canfd)
+{
+  char path[DBC_LINE_MAX] = {0};
+  struct rx_loop_s rx;
+  int ret;
+
+  fputs("DBC file to load: ", stdout);
+  fflush(stdout);
+  std_readline(path, sizeof(path));
+  path[strcspn(path, "\r\n")] = '\0';
+
+  if (dbc_load(path) < 0)
+    {
+      return;
+    }
+
+  memset(&rx, 0, sizeof(rx));
+  rx.canfd = canfd;
+  rx.tick_ms = RX_REPORT_MS;
+  rx.on_frame = dbc_frame;
+  rx.on_tick = dbc_tick;
+  rx.arg = &g_dbc;
+
+#ifdef CONFIG_CAN_ERRORS
+  errstats_reset(&g_errstats);
+#endif
+
+  printf("Decoding. Type Q to quit.\n");
+  fflush(stdout);
+
+  ret = rx_loop(&rx);
+
+  printf("%" PRIu32 " frames with IDs not in the DBC file\n",
+         g_dbc.db_unknown);
+
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+}
+
+/****************************************************************************
+ * Name: prompt_hexbytes
+ *
+ * Description:
+ *   Prompts for a string of hex bytes such as "01ff" or "01 ff".
+ *
+ * Input parameters:
+ *   prompt - Text to print
+ *   buf    - Receives the bytes; bytes not entered are set to 0
+ *   max    - Size of buf
+ *
+ * Returned value:
+ *   Number of bytes entered.
+ ****************************************************************************/
+
+static int prompt_hexbytes(FAR const char *prompt, FAR uint8_t *buf,
+                           int max)
+{
+  char line[3 * CAN_MAXDATALEN + 2] = {0};
+  FAR const char *p;
+  FAR const char *digit;
+  int nibbles = 0;
+
+  memset(buf, 0, max);
+
+  printf("%s: ", prompt);
+  fflush(stdout);
+
+  if (std_readline(line, sizeof(line)) <= 0)
+    {
+      return 0;
+    }
+
+  for (p = line; *p != '\0' && nibbles < 2 * max; ++p)
+    {
+      digit = strchr(g_hexdigits, tolower(*p));
+      if (digit == NULL)
+        {
+          continue;
+        }
+
+      buf[nibbles / 2] = (buf[nibbles / 2] << 4) | (digit - g_hexdigits);
+      ++nibbles;
+    }
+
+  return (nibbles + 1) / 2;
+}
+
+/****************************************************************************
+ * Name: trig_match
+ *
+ * Description:
+ *   Checks whether a received frame fires the armed trigger.
+ ****************************************************************************/
+
+static bool trig_match(FAR struct trig_s *tr,
+                       FAR const struct can_msg_s *msg, uint64_t ts_us)
+{
+  uint32_t key;
+  bool gap;
+  int i;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      return tr->tr_type == TRIG_ERROR &&
+             (msg->cm_hdr.ch_id & tr->tr_errclass) != 0;
+    }
+#endif
+
+  key = idtab_key(msg);
+
+  if (tr->tr_type == TRIG_MATCH)
+    {
+      if ((key ^ tr->tr_key) & tr->tr_idmask)
+        {
+          return false;
+        }
+
+      for (i = 0; i < TRIG_DATA_MAX; ++i)
+        {
+          if (((i < canmsg_nbytes(msg) ? msg->cm_data[i] : 0) ^
+               tr->tr_data[i]) & tr->tr_dmask[i])
+            {
+              return false;
+            }
+        }
+
+      return true;
+    }
+  else if (tr->tr_type == TRIG_GAP && key == tr->tr_key)
+    {
+      gap = tr->tr_seen && ts_us - tr->tr_last_us > tr->tr_gap_us;
+      tr->tr_last_us = ts_us;
+      tr->tr_seen = true;
+      return gap;
+    }
+
+  return false;
+}
+
+/****************************************************************************
+ * Name: trig_fire
+ *
+ * Description:
+ *   Records the trigger point and starts counting post-trigger frames.
+ *
+ * Input parameters:
+ *   tr    - Trigger state
+ *   ts_us - Time of the trigger
+ *   index - Ring index of the trigger frame, or TRIG_NOFRAME if the
+ *           trigger was a timeout rather than a frame
+ ****************************************************************************/
+
+static void trig_fire(FAR struct trig_s *tr, uint64_t ts_us,
+                      uint32_t index)
+{
+  tr->tr_state = TRIG_POST;
+  tr->tr_trig_us = ts_us;
+  tr->tr_trig_idx = index;
+  tr->tr_remaining = tr->tr_post;
+  ++tr->tr_fired;
+}
+
+/****************************************************************************
+ * Name: trig_dump
+ *
+ * Description:
+ *   Prints the captured window with times relative to the trigger. The
+ *   console is switched back to blocking output for the dump so that no
+ *   line of the window is skipped; frames arriving meanwhile queue in the
+ *   driver.
+ ****************************************************************************/
+
+static void trig_dump(FAR struct trig_s *tr)
+{
+  FAR const struct trig_ent_s *ent;
+  char tag[FMT_TAG_MAX];
+  uint32_t first;
+  uint32_t idx;
+  uint32_t n;
+  int64_t rel;
+  bool marked;
+#ifdef CONFIG_CAN_ERRORS
+  int i;
+#endif
+
+  fmt_end();
+
+  printf("Trigger %" PRIu32 " fired, %" PRIu32 " frames in window:\n",
+         tr->tr_fired, tr->tr_count);
+
+  first = (tr->tr_head + TRIG_DEPTH - tr->tr_count) % TRIG_DEPTH;
+  marked = tr->tr_trig_idx != TRIG_NOFRAME;
+
+  for (n = 0; n < tr->tr_count; ++n)
+    {
+      idx = (first + n) % TRIG_DEPTH;
+      ent = &g_trigring[idx];
+
+      /* A timeout trigger has no frame of its own, mark where it fell */
+
+      if (!marked && ent->te_ts_us > tr->tr_trig_us)
+        {
+          fmt_puts(TRIG_GAP_MARKER);
+          marked = true;
+        }
+
+      rel = (int64_t)(ent->te_ts_us - tr->tr_trig_us);
+      rel = rel < INT32_MIN ? INT32_MIN : rel > INT32_MAX ? INT32_MAX : rel;
+      snprintf(tag, sizeof(tag), "%c%+11" PRId32 " us ",
+               idx == tr->tr_trig_idx ? '*' : ' ', (int32_t)rel);
+
+#ifdef CONFIG_CAN_ERRORS
+      if (ent->te_msg.cm_hdr.ch_error)
+        {
+          fmt_printf("%sERR class 0x%03" PRIx32 " DATA (hex):", tag,
+                     (uint32_t)ent->te_msg.cm_hdr.ch_id);
+          for (i = 0; i < canmsg_nbytes(&ent->te_msg); ++i)
+            {
+              fmt_printf(" %02x", ent->te_msg.cm_data[i]);
+            }
+
+          fmt_puts("\n");
+          continue;
+        }
+#endif
+
+      fmt_frame(&ent->te_msg, tag);
+    }
+
+  if (!marked)
+    {
+      fmt_puts(TRIG_GAP_MARKER);
+    }
+
+  fmt_flush(true);
+  fmt_begin();
+}
+
+/****************************************************************************
+ * Name: trig_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the trigger mode. Every frame goes into
+ *   the ring; the trigger is only evaluated while armed.
+ ****************************************************************************/
+
+static void trig_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                       FAR void *arg)
+{
+  FAR struct trig_s *tr = arg;
+  FAR struct trig_ent_s *ent;
+  uint32_t idx;
+
+  if (tr->tr_state != TRIG_ARMED && tr->tr_state != TRIG_POST)
+    {
+      return;
+    }
+
+  idx = tr->tr_head;
+  ent = &g_trigring[idx];
+  ent->te_ts_us = ts_us;
+  memcpy(&ent->te_msg, msg, CAN_MSGLEN(canmsg_nbytes(msg)));
+
+  tr->tr_head = (idx + 1) % TRIG_DEPTH;
+  if (tr->tr_count < TRIG_DEPTH)
+    {
+      ++tr->tr_count;
+    }
+
+  if (tr->tr_state == TRIG_ARMED)
+    {
+      if (trig_match(tr, msg, ts_us))
+        {
+          trig_fire(tr, ts_us, idx);
+        }
+    }
+  else
+    {
+      --tr->tr_remaining;
+    }
+
+  if (tr->tr_state == TRIG_POST && tr->tr_remaining == 0)
+    {
+      tr->tr_state = TRIG_DONE;
+    }
+}
+
+/****************************************************************************
+ * Name: trig_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the trigger mode. Fires gap triggers when
+ *   the periodic ID stops altogether, and dumps a completed window.
+ ****************************************************************************/
+
+static void trig_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct trig_s *tr = arg;
+
+  if (tr->tr_state == TRIG_ARMED && tr->tr_type == TRIG_GAP &&
+      tr->tr_seen && now - tr->tr_last_us > tr->tr_gap_us)
+    {
+      trig_fire(tr, tr->tr_last_us + tr->tr_gap_us, TRIG_NOFRAME);
+      if (tr->tr_remaining == 0)
+        {
+          tr->tr_state = TRIG_DONE;
+        }
+    }
+
+  if (tr->tr_state != TRIG_DONE)
+    {
+      return;
+    }
+
+  trig_dump(tr);
+
+  if (tr->tr_rearm)
+    {
+      tr->tr_state = TRIG_ARMED;
+      tr->tr_count = 0;
+      tr->tr_seen = false;
+      fmt_printf("Re-armed.\n");
+    }
+  else
+    {
+      tr->tr_state = TRIG_IDLE;
+      fmt_printf("Trigger done. Type Q to return to the menu.\n");
+    }
+}
+
+/****************************************************************************
+ * Name: test_trigger_capture
+ *
+ * Description:
+ *   Oscilloscope-style capture. The last TRIG_DEPTH frames are kept in a
+ *   static ring buffer at the cost of one copy per frame. When the trigger
+ *   fires, a chosen number of further frames is recorded and only that
+ *   window is printed.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_trigger_capture(int canfd)
+{
+  FAR struct trig_s *tr = &g_trig;
+  struct rx_loop_s rx;
+  uint32_t id;
+  int ret;
+
+  memset(tr, 0, sizeof(*tr));
+  tr->tr_key = IDTAB_EMPTY;
+  tr->tr_trig_idx = TRIG_NOFRAME;
+
+  tr->tr_type = prompt_long("Trigger: 0 ID and data match, 1 error class, "
+                            "2 gap in a periodic ID", TRIG_MATCH);
+
+  switch (tr->tr_type)
+    {
+      case TRIG_MATCH:
+      case TRIG_GAP:
+        id = prompt_long("ID", 0);
+#ifdef CONFIG_CAN_EXTID
+        if (prompt_long("Extended ID (1/0)", 0) != 0)
+          {
+            id |= IDTAB_EXT;
+          }
+#endif
+        tr->tr_key = id;
+
+        if (tr->tr_type == TRIG_MATCH)
+          {
+            tr->tr_idmask = prompt_long("ID mask", CAN_MAX_STDMSGID) |
+                            IDTAB_EXT;
+            prompt_hexbytes("Data to match (hex bytes)", tr->tr_data,
+                            TRIG_DATA_MAX);
+            prompt_hexbytes("Data mask (hex bytes, empty for none)",
+                            tr->tr_dmask, TRIG_DATA_MAX);
+          }
+        else
+          {
+            tr->tr_gap_us = prompt_long("Fire when no frame for (ms)", 100)
+                            * 1000;
+          }
+        break;
+
+#ifdef CONFIG_CAN_ERRORS
+      case TRIG_ERROR:
+        tr->tr_errclass = prompt_long("Error class bits (CAN_ERROR_*)",
+                                      CAN_ERROR_BUSOFF);
+        break;
+#endif
+
+      default:
+        puts("Unsupported trigger.");
+        return;
+    }
+
+  tr->tr_post = prompt_long("Frames to capture after the trigger",
+                            TRIG_DEPTH / 2);
+  if (tr->tr_post >= TRIG_DEPTH)
+    {
+      printf("At most %d frames can follow the trigger.\n",
+             TRIG_DEPTH - 1);
+      return;
+    }
+
+  tr->tr_rearm = prompt_long("Re-arm after each dump (1/0)", 0) != 0;
+  tr->tr_state = TRIG_ARMED;
+
+  memset(&rx, 0, sizeof(rx));
+  rx.canfd = canfd;
+  rx.tick_ms = TRIG_TICK_MS;
+  rx.on_frame = trig_frame;
+  rx.on_tick = trig_tick;
+  rx.arg = tr;
+
+  printf("Armed with a %d frame ring. Type Q to quit.\n", TRIG_DEPTH);
+  fflush(stdout);
+
+  ret = rx_loop(&rx);
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+
+  printf("Trigger fired %" PRIu32 " times\n", tr->tr_fired);
+}
+
+/****************************************************************************
+ * Name: gw_route
+ *
+ * Description:
+ *   Applies the gateway rule table to a frame. The first rule whose ID and
+ *   mask match and that applies to the frame's direction decides; frames
+ *   matching no rule are forwarded unchanged or dropped depending on
+ *   gw_default_pass.
+ *
+ * Input parameters:
+ *   gw  - Gateway state
+ *   dir - Index of the receiving port (0 or 1)
+ *   msg - The frame. Its ID is rewritten in place if a rule says so.
+ *
+ * Returned value:
+ *   true if the frame should be forwarded.
+ ****************************************************************************/
+
+static bool gw_route(FAR struct gateway_s *gw, int dir,
+                     FAR struct can_msg_s *msg)
+{
+  FAR const struct gw_rule_s *rule;
+  uint32_t key = idtab_key(msg);
+  int i;
+
+  for (i = 0; i < gw->gw_nrules; ++i)
+    {
+      rule = &gw->gw_rules[i];
+      if ((rule->gr_dirs & (1 << dir)) == 0 ||
+          ((key ^ rule->gr_key) & rule->gr_mask) != 0)
+        {
+          continue;
+        }
+
+      if (rule->gr_action == GW_DROP)
+        {
+          return false;
+        }
+      else if (rule->gr_action == GW_REWRITE)
+        {
+          msg->cm_hdr.ch_id = rule->gr_newkey & ~IDTAB_EXT;
+#ifdef CONFIG_CAN_EXTID
+          msg->cm_hdr.ch_extid = (rule->gr_newkey & IDTAB_EXT) != 0;
+#endif
+        }
+
+      return true;
+    }
+
+  return gw->gw_default_pass;
+}
+
+/****************************************************************************
+ * Name: gw_flush
+ *
+ * Description:
+ *   Writes the batch collected in g_txbuf to the output port with one
+ *   write() and records the forwarding latency of every frame in it. The
+ *   output is non-blocking; frames the driver has no room for are dropped
+ *   and counted rather than stalling the other direction.
+ *
+ * Input parameters:
+ *   in    - Port the batch was received on (owns the statistics)
+ *   out   - Port to transmit on
+ *   len   - Bytes in g_txbuf
+ *   nmsgs - Frames in g_txbuf
+ *   ts    - Receive time of each frame
+ ****************************************************************************/
+
+static void gw_flush(FAR struct gw_port_s *in, FAR struct gw_port_s *out,
+                     size_t len, int nmsgs, FAR const uint64_t *ts)
+{
+  FAR struct can_msg_s *msg;
+  ssize_t ret;
+  size_t done;
+  uint64_t now;
+  int i;
+
+  do
+    {
+      ret = write(out->gp_fd, g_txbuf, len);
+    }
+  while (ret < 0 && errno == EINTR);
+
+  done = ret < 0 ? 0 : ret;
+  now = now_us();
+
+  for (i = 0, len = 0; i < nmsgs; ++i)
+    {
+      msg = (FAR struct can_msg_s *)(g_txbuf + len);
+      len += CAN_MSGLEN(canmsg_nbytes(msg));
+
+      if (len <= done)
+        {
+          lathist_add(&in->gp_latency, (uint32_t)(now - ts[i]));
+          ++in->gp_fwd;
+          ++in->gp_wfwd;
+        }
+      else
+        {
+          ++in->gp_txdrop;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: gw_forward
+ *
+ * Description:
+ *   Drains everything queued on one port and forwards it to the other in
+ *   batches of up to TXGEN_BATCH_MAX frames per write().
+ *
+ * Returned value:
+ *   0 on success, otherwise an errno value from read().
+ ****************************************************************************/
+
+static int gw_forward(FAR struct gateway_s *gw, int dir)
+{
+  FAR struct gw_port_s *in = &gw->gw_ports[dir];
+  FAR struct gw_port_s *out = &gw->gw_ports[dir ^ 1];
+  FAR struct can_msg_s *msg;
+  uint64_t ts[TXGEN_BATCH_MAX];
+  uint64_t read_us;
+  uint32_t depth = 0;
+  size_t txlen = 0;
+  ssize_t ret;
+  int offset;
+  int msglen;
+  int nmsgs = 0;
+
+  while (true)
+    {
+      ret = read(in->gp_fd, in->gp_buf, in->gp_bufsize);
+      if (ret < 0)
+        {
+          if (errno == EAGAIN || errno == EINTR)
+            {
+              break;
+            }
+
+          return errno;
+        }
+
+      read_us = now_us();
+
+      for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+        {
+          msg = (FAR struct can_msg_s *)(in->gp_buf + offset);
+          msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+          if (offset + msglen > ret)
+            {
+              break;
+            }
+
+          ++depth;
+          ++in->gp_rx;
+
+#ifdef CONFIG_CAN_ERRORS
+          if (msg->cm_hdr.ch_error)
+            {
+              ++in->gp_errframes;
+              continue;
+            }
+#endif
+
+          if (!gw_route(gw, dir, msg))
+            {
+              ++in->gp_filtered;
+              continue;
+            }
+
+          ts[nmsgs++] = rx_frame_time(msg, read_us);
+          memcpy(g_txbuf + txlen, msg, msglen);
+          txlen += msglen;
+
+          if (nmsgs == TXGEN_BATCH_MAX)
+            {
+              gw_flush(in, out, txlen, nmsgs, ts);
+              txlen = 0;
+              nmsgs = 0;
+            }
+        }
+
+      if (ret + CAN_MSGLEN(CAN_MAXDATALEN) <= in->gp_bufsize)
+        {
+          break;
+        }
+
+      ++in->gp_full_reads;
+    }
+
+  if (nmsgs > 0)
+    {
+      gw_flush(in, out, txlen, nmsgs, ts);
+    }
+
+  if (depth > 0)
+    {
+      ++in->gp_wakeups;
+      in->gp_depth_sum += depth;
+      if (depth > in->gp_max_depth)
+        {
+          in->gp_max_depth = depth;
+        }
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Name: gw_read_rules
+ *
+ * Description:
+ *   Prompts for the gateway's filter and rewrite rules.
+ ****************************************************************************/
+
+static void gw_read_rules(FAR struct gateway_s *gw)
+{
+  FAR struct gw_rule_s *rule;
+  uint32_t id;
+  int n;
+  int i;
+
+  n = prompt_long("Number of filter/rewrite rules", 0);
+  if (n > GW_MAX_RULES)
+    {
+      printf("Using the first %d rules.\n", GW_MAX_RULES);
+      n = GW_MAX_RULES;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      rule = &gw->gw_rules[i];
+      printf("Rule %d:\n", i + 1);
+
+      id = prompt_long("  ID", 0);
+#ifdef CONFIG_CAN_EXTID
+      if (prompt_long("  Extended ID (1/0)", 0) != 0)
+        {
+          id |= IDTAB_EXT;
+        }
+#endif
+      rule->gr_key = id;
+      rule->gr_mask = prompt_long("  ID mask", CAN_MAX_EXTMSGID) |
+                      IDTAB_EXT;
+      rule->gr_dirs = prompt_long("  Direction: 1 A to B, 2 B to A, "
+                                  "3 both", 3) & 3;
+      rule->gr_action = prompt_long("  Action: 0 forward, 1 drop, "
+                                    "2 rewrite ID", GW_PASS);
+
+      if (rule->gr_action == GW_REWRITE)
+        {
+          id = prompt_long("  New ID", 0);
+#ifdef CONFIG_CAN_EXTID
+          if (prompt_long("  New ID extended (1/0)", 0) != 0)
+            {
+              id |= IDTAB_EXT;
+            }
+#endif
+          rule->gr_newkey = id;
+        }
+    }
+
+  gw->gw_nrules = n;
+  gw->gw_default_pass = n == 0 ||
+    prompt_long("Forward frames that match no rule (1/0)", 1) != 0;
+}
+
+/****************************************************************************
+ * Name: gw_report
+ *
+ * Description:
+ *   Prints forwarding rate, drops and queue depth for both directions.
+ ****************************************************************************/
+
+static void gw_report(FAR struct gateway_s *gw, uint64_t now, bool final)
+{
+  static const char *const dirnames[2] =
+    {
+      "A->B", "B->A"
+    };
+
+  FAR struct gw_port_s *port;
+  uint32_t elapsed_ms = (now - gw->gw_report_us) / 1000;
+  int i;
+
+  if (elapsed_ms == 0 && !final)
+    {
+      return;
+    }
+
+  for (i = 0; i < 2; ++i)
+    {
+      port = &gw->gw_ports[i];
+
+      if (final)
+        {
+          printf("%s: %" PRIu32 " received, %" PRIu32 " forwarded, %"
+                 PRIu32 " filtered, %" PRIu32 " TX drops, %" PRIu32
+                 " error frames\n", dirnames[i], port->gp_rx, port->gp_fwd,
+                 port->gp_filtered, port->gp_txdrop, port->gp_errframes);
+          printf("      %" PRIu32 " wakeups, queue depth mean %" PRIu32
+                 " max %" PRIu32 " frames, %" PRIu32 " full reads\n",
+                 port->gp_wakeups, port->gp_wakeups ?
+                 port->gp_depth_sum / port->gp_wakeups : 0,
+                 port->gp_max_depth, port->gp_full_reads);
+          lathist_print(&port->gp_latency, "      Forwarding latency");
+          continue;
+        }
+
+      fmt_printf("%s %" PRIu32 " frames/s, %" PRIu32 " TX drops, depth max %"
+                 PRIu32 ", latency max %" PRIu32 " us%s", dirnames[i],
+                 (uint32_t)((uint64_t)port->gp_wfwd * 1000 / elapsed_ms),
+                 port->gp_txdrop, port->gp_max_depth,
+                 port->gp_latency.lh_max, i == 0 ? "; " : "\n");
+      port->gp_wfwd = 0;
+    }
+
+  gw->gw_report_us = now;
+}
+
+/****************************************************************************
+ * Name: test_gateway
+ *
+ * Description:
+ *   Forwards frames between the selected CAN device (A) and a second one
+ *   (B) in both directions, optionally filtering or rewriting IDs. Each
+ *   wakeup drains a port completely and forwards the frames in batched
+ *   writes. Forwarding latency is measured from the driver timestamp with
+ *   CONFIG_CAN_TIMESTAMP, otherwise from the read() that returned the
+ *   frame, which covers only the gateway's own processing.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for device A
+ ****************************************************************************/
+
+static void test_gateway(int canfd)
+{
+  FAR struct gateway_s *gw = &g_gateway;
+  struct pollfd fds[3];
+  char devb[CANDEV_NAMELEN + 1] = {0};
+  uint64_t now;
+  int oflags;
+  int ret;
+  int err = 0;
+  int i;
+
+  memset(gw, 0, sizeof(*gw));
+
+  fputs("Device B (e.g. /dev/can1): ", stdout);
+  fflush(stdout);
+  std_readline(devb, sizeof(devb));
+  devb[strcspn(devb, "\r\n")] = '\0';
+
+  gw->gw_ports[1].gp_fd = open(devb, O_RDWR | O_NONBLOCK);
+  if (gw->gw_ports[1].gp_fd < 0)
+    {
+      printf("Error opening CAN device %s: %d\n", devb, errno);
+      return;
+    }
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      close(gw->gw_ports[1].gp_fd);
+      return;
+    }
+
+  gw->gw_ports[0].gp_fd = canfd;
+
+  /* Each direction reads into its own half of g_rxbuf */
+
+  for (i = 0; i < 2; ++i)
+    {
+      gw->gw_ports[i].gp_bufsize = (sizeof(g_rxbuf) / 2) & ~3;
+      gw->gw_ports[i].gp_buf = g_rxbuf + i * gw->gw_ports[i].gp_bufsize;
+      fds[i].fd = gw->gw_ports[i].gp_fd;
+      fds[i].events = POLLIN;
+    }
+
+  fds[2].fd = STDIN_FILENO;
+  fds[2].events = POLLIN;
+
+  gw_read_rules(gw);
+
+  printf("Forwarding between A and %s. Type Q to quit.\n", devb);
+  fmt_begin();
+
+  gw->gw_report_us = now_us();
+
+  while (err == 0)
+    {
+      now = now_us();
+      ret = poll(fds, 3, now - gw->gw_report_us >= 1000000 ? 0 :
+                 1000 - (now - gw->gw_report_us) / 1000);
+      if (ret < 0 && errno != EINTR)
+        {
+          err = errno;
+          fmt_printf("poll() failed: %d\n", err);
+          break;
+        }
+
+      for (i = 0; ret > 0 && i < 2; ++i)
+        {
+          if (fds[i].revents & POLLIN)
+            {
+              err = gw_forward(gw, i);
+              if (err != 0)
+                {
+                  fmt_printf("read() of port %c failed: %d\n", 'A' + i,
+                             err);
+                  break;
+                }
+            }
+        }
+
+      if (ret > 0 && (fds[2].revents & POLLIN))
+        {
+          ret = rx_read_stdin_quit();
+          if (ret != 0)
+            {
+              break;
+            }
+        }
+
+      now = now_us();
+      if (now - gw->gw_report_us >= 1000000)
+        {
+          gw_report(gw, now, false);
+        }
+
+      fmt_flush(false);
+    }
+
+  fmt_end();
+  fcntl(canfd, F_SETFL, oflags);
+  close(gw->gw_ports[1].gp_fd);
+
+  gw_report(gw, now_us(), true);
+}
+
+/****************************************************************************
+ * Name: seq_extract
+ *
+ * Description:
+ *   Reads the sequence counter field of a frame.
+ *
+ * Returned value:
+ *   true if the frame is long enough to hold the field.
+ ****************************************************************************/
+
+static bool seq_extract(FAR const struct seqcheck_s *sc,
+                        FAR const struct can_msg_s *msg,
+                        FAR uint32_t *seq)
+{
+  uint32_t val = 0;
+  int i;
+
+  if (sc->sc_offset + sc->sc_width > canmsg_nbytes(msg))
+    {
+      return false;
+    }
+
+  for (i = 0; i < sc->sc_width; ++i)
+    {
+      if (sc->sc_bigendian)
+        {
+          val = (val << 8) | msg->cm_data[sc->sc_offset + i];
+        }
+      else
+        {
+          val |= (uint32_t)msg->cm_data[sc->sc_offset + i] << (8 * i);
+        }
+    }
+
+  *seq = val;
+  return true;
+}
+
+/****************************************************************************
+ * Name: seq_frame
+ *
+ * Description:
+ *   rx_loop() frame callback for the sequence-checked receive mode. Each
+ *   ID (or, with sc_shared, the whole bus) keeps the next expected counter
+ *   value and a bitmap of the last SEQ_WINDOW counter values received, so
+ *   a frame behind the expected value can be told apart as a duplicate
+ *   (already received) or a reordered frame (previously counted as lost).
+ *   A frame further back than the window is taken as the sender restarting
+ *   its counter. Values older than the known part of the window (before
+ *   the first frame or a restart) were never counted as lost, so such a
+ *   frame is reordered without reducing the loss.
+ ****************************************************************************/
+
+static void seq_frame(FAR const struct can_msg_s *msg, uint64_t ts_us,
+                      FAR void *arg)
+{
+  FAR struct seqcheck_s *sc = arg;
+  FAR struct seqstat_s *st;
+  uint32_t seq;
+  uint32_t ahead;
+  uint32_t behind;
+  int slot;
+
+#ifdef CONFIG_CAN_ERRORS
+  if (msg->cm_hdr.ch_error)
+    {
+      if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+          (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+        {
+          ++sc->sc_woverflows;
+          ++sc->sc_overflows;
+        }
+
+      return;
+    }
+#endif
+
+  if (msg->cm_hdr.ch_rtr)
+    {
+      return;
+    }
+
+  if (!seq_extract(sc, msg, &seq))
+    {
+      ++sc->sc_short;
+      return;
+    }
+
+  if (sc->sc_shared)
+    {
+      st = &sc->sc_all;
+    }
+  else
+    {
+      slot = idtab_find(sc->sc_keys, idtab_key(msg), true);
+      if (slot < 0)
+        {
+          ++sc->sc_untracked;
+          return;
+        }
+
+      st = &sc->sc_stats[slot];
+    }
+
+  ++st->ss_received;
+
+  if (st->ss_received == 1)
+    {
+      st->ss_next = (seq + 1) & sc->sc_mask;
+      st->ss_window = 1;
+      st->ss_valid = 1;
+      return;
+    }
+
+  ahead = (seq - st->ss_next) & sc->sc_mask;
+
+  if (ahead <= sc->sc_mask / 2)
+    {
+      /* In order, or frames were skipped */
+
+      st->ss_lost += ahead;
+      sc->sc_wlost += ahead;
+      /* The skipped values stay in the window as lost */
+
+      st->ss_window = ahead + 1 >= SEQ_WINDOW ? 1 :
+                      (st->ss_window << (ahead + 1)) | 1;
+      st->ss_valid = ahead + 1 >= SEQ_WINDOW - st->ss_valid ? SEQ_WINDOW :
+                     st->ss_valid + ahead + 1;
+
+      st->ss_next = (seq + 1) & sc->sc_mask;
+      return;
+    }
+
+  /* Behind the expected value: bit n of the window is next - 1 - n */
+
+  behind = ((st->ss_next - 1 - seq) & sc->sc_mask);
+
+  if (behind >= SEQ_WINDOW)
+    {
+      ++st->ss_resets;
+      st->ss_next = (seq + 1) & sc->sc_mask;
+      st->ss_window = 1;
+      st->ss_valid = 1;
+    }
+  else if (behind >= st->ss_valid)
+    {
+      ++st->ss_reordered;
+    }
+  else if (st->ss_window & ((uint64_t)1 << behind))
+    {
+      ++st->ss_dups;
+      ++sc->sc_wdups;
+    }
+  else
+    {
+      st->ss_window |= (uint64_t)1 << behind;
+      ++st->ss_reordered;
+      --st->ss_lost;
+      --sc->sc_wlost;
+    }
+}
+
+/****************************************************************************
+ * Name: seq_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the sequence-checked receive mode. Prints
+ *   losses in the last interval next to the driver's RX overflow reports
+ *   and the number of reads that filled the whole buffer, so losses can be
+ *   attributed: with overflow reports the controller or driver FIFO
+ *   overran; with full reads but no overflows, frames were queued deeper
+ *   than the read loop drained; with neither, the frames never reached
+ *   this node.
+ ****************************************************************************/
+
+static void seq_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct seqcheck_s *sc = arg;
+  uint32_t full_reads = sc->sc_rx->full_reads - sc->sc_last_full;
+  uint32_t frames = sc->sc_rx->frames - sc->sc_last_frames;
+  uint32_t elapsed_ms = (now - sc->sc_last_us) / 1000;
+
+  if (elapsed_ms == 0)
+    {
+      return;
+    }
+
+  if (sc->sc_wlost != 0)
+    {
+      ++sc->sc_loss_intervals;
+      if (sc->sc_woverflows != 0)
+        {
+          ++sc->sc_ovf_intervals;
+        }
+      else if (full_reads != 0)
+        {
+          ++sc->sc_full_intervals;
+        }
+    }
+
+  fmt_printf("%" PRIu32 " frames/s, lost %" PRId32 ", dup %" PRIu32
+             ", RX overflows %" PRIu32 ", full reads %" PRIu32 "\n",
+             (uint32_t)((uint64_t)frames * 1000 / elapsed_ms),
+             sc->sc_wlost, sc->sc_wdups, sc->sc_woverflows, full_reads);
+
+  sc->sc_wlost = 0;
+  sc->sc_wdups = 0;
+  sc->sc_woverflows = 0;
+  sc->sc_last_full = sc->sc_rx->full_reads;
+  sc->sc_last_frames = sc->sc_rx->frames;
+  sc->sc_last_us = now;
+}
+
+/****************************************************************************
+ * Name: test_seq_receive
+ *
+ * Description:
+ *   Sequence-checked receive. A payload field of each frame is treated as
+ *   a counter, either per ID or shared by all IDs, to count dropped,
+ *   duplicated and reordered frames and the loss rate against the offered
+ *   load, i.e. the frames the sender sent. The defaults match the TX
+ *   generator's counter payload, which numbers frames across all its IDs.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_seq_receive(int canfd)
+{
+  FAR struct seqcheck_s *sc = &g_seqcheck;
+  FAR struct seqstat_s *st;
+  struct rx_loop_s rx;
+  uint64_t offered = 0;
+  uint64_t lost = 0;
+  uint32_t ppm;
+  int ret;
+  int i;
+
+  memset(sc, 0, sizeof(*sc));
+  memset(sc->sc_keys, 0xff, sizeof(sc->sc_keys));
+  memset(&rx, 0, sizeof(rx));
+
+  sc->sc_offset = prompt_long("Counter byte offset", 0);
+  sc->sc_width = prompt_long("Counter width in bytes (1-4)", 4);
+  sc->sc_bigendian = prompt_long("Byte order: 0 little-endian, "
+                                 "1 big-endian", 0) != 0;
+  sc->sc_shared = prompt_long("Counter shared across IDs (1/0)", 1) != 0;
+
+  if (sc->sc_width < 1 || sc->sc_width > 4 ||
+      sc->sc_offset + sc->sc_width > CAN_MAXDATALEN)
+    {
+      puts("Invalid counter field.");
+      return;
+    }
+
+  sc->sc_mask = sc->sc_width == 4 ? UINT32_MAX :
+                (1ul << (8 * sc->sc_width)) - 1;
+
+  rx.canfd = canfd;
+  rx.tick_ms = RX_REPORT_MS;
+  rx.on_frame = seq_frame;
+  rx.on_tick = seq_tick;
+  rx.arg = sc;
+
+  printf("Checking sequence counters. Type Q to quit.\n");
+  fflush(stdout);
+
+  sc->sc_rx = &rx;
+  sc->sc_last_us = now_us();
+  ret = rx_loop(&rx);
+
+  puts("        ID  received      lost      dups reordered  resets");
+
+  for (i = sc->sc_shared ? -1 : 0; i < IDTAB_SIZE; ++i)
+    {
+      if (i < 0)
+        {
+          st = &sc->sc_all;
+          printf("       all");
+        }
+      else if (sc->sc_keys[i] == IDTAB_EMPTY)
+        {
+          continue;
+        }
+      else
+        {
+          st = &sc->sc_stats[i];
+          printf("%c%9" PRIx32, (sc->sc_keys[i] & IDTAB_EXT) ? 'x' : ' ',
+                 (uint32_t)(sc->sc_keys[i] & ~IDTAB_EXT));
+        }
+
+      printf(" %9" PRIu32 " %9" PRId32 " %9" PRIu32 " %9" PRIu32 " %7"
+             PRIu32 "\n", st->ss_received, st->ss_lost, st->ss_dups,
+             st->ss_reordered, st->ss_resets);
+
+      offered += st->ss_received - st->ss_dups + st->ss_lost;
+      lost += st->ss_lost;
+    }
+
+  ppm = offered ? (uint32_t)(lost * 1000000 / offered) : 0;
+  printf("Offered %" PRIu32 " frames, lost %" PRIu32 ": loss rate %" PRIu32
+         ".%04" PRIu32 "%%\n", (uint32_t)offered, (uint32_t)lost,
+         ppm / 10000, ppm % 10000);
+  printf("%" PRIu32 " frames too short for the counter, %" PRIu32
+         " untracked, %" PRIu32 " RX overflow reports, %" PRIu32
+         " full reads\n", sc->sc_short, sc->sc_untracked, sc->sc_overflows,
+         rx.full_reads);
+  printf("Intervals with losses: %" PRIu32 " (%" PRIu32 " with RX overflow"
+         " reports, %" PRIu32 " with full reads only)\n",
+         sc->sc_loss_intervals, sc->sc_ovf_intervals,
+         sc->sc_full_intervals);
+
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+}
+
+/****************************************************************************
+ * Name: selftest_drain
+ *
+ * Description:
+ *   Reads every frame queued in loopback and matches the test frames
+ *   against the current step by sequence number.
+ ****************************************************************************/
+
+static void selftest_drain(int canfd, FAR struct selftest_step_s *step)
+{
+  FAR struct can_msg_s *msg;
+  uint64_t read_us;
+  uint32_t seq;
+  uint32_t sent_us;
+  ssize_t ret;
+  int offset;
+  int msglen;
+
+  while (true)
+    {
+      ret = read(canfd, g_rxbuf, sizeof(g_rxbuf));
+      if (ret < 0)
+        {
+          break;
+        }
+
+      read_us = now_us();
+
+      for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+        {
+          msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+          msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+          if (offset + msglen > ret)
+            {
+              break;
+            }
+
+#ifdef CONFIG_CAN_ERRORS
+          if (msg->cm_hdr.ch_error)
+            {
+              if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+                  (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+                {
+                  ++step->st_overflows;
+                }
+
+              continue;
+            }
+#endif
+
+          if (msg->cm_hdr.ch_id != SELFTEST_ID || canmsg_nbytes(msg) < 8)
+            {
+              continue;
+            }
+
+          memcpy(&seq, &msg->cm_data[0], sizeof(seq));
+          memcpy(&sent_us, &msg->cm_data[4], sizeof(sent_us));
+
+          if (seq - step->st_first_seq >= step->st_sent)
+            {
+              ++step->st_stray;
+              continue;
+            }
+
+          ++step->st_received;
+          lathist_add(&step->st_latency,
+                      (uint32_t)rx_frame_time(msg, read_us) - sent_us);
+        }
+
+      if (ret + CAN_MSGLEN(CAN_MAXDATALEN) <= sizeof(g_rxbuf))
+        {
+          break;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: selftest_step
+ *
+ * Description:
+ *   Runs one rate step of the loopback self-test. Frames are due at
+ *   absolute times derived from the step start; everything due is sent
+ *   with one write() and the loopback frames are drained between writes.
+ *   A full TX queue (EAGAIN) is counted and the frames are retried later,
+ *   so the achieved TX rate shows where the controller saturates.
+ *
+ * Input parameters:
+ *   canfd - CAN device in loopback and non-blocking mode
+ *   step  - Rate and duration in; results out
+ *   seq   - Sequence number of the first frame; updated
+ ****************************************************************************/
+
+static void selftest_step(int canfd, FAR struct selftest_step_s *step,
+                          FAR uint32_t *seq)
+{
+  struct pollfd pfd = {.fd = canfd, .events = POLLIN, .revents = 0};
+  FAR struct can_msg_s *msg;
+  uint64_t start;
+  uint64_t end;
+  uint64_t now;
+  uint64_t due;
+  uint32_t stamp;
+  uint32_t n;
+  size_t len;
+  ssize_t ret;
+  int timeout;
+
+  step->st_first_seq = *seq;
+  start = now_us();
+  end = start + (uint64_t)step->st_ms * 1000;
+
+  while ((now = now_us()) < end)
+    {
+      due = (now - start) * step->st_rate / 1000000 + 1;
+      if (due > step->st_sent)
+        {
+          len = 0;
+          stamp = now;
+
+          for (n = 0; n < due - step->st_sent && n < TXGEN_BATCH_MAX; ++n)
+            {
+              msg = (FAR struct can_msg_s *)(g_txbuf + len);
+              memset(&msg->cm_hdr, 0, sizeof(msg->cm_hdr));
+              msg->cm_hdr.ch_id = SELFTEST_ID;
+              msg->cm_hdr.ch_dlc = 8;
+              *seq = step->st_first_seq + step->st_sent + n;
+              memcpy(&msg->cm_data[0], seq, sizeof(*seq));
+              memcpy(&msg->cm_data[4], &stamp, sizeof(stamp));
+              len += CAN_MSGLEN(8);
+            }
+
+          ret = write(canfd, g_txbuf, len);
+          if (ret < 0)
+            {
+              ++step->st_txfull;
+            }
+          else
+            {
+              step->st_sent += ret / CAN_MSGLEN(8);
+            }
+        }
+
+      /* Sleep until the next frame is due or loopback frames arrive */
+
+      due = start + (uint64_t)(step->st_sent + 1) * 1000000 / step->st_rate;
+      now = now_us();
+      timeout = due > now ? (due - now) / 1000 : 0;
+      if (poll(&pfd, 1, timeout) > 0)
+        {
+          selftest_drain(canfd, step);
+        }
+    }
+
+  /* Give the last frames time to come back */
+
+  end = now_us() + SELFTEST_SETTLE_MS * 1000;
+  while (now_us() < end && step->st_received < step->st_sent)
+    {
+      if (poll(&pfd, 1, 1) > 0)
+        {
+          selftest_drain(canfd, step);
+        }
+    }
+
+  *seq = step->st_first_seq + step->st_sent;
+  step->st_elapsed_us = now_us() - start;
+}
+
+/****************************************************************************
+ * Name: test_loopback_selftest
+ *
+ * Description:
+ *   Single-node throughput self-test. Puts the controller into loopback
+ *   mode and sends frames at increasing rates, each frame carrying a
+ *   sequence number and its send time. For every step it reports the
+ *   achieved TX and RX rates, losses, TX-full events, RX overflow reports
+ *   and latency, and finally the highest rate sustained without loss and
+ *   the rate at which the receive FIFO first overflowed.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_loopback_selftest(int canfd)
+{
+  FAR struct selftest_step_s *step = &g_selftest;
+  FAR struct selftest_step_s *best = &g_selftest_best;
+  struct canioc_connmodes_s saved;
+  bool lossy = false;
+  uint32_t seq = 0;
+  uint32_t tested = 0;
+  uint32_t rate;
+  uint32_t maxrate;
+  uint32_t factor;
+  uint32_t step_ms;
+  uint32_t tx_rate;
+  uint32_t rx_rate;
+  int oflags;
+  int nsteps = 0;
+
+  rate = prompt_long("Start rate in frames/s", 500);
+  maxrate = prompt_long("Highest rate in frames/s", 20000);
+  factor = prompt_long("Rate increase per step in percent", 50);
+  step_ms = prompt_long("Step duration in ms", 500);
+
+  if (rate < 1 || factor < 1 || step_ms < 1)
+    {
+      puts("Rates, increase and duration must be positive.");
+      return;
+    }
+
+  if (rate > maxrate)
+    {
+      puts("The start rate must not be above the highest rate.");
+      return;
+    }
+
+  if (can_set_loopback(canfd, true, &saved) < 0)
+    {
+      printf("Loopback mode not supported by the driver: %d\n", errno);
+      return;
+    }
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      ioctl(canfd, CANIOC_SET_CONNMODES, &saved);
+      return;
+    }
+
+  /* Discard anything queued before the test */
+
+  while (read(canfd, g_rxbuf, sizeof(g_rxbuf)) > 0);
+
+  puts(" offered   TX/s   RX/s    lost TXfull  ovf  lat mean   lat max");
+
+  memset(best, 0, sizeof(*best));
+
+  for (; rate <= maxrate && nsteps < SELFTEST_MAX_STEPS;
+       rate += (uint64_t)rate * factor / 100 > 0 ?
+               (uint64_t)rate * factor / 100 : 1)
+    {
+      ++nsteps;
+      tested = rate;
+      memset(step, 0, sizeof(*step));
+      step->st_rate = rate;
+      step->st_ms = step_ms;
+
+      selftest_step(canfd, step, &seq);
+
+      tx_rate = (uint64_t)step->st_sent * 1000000 / step->st_elapsed_us;
+      rx_rate = (uint64_t)step->st_received * 1000000 /
+                step->st_elapsed_us;
+
+      printf("%8" PRIu32 " %6" PRIu32 " %6" PRIu32 " %7" PRIu32 " %6"
+             PRIu32 " %4" PRIu32 " %6" PRIu32 " us %6" PRIu32 " us\n",
+             rate, tx_rate, rx_rate, step->st_sent - step->st_received,
+             step->st_txfull, step->st_overflows,
+             step->st_latency.lh_count ? (uint32_t)
+             (step->st_latency.lh_sum / step->st_latency.lh_count) : 0,
+             step->st_latency.lh_max);
+
+      if (step->st_overflows > 0 || step->st_received < step->st_sent)
+        {
+          lossy = true;
+          break;
+        }
+
+      if (step->st_received > best->st_received)
+        {
+          *best = *step;
+        }
+    }
+
+  fcntl(canfd, F_SETFL, oflags);
+  ioctl(canfd, CANIOC_SET_CONNMODES, &saved);
+
+  if (best->st_received > 0)
+    {
+      printf("Highest sustained rate without loss: %" PRIu32
+             " frames/s (offered %" PRIu32 ")\n",
+             (uint32_t)((uint64_t)best->st_received * 1000000 /
+                        best->st_elapsed_us), best->st_rate);
+      lathist_print(&best->st_latency, "Loopback latency at that rate");
+    }
+
+  if (lossy)
+    {
+      printf("First loss at %" PRIu32 " frames/s offered: %" PRIu32
+             " frames lost, %" PRIu32 " RX overflow reports\n",
+             step->st_rate, step->st_sent - step->st_received,
+             step->st_overflows);
+    }
+  else
+    {
+      printf("No loss up to %" PRIu32 " frames/s offered.\n", tested);
+      if (rate <= maxrate)
+        {
+          printf("Stopped after %d steps, below the highest rate of %"
+                 PRIu32 " frames/s;\nuse a larger increase per step to "
+                 "reach it.\n", SELFTEST_MAX_STEPS, maxrate);
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: filtrec_add
+ *
+ * Description:
+ *   Remembers a filter added during this session. The CAN character driver
+ *   cannot report its filter bank, so setup info shows this record instead.
+ *
+ * Input parameters:
+ *   extended - Whether the filter was added with CANIOC_ADD_EXTFILTER
+ *   index    - Filter number returned by the driver
+ *   id1      - First ID (sf_id1/xf_id1)
+ *   id2      - Second ID or mask (sf_id2/xf_id2)
+ *   type     - CAN_FILTER_MASK, CAN_FILTER_DUAL or CAN_FILTER_RANGE
+ ****************************************************************************/
+
+static void filtrec_add(bool extended, int index, uint32_t id1, uint32_t id2,
+                        uint8_t type)
+{
+  int i;
+
+  for (i = 0; i < FILTREC_MAX; ++i)
+    {
+      if (!g_filtrec[i].fr_used)
+        {
+          g_filtrec[i].fr_id1 = id1;
+          g_filtrec[i].fr_id2 = id2;
+          g_filtrec[i].fr_index = index;
+          g_filtrec[i].fr_type = type;
+          g_filtrec[i].fr_extended = extended;
+          g_filtrec[i].fr_used = true;
+          return;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: filtrec_del
+ *
+ * Description:
+ *   Forgets a filter deleted during this session.
+ ****************************************************************************/
+
+static void filtrec_del(bool extended, int index)
+{
+  int i;
+
+  for (i = 0; i < FILTREC_MAX; ++i)
+    {
+      if (g_filtrec[i].fr_used && g_filtrec[i].fr_extended == extended &&
+          g_filtrec[i].fr_index == index)
+        {
+          g_filtrec[i].fr_used = false;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: print_bittiming
+ *
+ * Description:
+ *   Prints a bit timing with its quanta per bit and sample point.
+ ****************************************************************************/
+
+static void print_bittiming(FAR const struct canioc_bittiming_s *bt)
+{
+  uint32_t quanta = 1 + bt->bt_tseg1 + bt->bt_tseg2;
+
+  printf("Bit rate %" PRIu32 " bit/s, TSEG1 %u, TSEG2 %u, SJW %u: "
+         "%" PRIu32 " quanta per bit, sample point %" PRIu32 ".%" PRIu32
+         "%%\n", bt->bt_baud, bt->bt_tseg1, bt->bt_tseg2, bt->bt_sjw,
+         quanta, (1 + bt->bt_tseg1) * 100 / quanta,
+         (1 + bt->bt_tseg1) * 1000 / quanta % 10);
+}
+
+/****************************************************************************
+ * Name: prompt_list
+ *
+ * Description:
+ *   Prompts for a list of numbers separated by spaces or commas.
+ *
+ * Input parameters:
+ *   prompt - Text shown before the default list
+ *   def    - Default list, used when the line is empty
+ *   vals   - Output array
+ *   max    - Size of vals
+ *
+ * Returned value:
+ *   Number of values stored.
+ ****************************************************************************/
+
+static int prompt_list(FAR const char *prompt, FAR const char *def,
+                       FAR long *vals, int max)
+{
+  char line[80] = {0};
+  FAR const char *p = line;
+  FAR char *end;
+  int n = 0;
+
+  printf("%s [%s]: ", prompt, def);
+  fflush(stdout);
+
+  if (std_readline(line, sizeof(line)) <= 0 || strspn(line, " ,\n") ==
+      strlen(line))
+    {
+      p = def;
+    }
+
+  while (n < max)
+    {
+      p += strspn(p, " ,\n");
+      vals[n] = strtol(p, &end, 0);
+      if (end == p)
+        {
+          break;
+        }
+
+      p = end;
+      ++n;
+    }
+
+  return n;
+}
+
+/****************************************************************************
+ * Name: sweep_step
+ *
+ * Description:
+ *   Runs the timed traffic exchange of one bitrate sweep step: sends
+ *   SWEEP_ID frames at a fixed rate for the step duration while counting
+ *   received frames and error frames.
+ *
+ * Input parameters:
+ *   canfd - CAN device in non-blocking mode
+ *   res   - Rate and duration in; results out
+ ****************************************************************************/
+
+static void sweep_step(int canfd, FAR struct sweep_res_s *res)
+{
+  struct pollfd pfd = {.fd = canfd, .events = POLLIN, .revents = 0};
+  FAR struct can_msg_s *msg;
+  struct can_msg_s txmsg;
+  uint64_t start;
+  uint64_t end;
+  uint64_t now;
+  uint64_t due;
+  ssize_t ret;
+  int offset;
+  int msglen;
+  int timeout;
+
+  memset(&txmsg, 0, sizeof(txmsg));
+  txmsg.cm_hdr.ch_id = SWEEP_ID;
+  txmsg.cm_hdr.ch_dlc = 8;
+
+  start = now_us();
+  end = start + (uint64_t)res->sr_ms * 1000;
+
+  while ((now = now_us()) < end)
+    {
+      due = start + (uint64_t)(res->sr_sent + res->sr_txfail) * 1000000 /
+            res->sr_rate;
+      if (now >= due)
+        {
+          /* Alternate 0x55/0xaa payloads for the most bit transitions */
+
+          memset(txmsg.cm_data, (res->sr_sent & 1) ? 0xaa : 0x55, 8);
+          if (write(canfd, &txmsg, CAN_MSGLEN(8)) < 0)
+            {
+              ++res->sr_txfail;
+            }
+          else
+            {
+              ++res->sr_sent;
+            }
+
+          continue;
+        }
+
+      timeout = (due - now) / 1000;
+      if (poll(&pfd, 1, timeout) <= 0)
+        {
+          continue;
+        }
+
+      while ((ret = read(canfd, g_rxbuf, sizeof(g_rxbuf))) > 0)
+        {
+          for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+            {
+              msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+              msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+              if (offset + msglen > ret)
+                {
+                  break;
+                }
+
+#ifdef CONFIG_CAN_ERRORS
+              if (msg->cm_hdr.ch_error)
+                {
+                  ++res->sr_errframes;
+                  if (msg->cm_hdr.ch_id & CAN_ERROR_NOACK)
+                    {
+                      ++res->sr_noack;
+                    }
+
+                  if (msg->cm_hdr.ch_id & CAN_ERROR_BUSOFF)
+                    {
+                      ++res->sr_busoff;
+                    }
+
+                  continue;
+                }
+#endif
+
+              ++res->sr_received;
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: test_bitrate_sweep
+ *
+ * Description:
+ *   Steps through candidate bitrates and sample points with
+ *   CANIOC_SET_BITTIMING, running a timed traffic exchange at each one and
+ *   recording error frames, so the highest bitrate the wiring supports
+ *   reliably can be read off the table. Another node must be on the bus to
+ *   acknowledge the frames; its own traffic is counted as received. That
+ *   peer only acknowledges frames at its own bit timing, so the sweep
+ *   pauses before every step for the operator to set the peer to the
+ *   step's timing; a step run against a peer at a different rate only
+ *   shows no-ACK and error frames. The original bit timing is restored
+ *   afterwards.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ *   orig  - Bit timing in effect before the sweep
+ ****************************************************************************/
+
+static void test_bitrate_sweep(int canfd,
+                               FAR const struct canioc_bittiming_s *orig)
+{
+  struct canioc_bittiming_s bt;
+  struct sweep_res_s res;
+  char line[4] = {0};
+  long rates[SWEEP_MAX_VALUES];
+  long points[SWEEP_MAX_VALUES];
+  uint32_t best_rate = 0;
+  long quanta;
+  long frame_rate;
+  long step_ms;
+  int nrates;
+  int npoints;
+  int oflags;
+  int tseg1;
+  int r;
+  int s;
+
+  puts("The peer node acknowledging the test frames must run at the same\n"
+       "bit timing as this node. The sweep pauses before every step so\n"
+       "the peer can be set to that step's bitrate and sample point.");
+
+  nrates = prompt_list("Bitrates in kbit/s", "125 250 500 800 1000", rates,
+                       SWEEP_MAX_VALUES);
+  npoints = prompt_list("Sample points in percent", "75 80 87", points,
+                        SWEEP_MAX_VALUES);
+  quanta = prompt_long("Time quanta per bit",
+                       1 + orig->bt_tseg1 + orig->bt_tseg2);
+  frame_rate = prompt_long("Frames/s sent per step", 200);
+  step_ms = prompt_long("Step duration in ms", 1000);
+
+  if (nrates == 0 || npoints == 0 || quanta < 4 || quanta > 256 ||
+      frame_rate < 1 || step_ms < 1)
+    {
+      puts("Need at least one bitrate and sample point, 4 to 256 quanta\n"
+           "per bit, and a positive frame rate and duration.");
+      return;
+    }
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      return;
+    }
+
+  puts("   kbit/s  SP%  TSEG1/2    sent  TXfail   recvd  errors  "
+       "no-ACK  bus-off");
+
+  for (r = 0; r < nrates && line[0] != 'Q' && line[0] != 'q'; ++r)
+    {
+      for (s = 0; s < npoints; ++s)
+        {
+          tseg1 = (quanta * points[s] + 50) / 100 - 1;
+          if (tseg1 < 1 || tseg1 > quanta - 2 || rates[r] < 1)
+            {
+              printf("%9ld %3ld  skipped: no valid TSEG1/TSEG2\n",
+                     rates[r], points[s]);
+              continue;
+            }
+
+          bt = *orig;
+          bt.bt_baud = rates[r] * 1000;
+          bt.bt_tseg1 = tseg1;
+          bt.bt_tseg2 = quanta - 1 - tseg1;
+          if (bt.bt_sjw > bt.bt_tseg2)
+            {
+              bt.bt_sjw = bt.bt_tseg2;
+            }
+
+          printf("Set the peer to %ld kbit/s, %ld%% sample point (TSEG1 "
+                 "%u, TSEG2 %u),\nthen press Enter (S skips this step, Q "
+                 "ends the sweep): ", rates[r], points[s], bt.bt_tseg1,
+                 bt.bt_tseg2);
+          fflush(stdout);
+          if (std_readline(line, sizeof(line)) <= 0)
+            {
+              line[0] = 'Q';
+            }
+
+          if (line[0] == 'Q' || line[0] == 'q')
+            {
+              break;
+            }
+
+          if (line[0] == 'S' || line[0] == 's')
+            {
+              continue;
+            }
+
+          if (ioctl(canfd, CANIOC_SET_BITTIMING, &bt) < 0)
+            {
+              printf("%9ld %3ld  rejected by the driver: %d\n", rates[r],
+                     points[s], errno);
+              continue;
+            }
+
+          /* Let the controller resynchronize, then drop anything received
+           * at the previous bit timing.
+           */
+
+          usleep(SWEEP_SETTLE_MS * 1000);
+          while (read(canfd, g_rxbuf, sizeof(g_rxbuf)) > 0);
+
+          memset(&res, 0, sizeof(res));
+          res.sr_rate = frame_rate;
+          res.sr_ms = step_ms;
+          sweep_step(canfd, &res);
+
+          printf("%9ld %3ld  %3u/%-3u %7" PRIu32 " %7" PRIu32 " %7" PRIu32
+                 " %7" PRIu32 " %7" PRIu32 "  %s\n", rates[r], points[s],
+                 bt.bt_tseg1, bt.bt_tseg2, res.sr_sent, res.sr_txfail,
+                 res.sr_received, res.sr_errframes, res.sr_noack,
+                 res.sr_busoff ? "yes" : "no");
+
+          if (res.sr_errframes == 0 && res.sr_txfail == 0 &&
+              res.sr_sent > 0 && bt.bt_baud > best_rate)
+            {
+              best_rate = bt.bt_baud;
+            }
+        }
+    }
+
+  if (ioctl(canfd, CANIOC_SET_BITTIMING, orig) < 0)
+    {
+      printf("Error restoring the original bit timing: %d\n", errno);
+    }
+  else
+    {
+      puts("Restored the original bit timing; set the peer back to it.");
+    }
+
+  fcntl(canfd, F_SETFL, oflags);
+
+#ifndef CONFIG_CAN_ERRORS
+  puts("Error frames are disabled in this build (CONFIG_CAN_ERRORS); only\n"
+       "TX failures were counted.");
+#endif
+
+  if (best_rate != 0)
+    {
+      printf("Highest error-free bitrate with the peer at the same "
+             "timing: %" PRIu32 " bit/s\n", best_rate);
+    }
+  else
+    {
+      puts("No bitrate ran without errors.");
+    }
+}
+
+/****************************************************************************
+ * Name: test_setup_info
+ *
+ * Description:
+ *   Prints the bit timing and connection modes read from the driver, the
+ *   CAN features of this build and the filters added during this session,
+ *   then optionally runs the bitrate sweep.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_setup_info(int canfd)
+{
+  struct canioc_bittiming_s bt;
+  struct canioc_connmodes_s modes;
+  char selection[4] = {0};
+  bool have_bt;
+  int nfilters = 0;
+  int i;
+
+  have_bt = ioctl(canfd, CANIOC_GET_BITTIMING, &bt) >= 0;
+  if (have_bt)
+    {
+      print_bittiming(&bt);
+    }
+  else
+    {
+      printf("Bit timing not available: %d\n", errno);
+    }
+
+  if (ioctl(canfd, CANIOC_GET_CONNMODES, &modes) >= 0)
+    {
+      printf("Loopback %s, silent %s\n", modes.bm_loopback ? "on" : "off",
+             modes.bm_silent ? "on" : "off");
+    }
+  else
+    {
+      printf("Connection modes not available: %d\n", errno);
+    }
+
+  printf("Build: extended IDs %s, error frames %s, CAN FD %s, "
+         "timestamps %s\n",
+#ifdef CONFIG_CAN_EXTID
+         "yes",
+#else
+         "no",
+#endif
+#ifdef CONFIG_CAN_ERRORS
+         "yes",
+#else
+         "no",
+#endif
+#ifdef CONFIG_CAN_FD
+         "yes",
+#else
+         "no",
+#endif
+#ifdef CONFIG_CAN_TIMESTAMP
+         "yes");
+#else
+         "no");
+#endif
+
+#ifdef CONFIG_CAN_FIFOSIZE
+  printf("Driver FIFO: %d frames\n", CONFIG_CAN_FIFOSIZE);
+#endif
+
+  for (i = 0; i < FILTREC_MAX; ++i)
+    {
+      if (!g_filtrec[i].fr_used)
+        {
+          continue;
+        }
+
+      if (nfilters++ == 0)
+        {
+          puts("Filters added in this session:");
+        }
+
+      printf(" %s %2d: %s 0x%08" PRIx32 " 0x%08" PRIx32 "\n",
+             g_filtrec[i].fr_extended ? "ext" : "std",
+             g_filtrec[i].fr_index,
+             g_filtrec[i].fr_type == CAN_FILTER_MASK ? "mask " :
+             g_filtrec[i].fr_type == CAN_FILTER_DUAL ? "dual " : "range",
+             g_filtrec[i].fr_id1, g_filtrec[i].fr_id2);
+    }
+
+  if (nfilters == 0)
+    {
+      puts("No filters added in this session (driver default applies).");
+    }
+
+  if (!have_bt)
+    {
+      return;
+    }
+
+  fputs("Run a bitrate/sample point sweep? (Y/N): ", stdout);
+  fflush(stdout);
+  std_readline(selection, 4);
+  if (selection[0] == 'Y' || selection[0] == 'y')
+    {
+      test_bitrate_sweep(canfd, &bt);
+    }
+}
+
+/****************************************************************************
+ * Name: rxlat_batch
+ *
+ * Description:
+ *   rx_loop() batch callback for the RX queue latency mode. Called right
+ *   after each read(), so the time taken here is when user space got the
+ *   frames; the difference to each driver timestamp is the time the frame
+ *   spent queued in the driver (plus the wakeup and scheduling delay).
+ ****************************************************************************/
+
+#ifdef CONFIG_CAN_TIMESTAMP
+static void rxlat_batch(FAR uint8_t *buf, int buflen, FAR void *arg)
+{
+  FAR struct rxlat_s *rl = arg;
+  FAR struct can_msg_s *msg;
+  uint64_t read_us = now_us();
+  uint64_t ts_us;
+  uint32_t delay;
+  uint32_t nframes = 0;
+  int offset;
+  int msglen;
+  int bucket;
+
+  for (offset = 0; offset + CAN_MSGLEN(0) <= buflen; offset += msglen)
+    {
+      msg = (FAR struct can_msg_s *)(buf + offset);
+      msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+      if (offset + msglen > buflen)
+        {
+          break;
+        }
+
+      ++nframes;
+
+#ifdef CONFIG_CAN_ERRORS
+      if (msg->cm_hdr.ch_error)
+        {
+          if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+              (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+            {
+              ++rl->rl_overflows;
+            }
+
+          continue;
+        }
+#endif
+
+      /* The driver stamps frames from the same monotonic clock as
+       * now_us(); a timestamp in the future means it does not.
+       */
+
+      ts_us = rx_frame_time(msg, read_us);
+      if (ts_us > read_us)
+        {
+          ++rl->rl_future;
+          continue;
+        }
+
+      delay = read_us - ts_us;
+      lathist_add(&rl->rl_total, delay);
+
+      ++rl->rl_count;
+      rl->rl_sum += delay;
+      if (delay > rl->rl_max)
+        {
+          rl->rl_max = delay;
+        }
+    }
+
+  if (nframes == 0)
+    {
+      return;
+    }
+
+  for (bucket = 0; bucket < RXLAT_READ_BUCKETS - 1 &&
+                   nframes >= (2u << bucket); ++bucket);
+  ++rl->rl_perread[bucket];
+
+  if (nframes > rl->rl_peak)
+    {
+      rl->rl_peak = nframes;
+    }
+
+  if (nframes > rl->rl_peak_total)
+    {
+      rl->rl_peak_total = nframes;
+    }
+}
+
+/****************************************************************************
+ * Name: rxlat_tick
+ *
+ * Description:
+ *   rx_loop() tick callback for the RX queue latency mode. Prints the
+ *   queueing delay and peak frames per read of the last interval.
+ ****************************************************************************/
+
+static void rxlat_tick(uint64_t now, FAR void *arg)
+{
+  FAR struct rxlat_s *rl = arg;
+
+  fmt_printf("%" PRIu32 " frames, queueing delay mean %" PRIu32
+             " us max %" PRIu32 " us, peak %" PRIu32 " frames/read, "
+             "%" PRIu32 " RX overflows\n", rl->rl_count,
+             rl->rl_count ? (uint32_t)(rl->rl_sum / rl->rl_count) : 0,
+             rl->rl_max, rl->rl_peak, rl->rl_overflows);
+
+  rl->rl_count = 0;
+  rl->rl_sum = 0;
+  rl->rl_max = 0;
+  rl->rl_peak = 0;
+}
+#endif
+
+/****************************************************************************
+ * Name: test_rx_latency
+ *
+ * Description:
+ *   Driver RX queue instrumentation. Compares each frame's driver
+ *   timestamp with the time the read() returning it completed and builds
+ *   a histogram of the queueing delay. The number of frames returned per
+ *   read() is tracked as a proxy for the driver FIFO high-water mark. Runs
+ *   until Q is entered. Requires CONFIG_CAN_TIMESTAMP.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_rx_latency(int canfd)
+{
+#ifdef CONFIG_CAN_TIMESTAMP
+  FAR struct rxlat_s *rl = &g_rxlat;
+  struct sched_param param;
+  struct rx_loop_s rx;
+  int ret;
+  int i;
+
+  memset(rl, 0, sizeof(*rl));
+  memset(&rx, 0, sizeof(rx));
+
+  if (sched_getparam(0, &param) == 0)
+    {
+      printf("Receiving at priority %d "
+             "(CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY is %d)\n",
+             param.sched_priority, CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY);
+    }
+
+  rx.tick_ms = prompt_long("Report interval in ms", 1000);
+  rx.canfd = canfd;
+  rx.on_batch = rxlat_batch;
+  rx.on_tick = rxlat_tick;
+  rx.arg = rl;
+
+  ret = rx_loop(&rx);
+  if (ret != 0)
+    {
+      printf("Receive loop ended with error %d\n", ret);
+    }
+
+  lathist_print(&rl->rl_total, "Driver queueing delay");
+
+  printf("%" PRIu32 " reads, peak %" PRIu32 " frames per read, %" PRIu32
+         " reads filled the %d-byte buffer\n", rx.reads, rl->rl_peak_total,
+         rx.full_reads, CONFIG_INDUSTRY_ETCETERA_CANTEST_RXBUFSIZE);
+
+  for (i = 0; i < RXLAT_READ_BUCKETS; ++i)
+    {
+      if (rl->rl_perread[i] == 0)
+        {
+          continue;
+        }
+
+      printf("  %s%5u frames/read: %8" PRIu32 " (%3" PRIu32 "%%)\n",
+             i == RXLAT_READ_BUCKETS - 1 ? ">= " : "   ", 1u << i,
+             rl->rl_perread[i],
+             (uint32_t)((uint64_t)rl->rl_perread[i] * 100 / rx.reads));
+    }
+
+  if (rl->rl_future > 0)
+    {
+      printf("%" PRIu32 " frames had timestamps ahead of the read time; "
+             "the driver\nclock does not match CLOCK_MONOTONIC.\n",
+             rl->rl_future);
+    }
+#else
+  puts("Driver timestamps disabled in this build (CONFIG_CAN_TIMESTAMP).");
+#endif
+}
+
+/****************************************************************************
+ * Name: rtrx_push
+ *
+ * Description:
+ *   Producer side of the receive ring. Never blocks: when the printer has
+ *   fallen a whole ring behind the frame is dropped and counted.
+ ****************************************************************************/
+
+static void rtrx_push(FAR struct rtrx_s *rt, FAR const struct can_msg_s *msg)
+{
+  unsigned int head;
+  unsigned int fill;
+
+  head = atomic_load_explicit(&rt->rt_head, memory_order_relaxed);
+  fill = head - atomic_load_explicit(&rt->rt_tail, memory_order_acquire);
+  if (fill >= RTRX_RING_SIZE)
+    {
+      ++rt->rt_dropped;
+      return;
+    }
+
+  memcpy(&g_rtrxring[head & (RTRX_RING_SIZE - 1)], msg,
+         CAN_MSGLEN(canmsg_nbytes(msg)));
+
+  /* Publish the entry only after it has been written */
+
+  atomic_store_explicit(&rt->rt_head, head + 1, memory_order_release);
+
+  if (fill + 1 > rt->rt_peak)
+    {
+      rt->rt_peak = fill + 1;
+    }
+}
+
+/****************************************************************************
+ * Name: rtrx_receiver
+ *
+ * Description:
+ *   Real-time receive thread. Waits in poll() with a timeout of
+ *   RTRX_TICK_MS so that idle wakeups measure scheduling jitter, drains
+ *   the driver with non-blocking reads and pushes the frames into the
+ *   ring. It never touches the console.
+ ****************************************************************************/
+
+static FAR void *rtrx_receiver(FAR void *arg)
+{
+  FAR struct rtrx_s *rt = arg;
+  struct pollfd pfd = {.fd = rt->rt_canfd, .events = POLLIN, .revents = 0};
+  FAR struct can_msg_s *msg;
+  uint64_t expect;
+  uint64_t woke;
+#ifdef CONFIG_CAN_TIMESTAMP
+  bool first;
+#endif
+  ssize_t ret;
+  int offset;
+  int msglen;
+
+  while (!atomic_load(&rt->rt_stop))
+    {
+      expect = now_us() + RTRX_TICK_MS * 1000;
+      ret = poll(&pfd, 1, RTRX_TICK_MS);
+      woke = now_us();
+
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          rt->rt_error = errno;
+          break;
+        }
+      else if (ret == 0)
+        {
+          /* Timeout: how late did the scheduler run us? */
+
+          lathist_add(&rt->rt_timer,
+                      woke > expect ? (uint32_t)(woke - expect) : 0);
+          continue;
+        }
+
+      ++rt->rt_wakeups;
+#ifdef CONFIG_CAN_TIMESTAMP
+      first = true;
+#endif
+
+      while ((ret = read(rt->rt_canfd, g_rxbuf, sizeof(g_rxbuf))) > 0)
+        {
+          for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+            {
+              msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+              msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+              if (offset + msglen > ret)
+                {
+                  break;
+                }
+
+#ifdef CONFIG_CAN_TIMESTAMP
+              /* The oldest frame of the wakeup shows how long it took
+               * from the frame arriving to this thread running.
+               */
+
+              if (first && rx_frame_time(msg, woke) <= woke)
+                {
+                  lathist_add(&rt->rt_wakeup,
+                              woke - rx_frame_time(msg, woke));
+                }
+
+              first = false;
+#endif
+
+              ++rt->rt_frames;
+              rtrx_push(rt, msg);
+            }
+        }
+
+      if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        {
+          rt->rt_error = errno;
+          break;
+        }
+    }
+
+  atomic_store(&rt->rt_stop, true);
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: rtrx_printer
+ *
+ * Description:
+ *   Low-priority consumer thread. Prints everything in the ring through
+ *   the output buffer with blocking writes, then sleeps for RTRX_PRINT_MS.
+ *   A slow console only delays this thread; the ring absorbs the backlog.
+ ****************************************************************************/
+
+static FAR void *rtrx_printer(FAR void *arg)
+{
+  FAR struct rtrx_s *rt = arg;
+  unsigned int tail;
+  unsigned int head;
+  bool stop;
+
+  while (true)
+    {
+      stop = atomic_load(&rt->rt_stop);
+      tail = atomic_load_explicit(&rt->rt_tail, memory_order_relaxed);
+      head = atomic_load_explicit(&rt->rt_head, memory_order_acquire);
+
+      while (tail != head)
+        {
+          if (rt->rt_print)
+            {
+              fmt_frame(&g_rtrxring[tail & (RTRX_RING_SIZE - 1)], NULL);
+            }
+
+          /* Hand the slot back once it has been consumed */
+
+          atomic_store_explicit(&rt->rt_tail, ++tail, memory_order_release);
+        }
+
+      fmt_flush(true);
+
+      if (stop)
+        {
+          break;
+        }
+
+      usleep(RTRX_PRINT_MS * 1000);
+    }
+
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: test_rt_receive
+ *
+ * Description:
+ *   Receives on a dedicated SCHED_FIFO thread that hands frames to a
+ *   low-priority printer thread through a lock-free single-producer,
+ *   single-consumer ring, so console output can never delay frame
+ *   handling. Reports the distribution of the receive thread's wakeup
+ *   jitter (idle poll() timeouts) and, with CONFIG_CAN_TIMESTAMP, of the
+ *   delay from frame arrival to the thread running.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_rt_receive(int canfd)
+{
+  FAR struct rtrx_s *rt = &g_rtrx;
+  char selection[4] = {0};
+  int rx_prio = CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY + 50;
+  int print_prio;
+  int oflags;
+  int ret;
+
+  memset(rt, 0, sizeof(*rt));
+  atomic_init(&rt->rt_head, 0);
+  atomic_init(&rt->rt_tail, 0);
+  atomic_init(&rt->rt_stop, false);
+  rt->rt_canfd = canfd;
+
+  if (rx_prio > sched_get_priority_max(SCHED_FIFO))
+    {
+      rx_prio = sched_get_priority_max(SCHED_FIFO);
+    }
+
+  rx_prio = prompt_long("Receive thread priority", rx_prio);
+  print_prio = prompt_long("Printer thread priority",
+                           CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY / 2);
+  rt->rt_print = prompt_long("Print frames (1/0)", 1) != 0;
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      return;
+    }
+
+  puts("Receiving; enter Q to stop.");
+  fflush(stdout);
+
+  ret = fifo_thread_start(&rt->rt_printer, rtrx_printer, rt, print_prio);
+  if (ret != 0)
+    {
+      printf("Unable to start printer thread: %d\n", ret);
+      fcntl(canfd, F_SETFL, oflags);
+      return;
+    }
+
+  ret = fifo_thread_start(&rt->rt_receiver, rtrx_receiver, rt, rx_prio);
+  if (ret != 0)
+    {
+      printf("Unable to start receive thread: %d\n", ret);
+      atomic_store(&rt->rt_stop, true);
+      pthread_join(rt->rt_printer, NULL);
+      fcntl(canfd, F_SETFL, oflags);
+      return;
+    }
+
+  while (!atomic_load(&rt->rt_stop))
+    {
+      if (std_readline(selection, sizeof(selection)) <= 0 ||
+          selection[0] == 'Q' || selection[0] == 'q')
+        {
+          break;
+        }
+    }
+
+  atomic_store(&rt->rt_stop, true);
+  pthread_join(rt->rt_receiver, NULL);
+  pthread_join(rt->rt_printer, NULL);
+  fcntl(canfd, F_SETFL, oflags);
+
+  if (rt->rt_error != 0)
+    {
+      printf("Receive thread failed: %d\n", rt->rt_error);
+    }
+
+  printf("%" PRIu32 " frames in %" PRIu32 " wakeups at priority %d; "
+         "%" PRIu32 " dropped (ring full), peak ring fill %" PRIu32 "/%d\n",
+         rt->rt_frames, rt->rt_wakeups, rx_prio, rt->rt_dropped,
+         rt->rt_peak, RTRX_RING_SIZE);
+  lathist_print(&rt->rt_timer, "Receive thread timer wakeup jitter");
+#ifdef CONFIG_CAN_TIMESTAMP
+  lathist_print(&rt->rt_wakeup, "Frame arrival to receive thread running");
+#endif
+}
+
+/****************************************************************************
+ * Name: cyctx_sift_down
+ *
+ * Description:
+ *   Restores the min-heap order (by next due time) below position i after
+ *   that entry's due time increased.
+ ****************************************************************************/
+
+static void cyctx_sift_down(FAR struct cyctx_s *ct, int i)
+{
+  uint8_t tmp;
+  int child;
+
+  while ((child = 2 * i + 1) < ct->ct_nmsgs)
+    {
+      if (child + 1 < ct->ct_nmsgs &&
+          ct->ct_msgs[ct->ct_heap[child + 1]].cm_due <
+          ct->ct_msgs[ct->ct_heap[child]].cm_due)
+        {
+          ++child;
+        }
+
+      if (ct->ct_msgs[ct->ct_heap[i]].cm_due <=
+          ct->ct_msgs[ct->ct_heap[child]].cm_due)
+        {
+          break;
+        }
+
+      tmp = ct->ct_heap[i];
+      ct->ct_heap[i] = ct->ct_heap[child];
+      ct->ct_heap[child] = tmp;
+      i = child;
+    }
+}
+
+/****************************************************************************
+ * Name: cyctx_send
+ *
+ * Description:
+ *   Sends every message due before the end of the current scheduler tick
+ *   with one write(), records period jitter and lateness, and schedules
+ *   the next transmission of each. A message whose next period has also
+ *   passed counts the skipped periods as deadline misses. Frames the TX
+ *   queue did not accept are misses too.
+ *
+ * Input parameters:
+ *   ct  - Scheduler state
+ *   now - Current time from now_us()
+ ****************************************************************************/
+
+static void cyctx_send(FAR struct cyctx_s *ct, uint64_t now)
+{
+  FAR struct cyctx_msg_s *cm;
+  FAR struct can_msg_s *msg;
+  uint8_t batch[TXGEN_BATCH_MAX];
+  uint64_t late;
+  uint32_t dev;
+  uint32_t skipped;
+  size_t len = 0;
+  ssize_t ret;
+  int nsent;
+  int n = 0;
+  int i;
+
+  while (n < TXGEN_BATCH_MAX &&
+         ct->ct_msgs[ct->ct_heap[0]].cm_due < now + ct->ct_tick_us)
+    {
+      cm = &ct->ct_msgs[ct->ct_heap[0]];
+      batch[n++] = ct->ct_heap[0];
+
+      msg = (FAR struct can_msg_s *)(g_txbuf + len);
+      memcpy(msg, &cm->cm_msg, CAN_MSGLEN(canmsg_nbytes(&cm->cm_msg)));
+      len += CAN_MSGLEN(canmsg_nbytes(msg));
+
+      /* Lateness against the nominal due time; frames sent early because
+       * they fall in the current tick count as on time.
+       */
+
+      late = now > cm->cm_due ? now - cm->cm_due : 0;
+      if (late > cm->cm_late_max)
+        {
+          cm->cm_late_max = late;
+        }
+
+      lathist_add(&ct->ct_late, late);
+
+      cm->cm_due += cm->cm_period_us;
+      if (cm->cm_due <= now)
+        {
+          skipped = (now - cm->cm_due) / cm->cm_period_us + 1;
+          cm->cm_missed += skipped;
+          cm->cm_due += (uint64_t)skipped * cm->cm_period_us;
+        }
+
+      cyctx_sift_down(ct, 0);
+    }
+
+  if (n == 0)
+    {
+      return;
+    }
+
+  ret = write(ct->ct_canfd, g_txbuf, len);
+  ++ct->ct_writes;
+
+  /* Frames are accepted in order, so the first nsent went out */
+
+  nsent = 0;
+  if (ret > 0)
+    {
+      for (len = 0; nsent < n; ++nsent)
+        {
+          msg = (FAR struct can_msg_s *)(g_txbuf + len);
+          len += CAN_MSGLEN(canmsg_nbytes(msg));
+          if (len > (size_t)ret)
+            {
+              break;
+            }
+        }
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      cm = &ct->ct_msgs[batch[i]];
+      if (i >= nsent)
+        {
+          ++cm->cm_missed;
+          ++ct->ct_txfull;
+          continue;
+        }
+
+      ++cm->cm_sent;
+      if (cm->cm_last_us != 0)
+        {
+          dev = now - cm->cm_last_us > cm->cm_period_us ?
+                now - cm->cm_last_us - cm->cm_period_us :
+                cm->cm_period_us - (now - cm->cm_last_us);
+          cm->cm_jitter_sum += dev;
+          if (dev > cm->cm_jitter_max)
+            {
+              cm->cm_jitter_max = dev;
+            }
+        }
+
+      cm->cm_last_us = now;
+    }
+
+  ct->ct_frames += nsent;
+}
+
+/****************************************************************************
+ * Name: cyctx_thread
+ *
+ * Description:
+ *   The single scheduler thread. Sleeps until the earliest due message
+ *   (at most CYCTX_MAX_SLEEP_MS so that a stop request is noticed), then
+ *   sends everything due in that tick.
+ ****************************************************************************/
+
+static FAR void *cyctx_thread(FAR void *arg)
+{
+  FAR struct cyctx_s *ct = arg;
+  struct timespec deadline;
+  uint64_t due;
+  uint64_t now;
+
+  while (!atomic_load(&ct->ct_stop))
+    {
+      now = now_us();
+      due = ct->ct_msgs[ct->ct_heap[0]].cm_due;
+      if (due > now + CYCTX_MAX_SLEEP_MS * 1000)
+        {
+          due = now + CYCTX_MAX_SLEEP_MS * 1000;
+        }
+
+      if (due > now)
+        {
+          deadline.tv_sec = due / 1000000;
+          deadline.tv_nsec = (due % 1000000) * 1000;
+          while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                                 NULL) == EINTR);
+        }
+
+      cyctx_send(ct, now_us());
+    }
+
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: cyctx_read_table
+ *
+ * Description:
+ *   Prompts for the periodic message table.
+ *
+ * Returned value:
+ *   Number of messages entered.
+ ****************************************************************************/
+
+static int cyctx_read_table(FAR struct cyctx_s *ct)
+{
+  FAR struct cyctx_msg_s *cm;
+  FAR struct can_msg_s *msg;
+  int n;
+  int i;
+
+  n = prompt_long("Number of periodic messages", 1);
+  if (n > CYCTX_MAX_MSGS)
+    {
+      printf("Using the first %d messages.\n", CYCTX_MAX_MSGS);
+      n = CYCTX_MAX_MSGS;
+    }
+
+  for (i = 0; i < n; ++i)
+    {
+      cm = &ct->ct_msgs[i];
+      msg = &cm->cm_msg;
+      printf("Message %d:\n", i + 1);
+
+      msg->cm_hdr.ch_id = prompt_long("  ID", 0x100 + i);
+#ifdef CONFIG_CAN_EXTID
+      msg->cm_hdr.ch_extid = prompt_long("  Extended ID (1/0)", 0) != 0;
+#endif
+      cm->cm_period_us = prompt_long("  Period in ms", 10) * 1000;
+      cm->cm_offset_us = prompt_long("  Offset in ms", 0) * 1000;
+      msg->cm_hdr.ch_dlc = prompt_hexbytes("  Payload (hex bytes)",
+                                           msg->cm_data, 8);
+
+      if (cm->cm_period_us == 0)
+        {
+          puts("  Period must be at least 1 ms.");
+          --i;
+        }
+    }
+
+  return n;
+}
+
+/****************************************************************************
+ * Name: cyctx_report
+ *
+ * Description:
+ *   Prints per-message counts, period jitter and deadline misses.
+ ****************************************************************************/
+
+static void cyctx_report(FAR struct cyctx_s *ct, uint64_t elapsed_us)
+{
+  FAR struct cyctx_msg_s *cm;
+  int i;
+
+  printf("%" PRIu32 " frames in %" PRIu32 " write() calls over %" PRIu32
+         " ms, %" PRIu32 " not accepted by the TX queue\n", ct->ct_frames,
+         ct->ct_writes, (uint32_t)(elapsed_us / 1000), ct->ct_txfull);
+  puts("        ID period ms     sent  missed  jitter mean/max us  "
+       "late max us");
+
+  for (i = 0; i < ct->ct_nmsgs; ++i)
+    {
+      cm = &ct->ct_msgs[i];
+      printf("%10" PRIx32 " %9" PRIu32 " %8" PRIu32 " %7" PRIu32
+             " %9" PRIu32 " / %-7" PRIu32 " %11" PRIu32 "\n",
+             (uint32_t)cm->cm_msg.cm_hdr.ch_id, cm->cm_period_us / 1000,
+             cm->cm_sent, cm->cm_missed,
+             cm->cm_sent > 1 ?
+             (uint32_t)(cm->cm_jitter_sum / (cm->cm_sent - 1)) : 0,
+             cm->cm_jitter_max, cm->cm_late_max);
+    }
+
+  lathist_print(&ct->ct_late, "Send time after due time");
+}
+
+/****************************************************************************
+ * Name: test_cyclic_tx
+ *
+ * Description:
+ *   Transmits a table of periodic messages, each with its own ID, period,
+ *   offset and payload, to emulate the cyclic traffic of other ECUs. One
+ *   SCHED_FIFO thread keeps the messages in a min-heap ordered by due
+ *   time; messages due in the same scheduler tick go out in one write().
+ *   Runs until Q is entered, then reports per-message period jitter and
+ *   deadline misses.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_cyclic_tx(int canfd)
+{
+  FAR struct cyctx_s *ct = &g_cyctx;
+  struct canioc_bittiming_s bt;
+  char selection[4] = {0};
+  uint64_t bits_per_s = 0;
+  uint64_t start;
+  int priority;
+  int oflags;
+  int ret;
+  int i;
+
+  memset(ct, 0, sizeof(*ct));
+  atomic_init(&ct->ct_stop, false);
+  ct->ct_canfd = canfd;
+
+  ct->ct_nmsgs = cyctx_read_table(ct);
+  if (ct->ct_nmsgs <= 0)
+    {
+      return;
+    }
+
+  ct->ct_tick_us = prompt_long("Scheduler tick in us", 1000);
+  priority = prompt_long("Scheduler thread priority",
+                         CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY + 10);
+
+  for (i = 0; i < ct->ct_nmsgs; ++i)
+    {
+      bits_per_s += (uint64_t)canmsg_bits(&ct->ct_msgs[i].cm_msg) *
+                    1000000 / ct->ct_msgs[i].cm_period_us;
+    }
+
+  if (ioctl(canfd, CANIOC_GET_BITTIMING, &bt) >= 0 && bt.bt_baud != 0)
+    {
+      printf("Offered load %" PRIu32 " bit/s, %" PRIu32 "%% of %" PRIu32
+             " bit/s\n", (uint32_t)bits_per_s,
+             (uint32_t)(bits_per_s * 100 / bt.bt_baud), bt.bt_baud);
+    }
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      return;
+    }
+
+  /* The heap starts out sorted by offset */
+
+  start = now_us() + CYCTX_LEAD_MS * 1000;
+  for (i = 0; i < ct->ct_nmsgs; ++i)
+    {
+      ct->ct_msgs[i].cm_due = start + ct->ct_msgs[i].cm_offset_us;
+      ct->ct_heap[i] = i;
+    }
+
+  for (i = ct->ct_nmsgs / 2 - 1; i >= 0; --i)
+    {
+      cyctx_sift_down(ct, i);
+    }
+
+  ret = fifo_thread_start(&ct->ct_thread, cyctx_thread, ct, priority);
+  if (ret != 0)
+    {
+      printf("Unable to start scheduler thread: %d\n", ret);
+      fcntl(canfd, F_SETFL, oflags);
+      return;
+    }
+
+  puts("Transmitting; enter Q to stop.");
+
+  while (std_readline(selection, sizeof(selection)) > 0 &&
+         selection[0] != 'Q' && selection[0] != 'q');
+
+  atomic_store(&ct->ct_stop, true);
+  pthread_join(ct->ct_thread, NULL);
+  fcntl(canfd, F_SETFL, oflags);
+
+  cyctx_report(ct, now_us() - start);
+}
+
+/****************************************************************************
+ * Name: isotp_stmin_us
+ *
+ * Description:
+ *   Decodes an ISO-TP STmin byte: 0-0x7f ms, or 0xf1-0xf9 for 100-900 us.
+ *   Reserved values mean the longest time, 127 ms.
+ ****************************************************************************/
+
+static uint32_t isotp_stmin_us(uint8_t stmin)
+{
+  if (stmin <= 0x7f)
+    {
+      return stmin * 1000;
+    }
+  else if (stmin >= 0xf1 && stmin <= 0xf9)
+    {
+      return (stmin - 0xf0) * 100;
+    }
+
+  return 127000;
+}
+
+/****************************************************************************
+ * Name: isotp_stmin_byte
+ *
+ * Description:
+ *   Encodes a separation time in microseconds as an ISO-TP STmin byte,
+ *   rounding up to the next representable value.
+ ****************************************************************************/
+
+static uint8_t isotp_stmin_byte(uint32_t us)
+{
+  if (us == 0)
+    {
+      return 0;
+    }
+  else if (us < 1000)
+    {
+      return 0xf0 + (us + 99) / 100;
+    }
+
+  return us >= 127000 ? 0x7f : (us + 999) / 1000;
+}
+
+/****************************************************************************
+ * Name: isotp_send
+ *
+ * Description:
+ *   Sends one ISO-TP frame, padded to 8 bytes with ISOTP_PAD.
+ *
+ * Returned value:
+ *   0 on success, or -1 if the TX queue did not accept the frame.
+ ****************************************************************************/
+
+static int isotp_send(FAR struct isotp_s *it, uint32_t id,
+                      FAR const uint8_t *data, int len)
+{
+  struct can_msg_s msg;
+
+  memset(&msg.cm_hdr, 0, sizeof(msg.cm_hdr));
+  msg.cm_hdr.ch_id = id;
+  msg.cm_hdr.ch_dlc = 8;
+  memcpy(msg.cm_data, data, len);
+  memset(msg.cm_data + len, ISOTP_PAD, 8 - len);
+
+  if (write(it->it_canfd, &msg, CAN_MSGLEN(8)) < 0)
+    {
+      ++it->it_txfull;
+      return -1;
+    }
+
+  ++it->it_frames;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: isotp_pattern
+ *
+ * Description:
+ *   Test payload byte: depends on the message number and the offset, so
+ *   the receiver can check every byte. The first byte is the message
+ *   number, which lets a receiver pick up a transfer in progress.
+ ****************************************************************************/
+
+static inline uint8_t isotp_pattern(uint32_t msgno, uint32_t offset)
+{
+  return (msgno + offset * 7) & 0xff;
+}
+
+/****************************************************************************
+ * Name: isotp_tx_start
+ *
+ * Description:
+ *   Starts sending message it_tx.tx_msgno: a single frame if it fits,
+ *   otherwise a first frame followed by waiting for flow control.
+ ****************************************************************************/
+
+static void isotp_tx_start(FAR struct isotp_s *it, uint64_t now)
+{
+  FAR struct isotp_tx_s *tx = &it->it_tx;
+  uint8_t data[8];
+  int n;
+  int i;
+
+  if (it->it_msglen <= 7)
+    {
+      data[0] = ISOTP_PCI_SF | it->it_msglen;
+      for (i = 0; i < it->it_msglen; ++i)
+        {
+          data[1 + i] = isotp_pattern(tx->tx_msgno, i);
+        }
+
+      if (isotp_send(it, it->it_tx_id, data, 1 + it->it_msglen) == 0)
+        {
+          tx->tx_state = ISOTP_TX_DONE;
+        }
+      else
+        {
+          tx->tx_state = ISOTP_TX_IDLE;
+        }
+
+      return;
+    }
+
+  data[0] = ISOTP_PCI_FF | (it->it_msglen >> 8);
+  data[1] = it->it_msglen & 0xff;
+  n = 6;
+  for (i = 0; i < n; ++i)
+    {
+      data[2 + i] = isotp_pattern(tx->tx_msgno, i);
+    }
+
+  if (isotp_send(it, it->it_tx_id, data, 8) < 0)
+    {
+      tx->tx_state = ISOTP_TX_IDLE;
+      return;
+    }
+
+  tx->tx_offset = n;
+  tx->tx_sn = 1;
+  tx->tx_state = ISOTP_TX_WAIT_FC;
+  tx->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+}
+
+/****************************************************************************
+ * Name: isotp_tx_fc
+ *
+ * Description:
+ *   Sender side: handles a flow control frame from the receiver.
+ ****************************************************************************/
+
+static void isotp_tx_fc(FAR struct isotp_s *it,
+                        FAR const struct can_msg_s *msg, uint64_t now)
+{
+  FAR struct isotp_tx_s *tx = &it->it_tx;
+
+  if (tx->tx_state != ISOTP_TX_WAIT_FC ||
+      (msg->cm_data[0] & 0xf0) != ISOTP_PCI_FC)
+    {
+      return;
+    }
+
+  switch (msg->cm_data[0] & 0x0f)
+    {
+      case ISOTP_FC_CTS:
+        tx->tx_bs = msg->cm_data[1];
+        tx->tx_block_left = tx->tx_bs;
+        tx->tx_stmin_us = isotp_stmin_us(msg->cm_data[2]);
+        tx->tx_next_cf = now;
+        tx->tx_state = ISOTP_TX_SENDING;
+        break;
+
+      case ISOTP_FC_WAIT:
+        ++it->it_fc_waits;
+        tx->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+        break;
+
+      default:
+
+        /* Overflow or invalid: the receiver cannot take this message */
+
+        ++it->it_aborts;
+        tx->tx_state = ISOTP_TX_RETRY;
+        break;
+    }
+}
+
+/****************************************************************************
+ * Name: isotp_tx_poll
+ *
+ * Description:
+ *   Sender side: sends the consecutive frames that are due and handles the
+ *   flow control timeout (N_Bs). A timed-out or aborted message is sent
+ *   again from the first frame, up to ISOTP_MAX_RETRIES times.
+ ****************************************************************************/
+
+static void isotp_tx_poll(FAR struct isotp_s *it, uint64_t now)
+{
+  FAR struct isotp_tx_s *tx = &it->it_tx;
+  uint8_t data[8];
+  int n;
+  int i;
+
+  if (tx->tx_state == ISOTP_TX_WAIT_FC && now >= tx->tx_deadline)
+    {
+      ++it->it_timeouts;
+      tx->tx_state = ISOTP_TX_RETRY;
+    }
+
+  if (tx->tx_state == ISOTP_TX_RETRY)
+    {
+      if (tx->tx_retries++ < ISOTP_MAX_RETRIES)
+        {
+          ++it->it_retries;
+          isotp_tx_start(it, now);
+        }
+      else
+        {
+          ++it->it_failed;
+          tx->tx_state = ISOTP_TX_FAILED;
+        }
+
+      return;
+    }
+
+  while (tx->tx_state == ISOTP_TX_SENDING && now >= tx->tx_next_cf)
+    {
+      n = it->it_msglen - tx->tx_offset;
+      if (n > 7)
+        {
+          n = 7;
+        }
+
+      data[0] = ISOTP_PCI_CF | tx->tx_sn;
+      for (i = 0; i < n; ++i)
+        {
+          data[1 + i] = isotp_pattern(tx->tx_msgno, tx->tx_offset + i);
+        }
+
+      if (isotp_send(it, it->it_tx_id, data, 1 + n) < 0)
+        {
+          return;   /* TX queue full: try again on the next pass */
+        }
+
+      tx->tx_offset += n;
+      tx->tx_sn = (tx->tx_sn + 1) & 0x0f;
+
+      if (tx->tx_offset >= it->it_msglen)
+        {
+          tx->tx_state = ISOTP_TX_DONE;
+        }
+      else if (tx->tx_bs != 0 && --tx->tx_block_left == 0)
+        {
+          tx->tx_state = ISOTP_TX_WAIT_FC;
+          tx->tx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+        }
+      else
+        {
+          tx->tx_next_cf = now + tx->tx_stmin_us;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: isotp_rx_check
+ *
+ * Description:
+ *   Receiver side: checks received payload bytes against the test pattern.
+ ****************************************************************************/
+
+static void isotp_rx_check(FAR struct isotp_s *it,
+                           FAR const uint8_t *data, int n)
+{
+  FAR struct isotp_rx_s *rx = &it->it_rx;
+  int i;
+
+  for (i = 0; i < n; ++i)
+    {
+      if (data[i] != isotp_pattern(rx->rx_msgno, rx->rx_got + i))
+        {
+          rx->rx_corrupt = true;
+        }
+    }
+
+  rx->rx_got += n;
+}
+
+/****************************************************************************
+ * Name: isotp_rx_done
+ *
+ * Description:
+ *   Receiver side: accounts a completely received message.
+ ****************************************************************************/
+
+static void isotp_rx_done(FAR struct isotp_s *it, uint64_t now)
+{
+  FAR struct isotp_rx_s *rx = &it->it_rx;
+
+  if (rx->rx_corrupt)
+    {
+      ++it->it_corrupt;
+    }
+  else
+    {
+      ++it->it_rx_msgs;
+      it->it_rx_bytes += rx->rx_len;
+    }
+
+  it->it_rx_last = now;
+  rx->rx_state = ISOTP_RX_IDLE;
+}
+
+/****************************************************************************
+ * Name: isotp_send_fc
+ *
+ * Description:
+ *   Receiver side: sends a clear-to-send flow control frame with the
+ *   configured block size and separation time.
+ ****************************************************************************/
+
+static void isotp_send_fc(FAR struct isotp_s *it, uint64_t now)
+{
+  uint8_t data[3];
+
+  data[0] = ISOTP_PCI_FC | ISOTP_FC_CTS;
+  data[1] = it->it_bs;
+  data[2] = it->it_stmin;
+  isotp_send(it, it->it_rx_id, data, 3);
+
+  it->it_rx.rx_block_left = it->it_bs;
+  it->it_rx.rx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+}
+
+/****************************************************************************
+ * Name: isotp_rx_frame
+ *
+ * Description:
+ *   Receiver side: handles a single, first or consecutive frame. A first
+ *   frame answers with flow control, as does the last consecutive frame of
+ *   each block. Single and first frames whose length does not fit the
+ *   frame are counted as length errors and ignored.
+ ****************************************************************************/
+
+static void isotp_rx_frame(FAR struct isotp_s *it,
+                           FAR const struct can_msg_s *msg, uint64_t now)
+{
+  FAR struct isotp_rx_s *rx = &it->it_rx;
+  FAR const uint8_t *d = msg->cm_data;
+  int nbytes = canmsg_nbytes(msg);
+  int n;
+
+  if (it->it_rx_first == 0)
+    {
+      it->it_rx_first = now;
+    }
+
+  switch (d[0] & 0xf0)
+    {
+      case ISOTP_PCI_SF:
+        n = d[0] & 0x0f;
+        if (n == 0 || 1 + n > nbytes)
+          {
+            ++it->it_len_errors;
+            return;
+          }
+
+        if (rx->rx_state == ISOTP_RX_RECEIVING)
+          {
+            ++it->it_rx_aborted;
+          }
+
+        rx->rx_len = n;
+        rx->rx_msgno = d[1];
+        rx->rx_got = 0;
+        rx->rx_corrupt = false;
+        isotp_rx_check(it, d + 1, rx->rx_len);
+        isotp_rx_done(it, now);
+        break;
+
+      case ISOTP_PCI_FF:
+        n = ((d[0] & 0x0f) << 8) | d[1];
+        if (nbytes < 8 || n <= 7)
+          {
+            ++it->it_len_errors;
+            return;
+          }
+
+        if (rx->rx_state == ISOTP_RX_RECEIVING)
+          {
+            ++it->it_rx_aborted;
+          }
+
+        rx->rx_len = n;
+        rx->rx_msgno = d[2];
+        rx->rx_got = 0;
+        rx->rx_sn = 1;
+        rx->rx_corrupt = false;
+        rx->rx_state = ISOTP_RX_RECEIVING;
+        isotp_rx_check(it, d + 2, 6);
+        isotp_send_fc(it, now);
+        break;
+
+      case ISOTP_PCI_CF:
+        if (rx->rx_state != ISOTP_RX_RECEIVING)
+          {
+            return;
+          }
+
+        if ((d[0] & 0x0f) != rx->rx_sn)
+          {
+            ++it->it_seq_errors;
+            ++it->it_rx_aborted;
+            rx->rx_state = ISOTP_RX_IDLE;
+            return;
+          }
+
+        rx->rx_sn = (rx->rx_sn + 1) & 0x0f;
+        n = rx->rx_len - rx->rx_got;
+        if (n > nbytes - 1)
+          {
+            n = nbytes - 1;
+          }
+
+        isotp_rx_check(it, d + 1, n > 7 ? 7 : n);
+
+        if (rx->rx_got >= rx->rx_len)
+          {
+            isotp_rx_done(it, now);
+          }
+        else if (it->it_bs != 0 && --rx->rx_block_left == 0)
+          {
+            isotp_send_fc(it, now);
+          }
+        else
+          {
+            rx->rx_deadline = now + ISOTP_TIMEOUT_MS * 1000;
+          }
+        break;
+
+      default:
+        break;
+    }
+}
+
+/****************************************************************************
+ * Name: isotp_run
+ *
+ * Description:
+ *   Event loop for one benchmark run. Runs the sender, the receiver or both
+ *   (over loopback) on one descriptor. With the sender role it ends once
+ *   every message has been sent and, with the receiver role too, received
+ *   or given up on; a receiver on its own runs until Q is entered.
+ *
+ * Input parameters:
+ *   it    - Benchmark state; counters are updated
+ *   roles - ISOTP_ROLE_TX and/or ISOTP_ROLE_RX
+ *
+ * Returned value:
+ *   0 when finished, 1 if the user quit, or a positive errno value.
+ ****************************************************************************/
+
+static int isotp_run(FAR struct isotp_s *it, int roles)
+{
+  struct pollfd fds[] = {
+    {.fd = it->it_canfd,  .events = POLLIN, .revents = 0},
+    {.fd = STDIN_FILENO,  .events = POLLIN, .revents = 0}
+  };
+  FAR struct isotp_tx_s *tx = &it->it_tx;
+  FAR struct can_msg_s *msg;
+  struct timespec deadline;
+  uint64_t tx_end = 0;
+  uint64_t now;
+  ssize_t ret;
+  int timeout;
+  int offset;
+  int msglen;
+
+  it->it_start = now_us();
+  if (roles & ISOTP_ROLE_TX)
+    {
+      memset(tx, 0, sizeof(*tx));
+      isotp_tx_start(it, it->it_start);
+    }
+
+  while (true)
+    {
+      now = now_us();
+
+      if ((roles & ISOTP_ROLE_TX) && tx_end == 0)
+        {
+          isotp_tx_poll(it, now);
+          if (tx->tx_state == ISOTP_TX_DONE ||
+              tx->tx_state == ISOTP_TX_FAILED)
+            {
+              if (tx->tx_state == ISOTP_TX_DONE)
+                {
+                  it->it_tx_bytes += it->it_msglen;
+                }
+
+              if (++tx->tx_msgno >= it->it_nmsgs)
+                {
+                  tx_end = now;
+                  it->it_tx_end = now;
+                }
+              else
+                {
+                  tx->tx_retries = 0;
+                  isotp_tx_start(it, now);
+                }
+            }
+          else if (tx->tx_state == ISOTP_TX_IDLE)
+            {
+              isotp_tx_start(it, now);    /* TX queue was full */
+            }
+        }
+
+      /* Receiver timeout (N_Cr): the sender stopped mid-message */
+
+      if ((roles & ISOTP_ROLE_RX) &&
+          it->it_rx.rx_state == ISOTP_RX_RECEIVING &&
+          now >= it->it_rx.rx_deadline)
+        {
+          ++it->it_rx_aborted;
+          it->it_rx.rx_state = ISOTP_RX_IDLE;
+        }
+
+      if (tx_end != 0)
+        {
+          if (!(roles & ISOTP_ROLE_RX) ||
+              it->it_rx_msgs + it->it_corrupt >= it->it_nmsgs ||
+              now - tx_end >= ISOTP_TIMEOUT_MS * 1000)
+            {
+              return 0;
+            }
+        }
+
+      timeout = ISOTP_TIMEOUT_MS;
+      if (tx_end == 0 && tx->tx_state == ISOTP_TX_SENDING)
+        {
+          /* Sleep out STmin rather than poll() for it: poll() counts in
+           * whole milliseconds, so sub-millisecond STmin would spin.
+           * Whatever arrived meanwhile is read without waiting.
+           */
+
+          if (tx->tx_next_cf > now)
+            {
+              deadline.tv_sec = tx->tx_next_cf / 1000000;
+              deadline.tv_nsec = (tx->tx_next_cf % 1000000) * 1000;
+              clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                              NULL);
+            }
+
+          timeout = 0;
+        }
+      else if (tx_end == 0 && (roles & ISOTP_ROLE_TX))
+        {
+          timeout = ISOTP_POLL_MS;
+        }
+
+      ret = poll(fds, 2, timeout);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            {
+              continue;
+            }
+
+          return errno;
+        }
+
+      if (fds[1].revents & POLLIN)
+        {
+          if (rx_read_stdin_quit() != 0)
+            {
+              return 1;
+            }
+        }
+
+      if (!(fds[0].revents & POLLIN))
+        {
+          continue;
+        }
+
+      while ((ret = read(it->it_canfd, g_rxbuf, sizeof(g_rxbuf))) > 0)
+        {
+          now = now_us();
+
+          for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+            {
+              msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+              msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+              if (offset + msglen > ret)
+                {
+                  break;
+                }
+
+#ifdef CONFIG_CAN_ERRORS
+              if (msg->cm_hdr.ch_error)
+                {
+                  continue;
+                }
+#endif
+
+              if (canmsg_nbytes(msg) < 3)
+                {
+                  continue;
+                }
+
+              if ((roles & ISOTP_ROLE_RX) &&
+                  msg->cm_hdr.ch_id == it->it_tx_id)
+                {
+                  isotp_rx_frame(it, msg, now);
+                }
+              else if ((roles & ISOTP_ROLE_TX) &&
+                       msg->cm_hdr.ch_id == it->it_rx_id)
+                {
+                  isotp_tx_fc(it, msg, now);
+                }
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: isotp_report
+ *
+ * Description:
+ *   Prints one result row; returns the payload throughput in bytes/s.
+ *   With the receiver role the throughput counts bytes received intact
+ *   between the first and last frame; otherwise bytes sent.
+ ****************************************************************************/
+
+static uint32_t isotp_report(FAR const struct isotp_s *it, int roles)
+{
+  uint64_t bytes;
+  uint64_t elapsed;
+  uint32_t rate = 0;
+
+  if (roles & ISOTP_ROLE_RX)
+    {
+      bytes = it->it_rx_bytes;
+      elapsed = it->it_rx_last - it->it_rx_first;
+    }
+  else
+    {
+      bytes = it->it_tx_bytes;
+      elapsed = it->it_tx_end - it->it_start;
+    }
+
+  if (elapsed > 0)
+    {
+      rate = bytes * 1000000 / elapsed;
+    }
+
+  printf("%4u %6" PRIu32 " %7" PRIu32 " %7" PRIu32 " %7" PRIu32
+         " %7" PRIu32 " %8" PRIu32 " %8" PRIu32 " %10" PRIu32 "\n",
+         it->it_bs, isotp_stmin_us(it->it_stmin),
+         (roles & ISOTP_ROLE_RX) ? it->it_rx_msgs :
+                                   it->it_tx.tx_msgno - it->it_failed,
+         it->it_corrupt + it->it_seq_errors + it->it_len_errors,
+         it->it_rx_aborted,
+         it->it_retries, it->it_timeouts, it->it_frames, rate);
+
+  return rate;
+}
+
+/****************************************************************************
+ * Name: test_isotp
+ *
+ * Description:
+ *   ISO-TP (ISO 15765-2, normal addressing) segmented transfer benchmark.
+ *   As sender it transmits test messages and follows the flow control of
+ *   a remote receiver; as responder it receives and checks them, answering
+ *   with the configured block size (BS) and separation time (STmin). The
+ *   sweep puts the controller into loopback, runs both ends in this
+ *   process for every BS/STmin combination and reports which gives the
+ *   best payload throughput. Messages that time out waiting for flow
+ *   control are retransmitted from the first frame.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_isotp(int canfd)
+{
+  FAR struct isotp_s *it = &g_isotp;
+  struct canioc_connmodes_s saved;
+  long bs_list[SWEEP_MAX_VALUES];
+  long st_list[SWEEP_MAX_VALUES];
+  uint32_t tx_id;
+  uint32_t rx_id;
+  uint32_t rate;
+  uint32_t best_rate = 0;
+  int best_bs = 0;
+  uint8_t best_st = 0;
+  int nbs;
+  int nst;
+  int mode;
+  int msglen;
+  int nmsgs;
+  int oflags;
+  int roles;
+  int ret = 0;
+  int b;
+  int s;
+
+  mode = prompt_long("1 send, 2 respond, 3 loopback BS/STmin sweep", 3);
+  tx_id = prompt_long("Data frame ID (sender to responder)", ISOTP_DATA_ID);
+  rx_id = prompt_long("Flow control ID (responder to sender)", ISOTP_FC_ID);
+
+  msglen = 0;
+  nmsgs = 0;
+  if (mode != 2)
+    {
+      msglen = prompt_long("Message length in bytes", 1024);
+      nmsgs = prompt_long("Messages per run", 20);
+      if (msglen < 1 || msglen > ISOTP_MAX_LEN || nmsgs < 1)
+        {
+          printf("Length must be 1 to %d and at least one message sent.\n",
+                 ISOTP_MAX_LEN);
+          return;
+        }
+    }
+
+  memset(it, 0, sizeof(*it));
+  it->it_canfd = canfd;
+  it->it_tx_id = tx_id;
+  it->it_rx_id = rx_id;
+  it->it_msglen = msglen;
+  it->it_nmsgs = nmsgs;
+
+  nbs = 1;
+  nst = 1;
+  bs_list[0] = 0;
+  st_list[0] = 0;
+
+  if (mode == 2)
+    {
+      bs_list[0] = prompt_long("Block size (0 = no limit)", 8);
+      st_list[0] = prompt_long("STmin in us", 0);
+      roles = ISOTP_ROLE_RX;
+    }
+  else if (mode == 3)
+    {
+      nbs = prompt_list("Block sizes", "0 2 4 8 16", bs_list,
+                        SWEEP_MAX_VALUES);
+      nst = prompt_list("STmin values in us", "0 500 1000 2000", st_list,
+                        SWEEP_MAX_VALUES);
+      roles = ISOTP_ROLE_TX | ISOTP_ROLE_RX;
+
+      if (can_set_loopback(canfd, true, &saved) < 0)
+        {
+          printf("Loopback mode not supported by the driver: %d\n", errno);
+          return;
+        }
+    }
+  else
+    {
+      roles = ISOTP_ROLE_TX;
+    }
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      if (mode == 3)
+        {
+          ioctl(canfd, CANIOC_SET_CONNMODES, &saved);
+        }
+
+      return;
+    }
+
+  if (mode == 2)
+    {
+      puts("Responding; enter Q to stop.");
+    }
+
+  puts("  BS  STmin    msgs  errors aborted retries timeouts   frames"
+       "  payload B/s");
+
+  for (b = 0; b < nbs && ret == 0; ++b)
+    {
+      for (s = 0; s < nst && ret == 0; ++s)
+        {
+          memset(it, 0, offsetof(struct isotp_s, it_canfd));
+          it->it_bs = bs_list[b] < 0 ? 0 : bs_list[b] > 255 ? 255 :
+                      bs_list[b];
+          it->it_stmin = isotp_stmin_byte(st_list[s] < 0 ? 0 :
+                                          st_list[s]);
+
+          ret = isotp_run(it, roles);
+          rate = isotp_report(it, roles);
+          if (rate > best_rate)
+            {
+              best_rate = rate;
+              best_bs = it->it_bs;
+              best_st = it->it_stmin;
+            }
+
+          /* Let the other end time out whatever was in flight */
+
+          while (read(canfd, g_rxbuf, sizeof(g_rxbuf)) > 0);
+        }
+    }
+
+  fcntl(canfd, F_SETFL, oflags);
+  if (mode == 3)
+    {
+      ioctl(canfd, CANIOC_SET_CONNMODES, &saved);
+    }
+
+  if (ret > 1)
+    {
+      printf("Benchmark stopped by error %d\n", ret);
+    }
+
+  if (mode == 3 && best_rate > 0)
+    {
+      printf("Best: BS %d, STmin %" PRIu32 " us: %" PRIu32
+             " payload bytes/s\n", best_bs, isotp_stmin_us(best_st),
+             best_rate);
+    }
+}
+
+/****************************************************************************
+ * Name: fuzz_fill
+ *
+ * Description:
+ *   Fills in one fuzz frame from the generator state: ID, extended bit,
+ *   RTR bit, DLC and payload are all random. A share of the frames use
+ *   one of the controller's own IDs instead of a random one. The status
+ *   ID is never generated, so the monitor only sees the controller.
+ ****************************************************************************/
+
+static void fuzz_fill(FAR struct fuzz_s *fz, FAR struct can_msg_s *msg)
+{
+  uint32_t r;
+  uint32_t id;
+  bool extid;
+  int i;
+
+  memset(&msg->cm_hdr, 0, sizeof(msg->cm_hdr));
+
+  r = prng_next(&fz->fz_prng);
+  if (fz->fz_nids > 0 && r % 100 < fz->fz_id_pct)
+    {
+      id = fz->fz_ids[(r >> 8) % fz->fz_nids];
+      extid = id > CAN_MAX_STDMSGID;
+    }
+  else
+    {
+      extid = (r & (1 << 16)) != 0;
+      id = prng_next(&fz->fz_prng);
+      id &= extid ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID;
+    }
+
+#ifdef CONFIG_CAN_EXTID
+  msg->cm_hdr.ch_extid = extid;
+#else
+  extid = false;
+  id &= CAN_MAX_STDMSGID;
+#endif
+
+  if (id == fz->fz_status_id && extid == fz->fz_status_ext)
+    {
+      id ^= 1;
+    }
+
+  msg->cm_hdr.ch_id = id;
+  msg->cm_hdr.ch_rtr = ((r >> 17) & 7) == 0;
+  msg->cm_hdr.ch_dlc = (r >> 20) % (FUZZ_MAX_DLC + 1);
+
+  for (i = 0; i < canmsg_nbytes(msg); ++i)
+    {
+      msg->cm_data[i] = msg->cm_hdr.ch_rtr ? 0 : prng_next(&fz->fz_prng);
+    }
+
+  fz->fz_generated++;
+  fz->fz_ext += extid;
+  fz->fz_rtr += msg->cm_hdr.ch_rtr;
+}
+
+/****************************************************************************
+ * Name: fuzz_status
+ *
+ * Description:
+ *   Checks one periodic status frame from the controller. Gaps are
+ *   rounded to whole periods to count missed ones. With a counter byte,
+ *   a counter that stands still or advances by more than the periods
+ *   elapsed (plus one for timing slack) counts as a reset of the
+ *   controller. Advancing by less just means the controller skipped
+ *   periods without counting them.
+ ****************************************************************************/
+
+static void fuzz_status(FAR struct fuzz_s *fz,
+                        FAR const struct can_msg_s *msg, uint64_t ts)
+{
+  uint32_t periods;
+  uint32_t gap;
+  uint8_t count = 0;
+  uint8_t delta;
+  bool have_count;
+
+  have_count = fz->fz_counter >= 0 &&
+               fz->fz_counter < canmsg_nbytes(msg) && !msg->cm_hdr.ch_rtr;
+  if (have_count)
+    {
+      count = msg->cm_data[fz->fz_counter];
+    }
+
+  if (fz->fz_status > 0)
+    {
+      gap = ts - fz->fz_status_last;
+      if (gap > fz->fz_max_gap)
+        {
+          fz->fz_max_gap = gap;
+        }
+
+      lathist_add(&fz->fz_jitter, gap > fz->fz_period_us ?
+                  gap - fz->fz_period_us : fz->fz_period_us - gap);
+
+      periods = (gap + fz->fz_period_us / 2) / fz->fz_period_us;
+      if (periods > 1)
+        {
+          fz->fz_missed += periods - 1;
+        }
+
+      if (periods >= FUZZ_SILENCE_PERIODS)
+        {
+          ++fz->fz_silences;
+        }
+
+      if (have_count && fz->fz_have_count)
+        {
+          delta = count - fz->fz_count_last;
+          if (delta == 0 || delta > periods + 1)
+            {
+              ++fz->fz_resets;
+            }
+        }
+    }
+
+  fz->fz_status_last = ts;
+  fz->fz_count_last = count;
+  fz->fz_have_count = have_count;
+  ++fz->fz_status;
+}
+
+/****************************************************************************
+ * Name: fuzz_receive
+ *
+ * Description:
+ *   Reads everything the driver has queued, passing status frames to
+ *   fuzz_status() and counting the driver's error reports.
+ ****************************************************************************/
+
+static void fuzz_receive(int canfd, FAR struct fuzz_s *fz)
+{
+  FAR struct can_msg_s *msg;
+  uint64_t read_us;
+  int offset;
+  int msglen;
+  ssize_t ret;
+
+  while ((ret = read(canfd, g_rxbuf, sizeof(g_rxbuf))) > 0)
+    {
+      read_us = now_us();
+
+      for (offset = 0; offset + CAN_MSGLEN(0) <= ret; offset += msglen)
+        {
+          msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+          msglen = CAN_MSGLEN(canmsg_nbytes(msg));
+          if (offset + msglen > ret)
+            {
+              break;
+            }
+
+#ifdef CONFIG_CAN_ERRORS
+          if (msg->cm_hdr.ch_error)
+            {
+              ++fz->fz_errframes;
+              if (msg->cm_hdr.ch_id & CAN_ERROR_LOSTARB)
+                {
+                  ++fz->fz_lostarb;
+                }
+
+              if (msg->cm_hdr.ch_id & CAN_ERROR_BUSOFF)
+                {
+                  ++fz->fz_busoff;
+                }
+
+              if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+                  (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+                {
+                  ++fz->fz_rxoverflow;
+                }
+
+              if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+                  (msg->cm_data[1] & CAN_ERROR1_TXOVERFLOW))
+                {
+                  ++fz->fz_txoverflow;
+                }
+
+              continue;
+            }
+#endif
+
+#ifdef CONFIG_CAN_EXTID
+          if (msg->cm_hdr.ch_extid != fz->fz_status_ext)
+            {
+              continue;
+            }
+#endif
+
+          if (msg->cm_hdr.ch_id == fz->fz_status_id)
+            {
+              fuzz_status(fz, msg, rx_frame_time(msg, read_us));
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: fuzz_report
+ *
+ * Description:
+ *   Prints the running totals; called once per FUZZ_REPORT_MS.
+ ****************************************************************************/
+
+static void fuzz_report(FAR const struct fuzz_s *fz, uint64_t now,
+                        uint64_t start)
+{
+  printf("%4" PRIu32 " s: %8" PRIu32 " sent, %6" PRIu32 " rejected, "
+         "%3" PRIu32 "%% load; status %6" PRIu32 ", missed %4" PRIu32
+         ", resets %3" PRIu32 "\n", (uint32_t)((now - start) / 1000000),
+         fz->fz_sent, fz->fz_txfull,
+         (uint32_t)(fz->fz_bits * 100000000 / fz->fz_bitrate /
+                    (now - start + 1)),
+         fz->fz_status, fz->fz_missed, fz->fz_resets);
+  fflush(stdout);
+}
+
+/****************************************************************************
+ * Name: test_fuzz_load
+ *
+ * Description:
+ *   Fuzzing load test. Sends reproducible random frames (see fuzz_fill())
+ *   at a target share of the bus bandwidth, alongside the controller's
+ *   normal traffic, while checking the controller's periodic status frame
+ *   for missed periods and resets. Frame timing follows the bit time
+ *   estimate of canmsg_bits(); frames the TX queue rejects are counted
+ *   and the schedule is not stretched, so the offered load stays as set.
+ *   The same seed always produces the same frame sequence.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_fuzz_load(int canfd)
+{
+  struct pollfd fds[] = {
+    {.fd = canfd,        .events = POLLIN, .revents = 0},
+    {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0}
+  };
+  FAR struct fuzz_s *fz = &g_fuzz;
+  FAR struct can_msg_s *msg;
+  struct canioc_bittiming_s bt;
+  long ids[FUZZ_MAX_IDS];
+  long bitrate = 500000;
+  uint64_t bits;
+  uint64_t start;
+  uint64_t end;
+  uint64_t due;
+  uint64_t next_report;
+  uint64_t now;
+  uint32_t load;
+  uint32_t tail;
+  size_t len;
+  size_t done;
+  ssize_t ret;
+  int timeout;
+  int oflags;
+  int n;
+  int i;
+
+  memset(fz, 0, sizeof(*fz));
+
+  if (ioctl(canfd, CANIOC_GET_BITTIMING, &bt) >= 0)
+    {
+      bitrate = bt.bt_baud;
+    }
+
+  fz->fz_seed = prompt_long("Seed", 1);
+  fz->fz_bitrate = prompt_long("Bit rate in bit/s", bitrate);
+  load = prompt_long("Fuzz bus load in percent", 30);
+  end = prompt_long("Duration in s", 30);
+  fz->fz_status_id = prompt_long("Controller status ID", FUZZ_STATUS_ID);
+  fz->fz_period_us = prompt_long("Status period in ms", 10) * 1000;
+  fz->fz_counter = prompt_long("Status counter byte (-1 = none)", -1);
+  fz->fz_nids = prompt_list("Controller IDs to mix in (empty = none)", "",
+                            ids, FUZZ_MAX_IDS);
+  if (fz->fz_nids > 0)
+    {
+      fz->fz_id_pct = prompt_long("Percent of frames using them", 25);
+    }
+
+  if (load < 1 || load > 100 || fz->fz_bitrate == 0 ||
+      fz->fz_period_us == 0)
+    {
+      puts("Load must be 1 to 100 percent, and the bit rate and status "
+           "period nonzero.");
+      return;
+    }
+
+  for (i = 0; i < fz->fz_nids; ++i)
+    {
+      fz->fz_ids[i] = ids[i];
+    }
+
+  fz->fz_status_ext = fz->fz_status_id > CAN_MAX_STDMSGID;
+  fz->fz_prng = fz->fz_seed != 0 ? fz->fz_seed : 1;
+
+  oflags = fcntl(canfd, F_GETFL);
+  if (oflags < 0 || fcntl(canfd, F_SETFL, oflags | O_NONBLOCK) < 0)
+    {
+      printf("Unable to make CAN device non-blocking: %d\n", errno);
+      return;
+    }
+
+  printf("Fuzzing with seed %" PRIu32 " for %" PRIu32 " s. Type Q to stop "
+         "early.\n", fz->fz_seed, (uint32_t)end);
+  fflush(stdout);
+
+  start = now_us();
+  end = start + end * 1000000;
+  due = start;
+  next_report = start + FUZZ_REPORT_MS * 1000;
+  bits = 0;
+
+  while ((now = now_us()) < end)
+    {
+      /* Everything that has come due goes out in one write() */
+
+      len = 0;
+      for (n = 0; n < TXGEN_BATCH_MAX && due <= now; ++n)
+        {
+          msg = (FAR struct can_msg_s *)(g_txbuf + len);
+          fuzz_fill(fz, msg);
+          len += CAN_MSGLEN(canmsg_nbytes(msg));
+          bits += canmsg_bits(msg);
+          due = start + bits * 100000000 / ((uint64_t)load * fz->fz_bitrate);
+        }
+
+      ret = len > 0 ? write(canfd, g_txbuf, len) : 0;
+      if (ret < 0)
+        {
+          if (errno != EAGAIN)
+            {
+              printf("write() failed: %d\n", errno);
+              break;
+            }
+
+          ret = 0;
+        }
+
+      for (done = 0; done < len; done += CAN_MSGLEN(canmsg_nbytes(msg)))
+        {
+          msg = (FAR struct can_msg_s *)(g_txbuf + done);
+          if (done < (size_t)ret)
+            {
+              ++fz->fz_sent;
+              fz->fz_bits += canmsg_bits(msg);
+            }
+          else
+            {
+              ++fz->fz_txfull;
+            }
+        }
+
+      fuzz_receive(canfd, fz);
+
+      if (now >= next_report)
+        {
+          fuzz_report(fz, now, start);
+          next_report += FUZZ_REPORT_MS * 1000;
+        }
+
+      timeout = 0;
+      if (due > now)
+        {
+          timeout = (due - now) / 1000;
+          if (timeout > FUZZ_REPORT_MS)
+            {
+              timeout = FUZZ_REPORT_MS;
+            }
+        }
+
+      if (poll(fds, 2, timeout) > 0 && (fds[1].revents & POLLIN) &&
+          rx_read_stdin_quit() != 0)
+        {
+          break;
+        }
+    }
+
+  fuzz_receive(canfd, fz);
+  fcntl(canfd, F_SETFL, oflags);
+  now = now_us();
+
+  /* Periods missed since the last status frame */
+
+  if (fz->fz_status > 0 && now > fz->fz_status_last)
+    {
+      tail = (now - fz->fz_status_last) / fz->fz_period_us;
+      if (tail > 1)
+        {
+          fz->fz_missed += tail - 1;
+        }
+    }
+
+  fuzz_report(fz, now, start);
+  printf("Seed %" PRIu32 ": %" PRIu32 " frames generated, %" PRIu32
+         " extended, %" PRIu32 " RTR\n", fz->fz_seed, fz->fz_generated,
+         fz->fz_ext, fz->fz_rtr);
+#ifdef CONFIG_CAN_ERRORS
+  printf("Error reports: %" PRIu32 " (lost arbitration %" PRIu32
+         ", RX overflow %" PRIu32 ", TX overflow %" PRIu32 ", bus off %"
+         PRIu32 ")\n", fz->fz_errframes, fz->fz_lostarb, fz->fz_rxoverflow,
+         fz->fz_txoverflow, fz->fz_busoff);
+#endif
+
+  if (fz->fz_status == 0)
+    {
+      printf("No status frames with ID 0x%" PRIx32 " received.\n",
+             fz->fz_status_id);
+      return;
+    }
+
+  printf("Status frames: %" PRIu32 ", missed periods: %" PRIu32 "\n",
+         fz->fz_status, fz->fz_missed);
+  printf("Resets: %" PRIu32 ", silences of %d+ periods: %" PRIu32
+         ", longest gap: %" PRIu32 " us\n", fz->fz_resets,
+         FUZZ_SILENCE_PERIODS, fz->fz_silences, fz->fz_max_gap);
+  lathist_print(&fz->fz_jitter, "Status period jitter");
+}
+
+/****************************************************************************
+ * Name: test_add_std_filter
+ *
+ * Description:
+ *   Allows user to add filters (this removes the default accept-anything
+ *   filter)
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN)
+ ****************************************************************************/
+
+static void test_add_std_filter(int canfd)
+{
+  int ret;
+  char selection[13] = {0};
+  struct canioc_stdfilter_s filter;
+
+  fputs("Standard mask filter: enter a message ID as 1's and 0's with\n"
+        "don't cares represented by X's. (example: 11X001X)\n"
+        "Unspecified bits are treated as must-match leading zeros.\n", stdout);
+
+  while (true)
+    {
+      fputs("Enter a filter, or Q to quit: ", stdout);
+      fflush(stdout);
+      std_readline(selection, 13);
+
+      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+        {
+          puts("Quit");
+          break;
+        }
+      else
+        {
+          ret = parse_mask(selection, &filter, false);
+          if (ret < 0)
+            {
+              printf("Error parsing mask: %d\n", errno);
+              continue;
+            }
+
+          ret = ioctl(canfd, CANIOC_ADD_STDFILTER, &filter);
+          if (ret < 0)
+            {
+              printf("Error adding filter: %d\n", errno);
+            }
+          else
+            {
+              printf("Added filter %d.\n", ret);
+              filtrec_add(false, ret, filter.sf_id1, filter.sf_id2,
+                          filter.sf_type);
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: test_add_ext_filter
+ *
+ * Description:
+ *   Allows the user to add filters (this removes the default accept-antyhing
+ *   filter)
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN)
+ ****************************************************************************/
+
+#ifdef CONFIG_CAN_EXTID
+static void test_add_ext_filter(int canfd)
+{
+  int ret;
+  char selection[31] = {0};
+  struct canioc_extfilter_s filter;
+
+  fputs("Extended mask filter: enter a message ID as 1's and 0's with\n"
+        "don't cares represented by X's (example: 11X001X) \n"
+        "Unspecified bits are treated as must-match leading zeros.\n", stdout);
+
+  while (true)
+    {
+      fputs("Enter a filter, or Q to quit: ", stdout);
+      fflush(stdout);
+      std_readline(selection, 13);
+
+      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+        {
+          puts("Quit");
+          break;
+        }
+      else
+        {
+          ret = parse_mask(selection, &filter, true);
+          if (ret < 0)
+            {
+              printf("Error parsing mask: %d\n", errno);
+              continue;
+            }
+
+          ret = ioctl(canfd, CANIOC_ADD_EXTFILTER, &filter);
+          if (ret < 0)
+            {
+              printf("Error adding filter: %d\n", errno);
+            }
+          else
+            {
+              printf("Added filter %d.\n", ret);
+              filtrec_add(true, ret, filter.xf_id1, filter.xf_id2,
+                          filter.xf_type);
+            }
+        }
+    }
+}
+#endif
+
+/****************************************************************************
+ * Name: test_rtr_transaction
+ *
+ * Description:
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ *
+ ****************************************************************************/
+
+static void test_rtr_transaction(int canfd)
+{
+  int ret;
+  long id;
+  char selection[31] = {0};
+  struct can_msg_s    xpectd_msg;
+  struct canioc_rtr_s rmt_req = {
+    .ci_timeout = {
+      .tv_sec = 10,
+      .tv_nsec = 1000
+    },
+    .ci_msg = &xpectd_msg
+  };
+
+  while (true)
+    {
+      fputs("Enter X for extended ID, S for standard ID, followed by the\n"
+            "message ID in decimal. (e.g. S1520) Enter Q to quit: ", stdout);
+      fflush(stdout);
+      std_readline(selection, 31);
+
+      switch (selection[0])
+      {
+        case 'X':
+#ifdef CONFIG_CAN_EXTID
+          xpectd_msg.cm_hdr.ch_extid = true;
+          break;
+#else
+          puts("Extended ID support disabled in this build.");
+          continue;
+#endif
+        case 'S':
+#ifdef CONFIG_CAN_EXTID
+          xpectd_msg.cm_hdr.ch_extid = false;
+#endif
+          break;
+        case 'Q':
+        case 'q':
+          puts("Quit");
+          return;
+        default:
+          puts("Unexpected starting character.");
+          continue;
+      }
+
+      if (selection[1] < '0' || selection[1] > '9')
+        {
+          puts("Not a valid message ID.");
+          continue;
+        }
+
+      id = atol(selection + 1);
+
+#ifdef CONFIG_CAN_EXTID
+      if (!xpectd_msg.cm_hdr.ch_extid && id > CAN_MAX_STDMSGID)
+        {
+          puts("Standard message ID too large.");
+          continue;
+        }
+      else if (xpectd_msg.cm_hdr.ch_extid && id > CAN_MAX_EXTMSGID)
+        {
+          puts("Extended message ID too large.");
+          continue;
+        }
+#else
+      if (id > CAN_MAX_STDMSGID)
+      {
+        puts("Standard message ID too large.");
+        continue;
+      }
+#endif
+
+      xpectd_msg.cm_hdr.ch_id = id;
+
+      fputs("Enter the data length code to request in decimal,\n"
+            "or Q to quit: ", stdout);
+      fflush(stdout);
+      std_readline(selection, 31);
+
+      if (selection[0] < '0' || selection[0] > '9')
+      {
+        if (selection[0] == 'q' || selection[0] == 'Q')
+          {
+            return;
+          }
+        else
+          {
+            puts("Not a valid DLC");
+            continue;
+          }
+      }
+
+      xpectd_msg.cm_hdr.ch_dlc = atoi(selection);
+
+      if (xpectd_msg.cm_hdr.ch_dlc > 8)
+      {
+        puts("DLC too large. Remote frames carry at most 8 bytes.");
+        continue;
+      }
+
+      puts("Sending request and waiting for response...");
+      fflush(stdout);
+      ret = ioctl(canfd, CANIOC_RTR, &rmt_req);
+
+      if (ret < 0)
+      {
+        printf("Request failed: %d\n", errno);
+      }
+      else
+      {
+        puts("Response received:");
+        print_canmsgs((uint8_t *)&xpectd_msg,
+                      CAN_MSGLEN(xpectd_msg.cm_hdr.ch_dlc));
+      }
+    }
+}
+
+/****************************************************************************
+ * Name: rtrbench_compare
+ *
+ * Description:
+ *   qsort() comparator for round-trip times.
+ ****************************************************************************/
+
+static int rtrbench_compare(FAR const void *a, FAR const void *b)
+{
+  uint32_t ua = *(FAR const uint32_t *)a;
+  uint32_t ub = *(FAR const uint32_t *)b;
+
+  return ua < ub ? -1 : ua > ub;
+}
+
+/****************************************************************************
+ * Name: test_rtr_benchmark
+ *
+ * Description:
+ *   Repeats a CANIOC_RTR transaction against one ID and reports the
+ *   distribution of round-trip times, measured with the monotonic clock
+ *   around the ioctl.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_rtr_benchmark(int canfd)
+{
+  struct can_msg_s    request;
+  struct can_msg_s    xpectd_msg;
+  struct canioc_rtr_s rmt_req;
+  struct timespec delay;
+  uint64_t t0;
+  uint32_t rtt;
+  uint32_t n = 0;
+  uint32_t timeouts = 0;
+  uint32_t failures = 0;
+  long reps;
+  long timeout_ms;
+  long delay_ms;
+  long id;
+  int ret;
+  int i;
+
+  memset(&xpectd_msg, 0, sizeof(xpectd_msg));
+
+#ifdef CONFIG_CAN_EXTID
+  xpectd_msg.cm_hdr.ch_extid = prompt_long("Extended ID (1/0)", 0) != 0;
+#endif
+  id = prompt_long("Message ID", 0);
+  xpectd_msg.cm_hdr.ch_dlc = prompt_long("DLC to request", 8);
+  reps = prompt_long("Number of requests", 100);
+  timeout_ms = prompt_long("Timeout per request in ms", 100);
+  delay_ms = prompt_long("Delay between requests in ms", 10);
+
+#ifdef CONFIG_CAN_EXTID
+  if (id < 0 || id > (xpectd_msg.cm_hdr.ch_extid ?
+                      CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID))
+#else
+  if (id < 0 || id > CAN_MAX_STDMSGID)
+#endif
+    {
+      puts("Not a valid message ID.");
+      return;
+    }
+
+  if (xpectd_msg.cm_hdr.ch_dlc > 8)
+    {
+      puts("DLC too large. Remote frames carry at most 8 bytes.");
+      return;
+    }
+
+  if (reps < 1 || reps > RTRBENCH_MAX)
+    {
+      printf("Number of requests must be 1 to %d.\n", RTRBENCH_MAX);
+      return;
+    }
+
+  xpectd_msg.cm_hdr.ch_id = id;
+  request = xpectd_msg;
+
+  rmt_req.ci_timeout.tv_sec = timeout_ms / 1000;
+  rmt_req.ci_timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  rmt_req.ci_msg = &xpectd_msg;
+
+  delay.tv_sec = delay_ms / 1000;
+  delay.tv_nsec = (delay_ms % 1000) * 1000000;
+
+  printf("Sending %ld remote requests...\n", reps);
+  fflush(stdout);
+
+  for (i = 0; i < reps; ++i)
+    {
+      /* The driver overwrites the whole message with the response */
+
+      xpectd_msg = request;
+
+      t0 = now_us();
+      ret = ioctl(canfd, CANIOC_RTR, &rmt_req);
+      rtt = now_us() - t0;
+
+      if (ret >= 0)
+        {
+          g_rtr_samples[n++] = rtt;
+        }
+      else if (errno == ETIMEDOUT)
+        {
+          ++timeouts;
+        }
+      else
+        {
+          ++failures;
+          if (failures == 1)
+            {
+              printf("Request failed: %d\n", errno);
+            }
+        }
+
+      if (delay_ms > 0)
+        {
+          nanosleep(&delay, NULL);
+        }
+    }
+
+  printf("%" PRIu32 " responses, %" PRIu32 " timeouts, %" PRIu32
+         " failures\n", n, timeouts, failures);
+
+  if (n == 0)
+    {
+      return;
+    }
+
+  qsort(g_rtr_samples, n, sizeof(g_rtr_samples[0]), rtrbench_compare);
+
+  /* Nearest-rank percentiles */
+
+  printf("Round trip (us): min %" PRIu32 ", median %" PRIu32 ", p99 %"
+         PRIu32 ", max %" PRIu32 "\n", g_rtr_samples[0],
+         g_rtr_samples[(n - 1) / 2], g_rtr_samples[(n * 99 + 99) / 100 - 1],
+         g_rtr_samples[n - 1]);
+}
+
+/****************************************************************************
+ * Name: parse_mask
+ *
+ * Description:
+ *   Converts a string like 11X001X into an ID and mask in the passed filter
+ *   struct. If the string is shorter than the number of bits in the message
+ *   ID, then it is the same as if they had been explicitly specified as 0's.
+ *
+ * Input parameters:
+ *   msk      - User input string
+ *   fltr_ptr - Pointer to either struct canioc_stdfilter_s or
+ *              struct canioc_extfilter_s
+ *   extended - Whether to interpret the struct and the filter as extended or
+ *              standard
+ *
+ * Return value: 0 on success, -1 with errno set if an error occurred.
+ ****************************************************************************/
+
+static int parse_mask(const char *msk, void *fltr_ptr, bool extended)
+{
+  int i;
+  struct canioc_stdfilter_s *sfilter = fltr_ptr;
+  if (!extended)
+    {
+      memset(sfilter, 0, sizeof(struct canioc_stdfilter_s));
+      sfilter->sf_type = CAN_FILTER_MASK;
+    }
+
+#ifdef CONFIG_CAN_EXTID
+  struct canioc_extfilter_s *xfilter = fltr_ptr;
+  if (extended)
+    {
+      memset(xfilter, 0, sizeof(struct canioc_extfilter_s));
+      xfilter->xf_type = CAN_FILTER_MASK;
+    }
+#else
+  if (extended)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+#endif
+
+  if (msk[0] == '\0' || msk[0] == '\r' || msk[0] == '\n')
+    {
+      puts("No filter given.");
+      errno = EINVAL;
+      return -1;
+    }
+
+  for (i = 0; msk[i] != '\0' && msk[i] != '\r' && msk[i] != '\n'; ++i)
+    {
+      if ((extended && i > 28) || (!extended && i > 10))
+      {
+        puts("Unexpected extra characters at end of filter.");
+        errno = EINVAL;
+        return -1;
+      }
+
+      switch (msk[i])
+        {
+          case '1':
+              if (extended)
+                {
+#ifdef CONFIG_CAN_EXTID
+                  xfilter->xf_id1 |= 1 << (28 - i);
+#endif
+                }
+              else
+                {
+                  sfilter->sf_id1 |= 1 << (10 - i);
+                }
+
+              /* id2 stores the mask... the bit must be set regardless whether
+              * this is a 0 or a 1, so fall through.
+              */
+
+          case '0':
+              if (extended)
+                {
+#ifdef CONFIG_CAN_EXTID
+                  xfilter->xf_id2 |= 1 << (28 - i);
+#endif
+                }
+              else
+                {
+                  sfilter->sf_id2 |= 1 << (10 - i);
+                }
+
+              break;
+
+          case 'X':
+          case 'x':
+              /* Don't care - leave mask bit as zero */
+              break;
+
+          default:
+              printf("Unexpected character in filter: %c\n", msk[i]);
+              errno = EINVAL;
+              return -1;
+        }
+    }
+
+  if (extended)
+    {
+#ifdef CONFIG_CAN_EXTID
+      /* Shift right if the user didn't type out all 29 bits. */
+      xfilter->xf_id1 >>= (29 - i);
+      xfilter->xf_id2 >>= (29 - i);
+
+      /* Require the ID to match 0's for unspecified most-significant bits. */
+      xfilter->xf_id2 |= (0xffffffff << i);
+#endif
+    }
+  else
+    {
+      /* Shift right if the user the user didn't type out all 29 bits. */
+      sfilter->sf_id1 >>= (11 - i);
+      sfilter->sf_id2 >>= (11 - i);
+
+      /* Require the ID to match 0's for unspecifed most-significant bits. */
+      sfilter->sf_id2 |= (0xffffffff << i);
+    }
+
+  return OK;
+}
+
+/****************************************************************************
+ * Name: filtopt_wanted
+ *
+ * Description:
+ *   Counts the wanted IDs that a mask filter accepts.
+ ****************************************************************************/
+
+static uint32_t filtopt_wanted(FAR const struct filtopt_s *opt,
+                               uint32_t id, uint32_t mask)
+{
+  uint32_t n = 0;
+  int i;
+
+  for (i = 0; i < opt->fo_nids; ++i)
+    {
+      if ((opt->fo_ids[i] & mask) == id)
+        {
+          ++n;
+        }
+    }
+
+  return n;
+}
+
+/****************************************************************************
+ * Name: filtopt_unwanted
+ *
+ * Description:
+ *   Counts the IDs a mask filter accepts that are not in the wanted list.
+ ****************************************************************************/
+
+static uint64_t filtopt_unwanted(FAR const struct filtopt_s *opt,
+                                 uint32_t id, uint32_t mask)
+{
+  uint32_t dontcare = opt->fo_idmask & ~mask;
+  uint64_t passes = (uint64_t)1 << __builtin_popcount(dontcare);
+
+  return passes - filtopt_wanted(opt, id, mask);
+}
+
+/****************************************************************************
+ * Name: filtopt_compile
+ *
+ * Description:
+ *   Greedily merges the wanted IDs into at most opt->fo_limit mask filters.
+ *   Starting from one exact-match filter per ID, it repeatedly merges the
+ *   pair of filters whose union lets through the fewest additional unwanted
+ *   IDs. Merges that cost nothing are always taken, so the result may use
+ *   fewer filters than the limit. Filters made redundant by a merge are
+ *   dropped.
+ *
+ * Input parameters:
+ *   opt - IDs to cover; receives the filters in fo_fid/fo_fmask
+ ****************************************************************************/
+
+static void filtopt_compile(FAR struct filtopt_s *opt)
+{
+  int64_t cost;
+  int64_t best_cost;
+  uint32_t mask;
+  uint32_t id;
+  int best_i;
+  int best_j;
+  int i;
+  int j;
+
+  opt->fo_nfilters = 0;
+  for (i = 0; i < opt->fo_nids; ++i)
+    {
+      for (j = 0; j < opt->fo_nfilters; ++j)
+        {
+          if (opt->fo_fid[j] == opt->fo_ids[i])
+            {
+              break;
+            }
+        }
+
+      if (j == opt->fo_nfilters)
+        {
+          opt->fo_fid[j] = opt->fo_ids[i];
+          opt->fo_fmask[j] = opt->fo_idmask;
+          ++opt->fo_nfilters;
+        }
+    }
+
+  while (opt->fo_nfilters > 1)
+    {
+      best_i = -1;
+      best_j = -1;
+      best_cost = INT64_MAX;
+
+      for (i = 0; i < opt->fo_nfilters; ++i)
+        {
+          for (j = i + 1; j < opt->fo_nfilters; ++j)
+            {
+              mask = opt->fo_fmask[i] & opt->fo_fmask[j] &
+                     ~(opt->fo_fid[i] ^ opt->fo_fid[j]);
+              id = opt->fo_fid[i] & mask;
+
+              /* Negative when the two filters overlap */
+
+              cost = (int64_t)filtopt_unwanted(opt, id, mask) -
+                     (int64_t)filtopt_unwanted(opt, opt->fo_fid[i],
+                                               opt->fo_fmask[i]) -
+                     (int64_t)filtopt_unwanted(opt, opt->fo_fid[j],
+                                               opt->fo_fmask[j]);
+
+              if (cost < best_cost)
+                {
+                  best_cost = cost;
+                  best_i = i;
+                  best_j = j;
+                }
+            }
+        }
+
+      if (best_cost > 0 && opt->fo_nfilters <= opt->fo_limit)
+        {
+          break;
+        }
+
+      mask = opt->fo_fmask[best_i] & opt->fo_fmask[best_j] &
+             ~(opt->fo_fid[best_i] ^ opt->fo_fid[best_j]);
+      id = opt->fo_fid[best_i] & mask;
+
+      opt->fo_fid[best_i] = id;
+      opt->fo_fmask[best_i] = mask;
+
+      /* Drop every other filter the merged one now covers */
+
+      for (j = 0; j < opt->fo_nfilters; )
+        {
+          if (j != best_i && (opt->fo_fmask[j] & mask) == mask &&
+              (opt->fo_fid[j] & mask) == id)
+            {
+              --opt->fo_nfilters;
+              opt->fo_fid[j] = opt->fo_fid[opt->fo_nfilters];
+              opt->fo_fmask[j] = opt->fo_fmask[opt->fo_nfilters];
+              if (best_i == opt->fo_nfilters)
+                {
+                  best_i = j;
+                }
+            }
+          else
+            {
+              ++j;
+            }
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: filtopt_read_ids
+ *
+ * Description:
+ *   Reads wanted IDs from the user, several per line, until an empty line.
+ *   Repeated IDs are stored once.
+ *
+ * Returned value:
+ *   0 on success, -1 if an ID was invalid.
+ ****************************************************************************/
+
+static int filtopt_read_ids(FAR struct filtopt_s *opt)
+{
+  char line[64];
+  FAR char *p;
+  FAR char *end;
+  unsigned long id;
+  int i;
+
+  opt->fo_nids = 0;
+
+  puts("Enter the IDs to accept (decimal or 0x hex, separated by spaces\n"
+       "or commas). Enter an empty line when done.");
+
+  while (true)
+    {
+      fputs("> ", stdout);
+      fflush(stdout);
+
+      memset(line, 0, sizeof(line));
+      if (std_readline(line, sizeof(line)) <= 0 || line[0] == '\n')
+        {
+          return 0;
+        }
+
+      for (p = line; *p != '\0'; p = end)
+        {
+          while (*p == ' ' || *p == ',' || *p == '\t')
+            {
+              ++p;
+            }
+
+          if (*p == '\n' || *p == '\r' || *p == '\0')
+            {
+              break;
+            }
+
+          id = strtoul(p, &end, 0);
+          if (end == p || id > opt->fo_idmask)
+            {
+              printf("Invalid ID at \"%s\"", p);
+              return -1;
+            }
+
+          for (i = 0; i < opt->fo_nids && opt->fo_ids[i] != id; ++i);
+          if (i < opt->fo_nids)
+            {
+              continue;
+            }
+
+          if (opt->fo_nids == FILTOPT_MAX_IDS)
+            {
+              printf("At most %d IDs are supported.\n", FILTOPT_MAX_IDS);
+              return -1;
+            }
+
+          opt->fo_ids[opt->fo_nids++] = id;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: test_filter_optimizer
+ *
+ * Description:
+ *   Compiles a list of wanted IDs into a small set of hardware mask filters
+ *   that fits the controller's filter bank, shows how much unwanted traffic
+ *   each filter lets through, and optionally programs them with
+ *   CANIOC_ADD_STDFILTER or CANIOC_ADD_EXTFILTER.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN)
+ ****************************************************************************/
+
+static void test_filter_optimizer(int canfd)
+{
+  FAR struct filtopt_s *opt = &g_filtopt;
+  char pattern[30];
+  char selection[4] = {0};
+  uint64_t unwanted;
+  uint64_t total = 0;
+  int nbits;
+  int ret;
+  int i;
+  int b;
+
+  memset(opt, 0, sizeof(*opt));
+
+#ifdef CONFIG_CAN_EXTID
+  opt->fo_extended = prompt_long("Extended IDs (1/0)", 0) != 0;
+#endif
+  nbits = opt->fo_extended ? 29 : 11;
+  opt->fo_idmask = opt->fo_extended ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID;
+  opt->fo_limit = prompt_long("Filters available in the bank", 8);
+
+  if (opt->fo_limit < 1 || opt->fo_limit > FILTOPT_MAX_IDS)
+    {
+      printf("Filter count must be 1 to %d.\n", FILTOPT_MAX_IDS);
+      return;
+    }
+
+  if (filtopt_read_ids(opt) < 0 || opt->fo_nids == 0)
+    {
+      puts("No filters computed.");
+      return;
+    }
+
+  filtopt_compile(opt);
+
+  printf("%d IDs compiled into %d filters:\n", opt->fo_nids,
+         opt->fo_nfilters);
+
+  for (i = 0; i < opt->fo_nfilters; ++i)
+    {
+      for (b = 0; b < nbits; ++b)
+        {
+          if (opt->fo_fmask[i] & (1ul << (nbits - 1 - b)))
+            {
+              pattern[b] = (opt->fo_fid[i] & (1ul << (nbits - 1 - b))) ?
+                           '1' : '0';
+            }
+          else
+            {
+              pattern[b] = 'X';
+            }
+        }
+
+      pattern[nbits] = '\0';
+      unwanted = filtopt_unwanted(opt, opt->fo_fid[i], opt->fo_fmask[i]);
+      total += unwanted;
+
+      printf(" %2d. %s  id 0x%08" PRIx32 " mask 0x%08" PRIx32 ": %" PRIu32
+             " wanted, %" PRIu64 " unwanted\n", i, pattern,
+             opt->fo_fid[i], opt->fo_fmask[i],
+             filtopt_wanted(opt, opt->fo_fid[i], opt->fo_fmask[i]),
+             unwanted);
+    }
+
+  printf("Unwanted IDs let through: %" PRIu64 "\n", total);
+
+  fputs("Program these filters? (Y/N): ", stdout);
+  fflush(stdout);
+  std_readline(selection, 4);
+  if (selection[0] != 'Y' && selection[0] != 'y')
+    {
+      return;
+    }
+
+  for (i = 0; i < opt->fo_nfilters; ++i)
+    {
+#ifdef CONFIG_CAN_EXTID
+      if (opt->fo_extended)
+        {
+          struct canioc_extfilter_s xfilter;
+
+          memset(&xfilter, 0, sizeof(xfilter));
+          xfilter.xf_id1 = opt->fo_fid[i];
+          xfilter.xf_id2 = opt->fo_fmask[i];
+          xfilter.xf_type = CAN_FILTER_MASK;
+          ret = ioctl(canfd, CANIOC_ADD_EXTFILTER, &xfilter);
+        }
+      else
+#endif
+        {
+          struct canioc_stdfilter_s sfilter;
+
+          memset(&sfilter, 0, sizeof(sfilter));
+          sfilter.sf_id1 = opt->fo_fid[i];
+          sfilter.sf_id2 = opt->fo_fmask[i];
+          sfilter.sf_type = CAN_FILTER_MASK;
+          ret = ioctl(canfd, CANIOC_ADD_STDFILTER, &sfilter);
+        }
+
+      if (ret < 0)
+        {
+          printf("Error adding filter %d: %d\n", i, errno);
+          break;
+        }
+      else
+        {
+          printf("Added filter %d as filter number %d.\n", i, ret);
+          filtrec_add(opt->fo_extended, ret, opt->fo_fid[i],
+                      opt->fo_fmask[i], CAN_FILTER_MASK);
+        }
+    }
+}
+
+/*****************************************************************************
+ * Name: test_del_filter
+ *
+ * Description:
+ *   Prompts the user to select a filter number to delete.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN character device
+ *   extended - Whether to use CANIOC_DEL_EXTFILTER or CANIOC_DEL_STDFILTER
+ ****************************************************************************/
+
+static int test_del_filter(int canfd, bool extended)
+{
+  int ret;
+  int index;
+  char selection[5] = {0};
+
+#ifndef CONFIG_CAN_EXTID
+  if (extended)
+  {
+    puts("Extended ID support disabled in this build.");
+    errno = EINVAL;
+    return -1;
+  }
+#endif
+
+  fputs("Delete ", stdout);
+
+  if (extended)
+    fputs("extended", stdout);
+  else
+    fputs("standard", stdout);
+
+  fputs(" filter: enter the filter number returned when the\n"
+        "filter was added.\n", stdout);
+
+  while (true)
+    {
+      fputs("Enter a filter number, or Q to quit: ", stdout);
+      fflush(stdout);
+      std_readline(selection, 5);
+
+      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+        {
+          puts("Quit");
+          ret = 0;
+          break;
+        }
+      else
+        {
+          index = atoi(selection);
+
+#ifdef CONFIG_CAN_EXTID
+          if (extended)
+            ret = ioctl(canfd, CANIOC_DEL_EXTFILTER, index);
+          else
+#endif
+            ret = ioctl(canfd, CANIOC_DEL_STDFILTER, index);
+
+          if (ret < 0)
+            {
+              printf("Error deleting filter: %d\n", errno);
+            }
+          else
+            {
+              puts("Deleted filter.");
+              filtrec_del(extended, index);
+            }
+        }
+    }
+
+  return ret;
+}
+
+/****************************************************************************
+ * Name: txgen_fill
+ *
+ * Description:
+ *   Fills in one generated frame.
+ *
+ * Input parameters:
+ *   gen - Generator settings and state
+ *   msg - Frame to fill in
+ *   seq - Sequence number of the frame since the start of the run
+ ****************************************************************************/
+
+static void txgen_fill(FAR struct txgen_s *gen, FAR struct can_msg_s *msg,
+                       uint32_t seq)
+{
+  int i;
+
+  memset(&msg->cm_hdr, 0, sizeof(msg->cm_hdr));
+
+  switch (gen->tg_idmode)
+    {
+      case TXGEN_ID_INCREMENT:
+        msg->cm_hdr.ch_id = gen->tg_id + seq % gen->tg_idrange;
+        break;
+      case TXGEN_ID_RANDOM:
+        msg->cm_hdr.ch_id = gen->tg_id + prng_next(&gen->tg_prng) %
+                            gen->tg_idrange;
+        break;
+      default:
+        msg->cm_hdr.ch_id = gen->tg_id;
+        break;
+    }
+
+#ifdef CONFIG_CAN_EXTID
+  msg->cm_hdr.ch_extid = gen->tg_extid;
+  msg->cm_hdr.ch_id &= gen->tg_extid ? CAN_MAX_EXTMSGID : CAN_MAX_STDMSGID;
+#else
+  msg->cm_hdr.ch_id &= CAN_MAX_STDMSGID;
+#endif
+
+  msg->cm_hdr.ch_dlc = gen->tg_dlc;
+#ifdef CONFIG_CAN_FD
+  msg->cm_hdr.ch_edl = gen->tg_fd;
+  msg->cm_hdr.ch_brs = gen->tg_brs;
+#endif
+
+  for (i = 0; i < canmsg_nbytes(msg); ++i)
+    {
+      switch (gen->tg_payload)
+        {
+          case TXGEN_DATA_COUNTER:
+
+            /* Little-endian frame sequence number, repeated */
+
+            msg->cm_data[i] = seq >> (8 * (i % 4));
+            break;
+          case TXGEN_DATA_RANDOM:
+            msg->cm_data[i] = prng_next(&gen->tg_prng);
+            break;
+          case TXGEN_DATA_FIXED:
+            msg->cm_data[i] = gen->tg_fill;
+            break;
+          default:
+            msg->cm_data[i] = 0;
+            break;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: txgen_check_errors
+ *
+ * Description:
+ *   Drains whatever the driver has queued for reading without blocking and
+ *   counts the TX-related error reports among it.
+ ****************************************************************************/
+
+static void txgen_check_errors(int canfd, FAR struct txgen_s *gen)
+{
+#ifdef CONFIG_CAN_ERRORS
+  struct pollfd pfd = {.fd = canfd, .events = POLLIN, .revents = 0};
+  FAR struct can_msg_s *msg;
+  int offset;
+  int ret;
+
+  while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+    {
+      ret = read(canfd, g_rxbuf, sizeof(g_rxbuf));
+      if (ret < CAN_MSGLEN(0))
+        {
+          break;
+        }
+
+      for (offset = 0; offset + CAN_MSGLEN(0) <= ret;
+           offset += CAN_MSGLEN(canmsg_nbytes(msg)))
+        {
+          msg = (FAR struct can_msg_s *)(g_rxbuf + offset);
+          if (!msg->cm_hdr.ch_error)
+            {
+              continue;
+            }
+
+          if (msg->cm_hdr.ch_id & CAN_ERROR_LOSTARB)
+            {
+              ++gen->tg_lostarb;
+            }
+
+          if (msg->cm_hdr.ch_id & CAN_ERROR_TXTIMEOUT)
+            {
+              ++gen->tg_txtimeout;
+            }
+
+          if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+              (msg->cm_data[1] & CAN_ERROR1_TXOVERFLOW))
+            {
+              ++gen->tg_txoverflow;
+            }
+        }
+
+      if (ret + CAN_MSGLEN(CAN_MAXDATALEN) <= sizeof(g_rxbuf))
+        {
+          break;
+        }
+    }
+#endif
+}
+
+/****************************************************************************
+ * Name: test_tx_generator
+ *
+ * Description:
+ *   Configurable TX traffic generator. Sends frames in batches of one
+ *   write() each, paced to a target frame rate with absolute deadlines,
+ *   and reports the achieved rate, the write() latency distribution and
+ *   any TX errors the driver reported. The defaults reproduce the old
+ *   17-frame extended-ID burst.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN character device
+ ****************************************************************************/
+
+static void test_tx_generator(int canfd)
+{
+  struct pollfd stdin_pfd =
+    {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+  FAR struct can_msg_s *msg;
+  struct txgen_s gen;
+  struct lathist_s hist;
+  struct timespec deadline;
+  uint64_t start;
+  uint64_t t0;
+  uint64_t elapsed;
+  uint64_t due;
+  uint32_t count;
+  uint32_t rate;
+  uint32_t batch;
+  uint64_t payload = 0;
+  uint32_t bpayload;
+  uint32_t sent = 0;
+  uint32_t shortwrites = 0;
+  uint32_t errors = 0;
+  uint32_t n;
+  size_t len;
+  size_t done;
+  ssize_t ret;
+
+  memset(&gen, 0, sizeof(gen));
+  memset(&hist, 0, sizeof(hist));
+
+  count = prompt_long("Number of frames", 17);
+#ifdef CONFIG_CAN_EXTID
+  gen.tg_extid = prompt_long("Extended IDs (1/0)", 1) != 0;
+#endif
+  gen.tg_idmode = prompt_long("ID pattern: 0 fixed, 1 incrementing, "
+                              "2 random", TXGEN_ID_INCREMENT);
+  gen.tg_id = prompt_long("Base ID", 0);
+  gen.tg_idrange = prompt_long("Number of distinct IDs", 17);
+#ifdef CONFIG_CAN_FD
+  gen.tg_fd = prompt_long("CAN FD frames (1/0)", 0) != 0;
+  if (gen.tg_fd)
+    {
+      gen.tg_brs = prompt_long("Bit rate switching (1/0)", 1) != 0;
+    }
+#endif
+  gen.tg_dlc = prompt_long(gen.tg_fd ? "DLC (0-15, 15 = 64 bytes)" : "DLC",
+                           gen.tg_fd ? 15 : 8);
+  gen.tg_payload = prompt_long("Payload: 0 zeros, 1 counter, 2 random, "
+                               "3 fixed byte", TXGEN_DATA_ZERO);
+  if (gen.tg_payload == TXGEN_DATA_FIXED)
+    {
+      gen.tg_fill = prompt_long("Fill byte", 0x55);
+    }
+
+  rate = prompt_long("Target frames/s (0 = as fast as possible)", 0);
+  batch = prompt_long("Frames per write()", 17);
+
+  if (gen.tg_dlc > (gen.tg_fd ? 15 : 8))
+    {
+      puts("DLC too large.");
+      return;
+    }
+
+  if (batch < 1 || batch > TXGEN_BATCH_MAX)
+    {
+      printf("Batch size must be 1 to %d.\n", TXGEN_BATCH_MAX);
+      return;
+    }
+
+  if (gen.tg_idrange == 0)
+    {
+      gen.tg_idrange = 1;
+    }
+
+  gen.tg_prng = 0x2545f491;
+
+  printf("Sending %" PRIu32 " frames. Type Q to stop early.\n", count);
+  fflush(stdout);
+
+  start = now_us();
+
+  while (sent < count)
+    {
+      /* Build the next batch */
+
+      len = 0;
+      bpayload = 0;
+      for (n = 0; n < batch && sent + n < count; ++n)
+        {
+          msg = (FAR struct can_msg_s *)(g_txbuf + len);
+          txgen_fill(&gen, msg, sent + n);
+          len += CAN_MSGLEN(canmsg_nbytes(msg));
+          bpayload += canmsg_nbytes(msg);
+        }
+
+      if (rate != 0)
+        {
+          due = start + (uint64_t)sent * 1000000 / rate;
+          deadline.tv_sec = due / 1000000;
+          deadline.tv_nsec = (due % 1000000) * 1000;
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        }
+
+      t0 = now_us();
+      for (done = 0; done < len; done += ret)
+        {
+          ret = write(canfd, g_txbuf + done, len - done);
+          if (ret < 0)
+            {
+              if (errno == EINTR)
+                {
+                  ret = 0;
+                  continue;
+                }
+
+              break;
+            }
+          else if (done + ret < len)
+            {
+              ++shortwrites;
+            }
+        }
+
+      lathist_add(&hist, now_us() - t0);
+
+      if (ret < 0)
+        {
+          printf("write() failed: %d\n", errno);
+          ++errors;
+          break;
+        }
+
+      sent += n;
+      payload += bpayload;
+
+      txgen_check_errors(canfd, &gen);
+
+      if (poll(&stdin_pfd, 1, 0) > 0 && rx_read_stdin_quit() != 0)
+        {
+          break;
+        }
+    }
+
+  elapsed = now_us() - start;
+
+  printf("Sent %" PRIu32 " frames in %" PRIu32 " us: %" PRIu32
+         " frames/s, %" PRIu32 " payload bytes/s\n", sent, (uint32_t)elapsed,
+         elapsed ? (uint32_t)((uint64_t)sent * 1000000 / elapsed) : 0,
+         elapsed ? (uint32_t)(payload * 1000000 / elapsed) : 0);
+  lathist_print(&hist, "write() latency");
+  printf("Short writes: %" PRIu32 ", write() errors: %" PRIu32 "\n",
+         shortwrites, errors);
+#ifdef CONFIG_CAN_ERRORS
+  printf("TX overflow reports: %" PRIu32 ", lost arbitration: %" PRIu32
+         ", TX timeouts: %" PRIu32 "\n", gen.tg_txoverflow, gen.tg_lostarb,
+         gen.tg_txtimeout);
+#endif
+}
+
+/****************************************************************************
+ * Name: can_set_loopback
+ *
+ * Description:
+ *   Switches the controller into or out of internal loopback mode with the
+ *   connection-mode ioctls.
+ *
+ * Input parameters:
+ *   canfd  - Open file descriptor for the CAN device
+ *   enable - Loopback on or off
+ *   saved  - If not NULL, receives the modes in effect before the change
+ *
+ * Returned value:
+ *   0 on success, -1 with errno set if the driver does not support it.
+ ****************************************************************************/
+
+static int can_set_loopback(int canfd, bool enable,
+                            FAR struct canioc_connmodes_s *saved)
+{
+  struct canioc_connmodes_s modes;
+
+  if (ioctl(canfd, CANIOC_GET_CONNMODES, &modes) < 0)
+    {
+      return -1;
+    }
+
+  if (saved != NULL)
+    {
+      *saved = modes;
+    }
+
+  modes.bm_loopback = enable;
+  return ioctl(canfd, CANIOC_SET_CONNMODES, &modes) < 0 ? -1 : 0;
+}
+
+/****************************************************************************
+ * Name: stress_consume
+ *
+ * Description:
+ *   Accounts for a buffer of frames read by a reader or poller thread:
+ *   marks each sequence number as seen (counting duplicates) and records
+ *   the latency from transmission (or, with CONFIG_CAN_TIMESTAMP, from
+ *   arrival) to wakeup. For a poller the wakeup is the return of poll(),
+ *   unless the frame only came in while read() was blocked (another
+ *   thread took the one poll() saw), in which case it is the return of
+ *   read().
+ *
+ * Input parameters:
+ *   thd     - The consuming thread
+ *   buf     - Frames returned by read()
+ *   buflen  - Bytes returned by read()
+ *   poll_us - When poll() returned (read_us for reader threads)
+ *   read_us - When read() returned
+ ****************************************************************************/
+
+static void stress_consume(FAR struct stress_thread_s *thd,
+                           FAR uint8_t *buf, int buflen, uint64_t poll_us,
+                           uint64_t read_us)
+{
+  FAR struct stress_s *st = thd->th_test;
+  FAR struct can_msg_s *msg;
+  uint32_t seq;
+  uint32_t sent;
+#ifdef CONFIG_CAN_TIMESTAMP
+  uint64_t arrival;
+#endif
+  bool first = true;
+  int offset;
+
+  for (offset = 0; offset + CAN_MSGLEN(0) <= buflen;
+       offset += CAN_MSGLEN(canmsg_nbytes(msg)))
+    {
+      msg = (FAR struct can_msg_s *)(buf + offset);
+
+#ifdef CONFIG_CAN_ERRORS
+      if (msg->cm_hdr.ch_error)
+        {
+          if ((msg->cm_hdr.ch_id & CAN_ERROR_CONTROLLER) &&
+              (msg->cm_data[1] & CAN_ERROR1_RXOVERFLOW))
+            {
+              ++thd->th_overflows;
+            }
+
+          continue;
+        }
+#endif
+
+      if (msg->cm_hdr.ch_id != STRESS_ID || msg->cm_hdr.ch_dlc != 8)
+        {
+          continue;
+        }
+
+      memcpy(&seq, &msg->cm_data[0], 4);
+      memcpy(&sent, &msg->cm_data[4], 4);
+      if (seq >= STRESS_MAX_SEQ)
+        {
+          continue;
+        }
+
+      ++thd->th_frames;
+
+      pthread_mutex_lock(&st->ss_lock);
+      if (st->ss_seen[seq / 32] & (1ul << (seq % 32)))
+        {
+          ++st->ss_duplicates;
+        }
+
+      st->ss_seen[seq / 32] |= 1ul << (seq % 32);
+      ++st->ss_received;
+      pthread_mutex_unlock(&st->ss_lock);
+
+      /* The oldest frame of the batch waited longest for this wakeup */
+
+      if (first)
+        {
+#ifdef CONFIG_CAN_TIMESTAMP
+          arrival = rx_frame_time(msg, read_us);
+          lathist_add(&thd->th_latency, (arrival <= poll_us ?
+                                         poll_us : read_us) - arrival);
+#else
+          lathist_add(&thd->th_latency,
+                      (int32_t)((uint32_t)poll_us - sent) >= 0 ?
+                      (uint32_t)poll_us - sent : (uint32_t)read_us - sent);
+#endif
+          first = false;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: stress_reader
+ *
+ * Description:
+ *   Reader thread: blocks in read() on the shared descriptor.
+ ****************************************************************************/
+
+static FAR void *stress_reader(FAR void *arg)
+{
+  FAR struct stress_thread_s *thd = arg;
+  FAR struct stress_s *st = thd->th_test;
+  uint64_t read_us;
+  int ret;
+
+  while (sem_wait(&g_poll_test_sem) < 0 && errno == EINTR);
+
+  while (!st->ss_stop)
+    {
+      ret = read(st->ss_fd, thd->th_buf, sizeof(thd->th_buf));
+      if (ret < 0)
+        {
+          if (errno != EINTR)
+            {
+              ++thd->th_errors;
+            }
+
+          continue;
+        }
+
+      ++thd->th_wakeups;
+      read_us = now_us();
+      stress_consume(thd, thd->th_buf, ret, read_us, read_us);
+    }
+
+  thd->th_done = true;
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: stress_poller
+ *
+ * Description:
+ *   Poller thread: waits in poll() on the shared descriptor, then reads.
+ *   If poll() times out while the driver still has frames queued, data
+ *   was pending without this thread being woken: a lost wakeup. Frames
+ *   other threads consumed during the wait say nothing about this one.
+ ****************************************************************************/
+
+static FAR void *stress_poller(FAR void *arg)
+{
+  FAR struct stress_thread_s *thd = arg;
+  FAR struct stress_s *st = thd->th_test;
+  struct pollfd pfd;
+  uint64_t poll_us;
+  int ret;
+
+  while (sem_wait(&g_poll_test_sem) < 0 && errno == EINTR);
+
+  while (!st->ss_stop)
+    {
+      pfd.fd = st->ss_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      ret = poll(&pfd, 1, STRESS_POLL_TIMEOUT_MS);
+      poll_us = now_us();
+
+      if (ret < 0)
+        {
+          if (errno != EINTR)
+            {
+              ++thd->th_errors;
+            }
+
+          continue;
+        }
+      else if (ret == 0)
+        {
+          /* Still readable right after the timeout: a frame was queued
+           * while this poll() was armed.
+           */
+
+          pfd.revents = 0;
+          if (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) &&
+              !st->ss_stop)
+            {
+              ++thd->th_missed;
+            }
+
+          continue;
         }
-    }
 
-  if (extended)
-    {
-#ifdef CONFIG_CAN_EXTID
-      /* Shift right if the user didn't type out all 29 bits. */
-      xfilter->xf_id1 >>= (29 - i);
-      xfilter->xf_id2 >>= (29 - i);
+      ++thd->th_wakeups;
 
-      /* Require the ID to match 0's for unspecified most-significant bits. */
-      xfilter->xf_id2 |= (0xffffffff << i);
-#endif
-    }
-  else
-    {
-      /* Shift right if the user the user didn't type out all 29 bits. */
-      sfilter->sf_id1 >>= (11 - i);
-      sfilter->sf_id2 >>= (11 - i);
+      /* Another thread may have taken the frame already, in which case
+       * this read() blocks until the next one.
+       */
 
-      /* Require the ID to match 0's for unspecifed most-significant bits. */
-      sfilter->sf_id2 |= (0xffffffff << i);
+      ret = read(st->ss_fd, thd->th_buf, sizeof(thd->th_buf));
+      if (ret < 0)
+        {
+          if (errno != EINTR)
+            {
+              ++thd->th_errors;
+            }
+
+          continue;
+        }
+
+      stress_consume(thd, thd->th_buf, ret, poll_us, now_us());
     }
 
-  return OK;
+  thd->th_done = true;
+  return NULL;
 }
 
-/*****************************************************************************
- * Name: test_del_filter
+/****************************************************************************
+ * Name: stress_writer
  *
  * Description:
- *   Prompts the user to select a filter number to delete.
- *
- * Input parameters:
- *   canfd - Open file descriptor for the CAN character device
- *   extended - Whether to use CANIOC_DEL_EXTFILTER or CANIOC_DEL_STDFILTER
+ *   Writer thread: sends sequence-numbered frames at a fixed rate on the
+ *   shared descriptor until the run ends.
  ****************************************************************************/
 
-static int test_del_filter(int canfd, bool extended)
+static FAR void *stress_writer(FAR void *arg)
 {
+  FAR struct stress_thread_s *thd = arg;
+  FAR struct stress_s *st = thd->th_test;
+  struct can_msg_s msg;
+  struct timespec deadline;
+  uint64_t due;
+  uint32_t seq;
+  uint32_t sent;
+  uint32_t n = 0;
   int ret;
-  char selection[5] = {0};
 
-#ifndef CONFIG_CAN_EXTID
-  if (extended)
-  {
-    puts("Extended ID support disabled in this build.");
-    errno = EINVAL;
-    return -1;
-  }
-#endif
+  while (sem_wait(&g_poll_test_sem) < 0 && errno == EINTR);
 
-  fputs("Delete ", stdout);
+  memset(&msg, 0, sizeof(msg));
+  msg.cm_hdr.ch_id = STRESS_ID;
+  msg.cm_hdr.ch_dlc = 8;
 
-  if (extended)
-    fputs("extended", stdout);
-  else
-    fputs("standard", stdout);
+  while (now_us() < st->ss_end_us)
+    {
+      due = st->ss_start_us + (uint64_t)n++ * 1000000 / st->ss_rate;
+      deadline.tv_sec = due / 1000000;
+      deadline.tv_nsec = (due % 1000000) * 1000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
 
-  fputs(" filter: enter the filter number returned when the\n"
-        "filter was added.\n", stdout);
+      pthread_mutex_lock(&st->ss_lock);
+      seq = st->ss_sent;
+      if (seq < STRESS_MAX_SEQ)
+        {
+          ++st->ss_sent;
+        }
 
-  while (true)
-    {
-      fputs("Enter a filter number, or Q to quit: ", stdout);
-      fflush(stdout);
-      std_readline(selection, 5);
+      pthread_mutex_unlock(&st->ss_lock);
 
-      if (strcmp(selection, "Q\n") == 0 || strcmp(selection, "q\n") == 0)
+      if (seq >= STRESS_MAX_SEQ)
         {
-          puts("Quit");
-          ret = 0;
           break;
         }
-      else
-        {
-          ret = atoi(selection);
 
-#ifdef CONFIG_CAN_EXTID
-          if (extended)
-            ret = ioctl(canfd, CANIOC_DEL_EXTFILTER, ret);
-          else
-#endif
-            ret = ioctl(canfd, CANIOC_DEL_STDFILTER, ret);
+      sent = now_us();
+      memcpy(&msg.cm_data[0], &seq, 4);
+      memcpy(&msg.cm_data[4], &sent, 4);
 
-          if (ret < 0)
-            {
-              printf("Error deleting filter: %d\n", errno);
-            }
-          else
-            {
-              puts("Deleted filter.");
-            }
+      ret = write(st->ss_fd, &msg, CAN_MSGLEN(8));
+      if (ret != CAN_MSGLEN(8))
+        {
+          ++thd->th_errors;
+        }
+      else
+        {
+          ++thd->th_frames;
         }
     }
 
-  return ret;
+  return NULL;
 }
 
 /****************************************************************************
- * Name: test_tx_burst
+ * Name: fifo_thread_start
  *
  * Description:
- *   Sends a series of 17 messages as quickly as possible so that the TX
- *   rate of the hardware can be measured.
+ *   Creates a thread at the requested SCHED_FIFO priority.
  *
- * Input parameters:
- *   canfd - Open file descriptor for the CAN character device
+ * Returned value:
+ *   0 on success, or the error returned by pthread_create().
  ****************************************************************************/
 
-static void test_tx_burst(int canfd)
+static int fifo_thread_start(FAR pthread_t *thread,
+                             FAR void *(*entry)(FAR void *), FAR void *arg,
+                             int priority)
 {
-  uint8_t msgs[17 * CAN_MSGLEN(8)];
-  struct can_msg_s *ptr;
+  struct sched_param param;
+  pthread_attr_t attr;
   int ret;
 
-  for (int i = 0; i < 17; ++i)
-  {
-    ptr = (struct can_msg_s *)(msgs + i * CAN_MSGLEN(8));
-    ptr->cm_hdr.ch_id = i;
-    ptr->cm_hdr.ch_dlc = 8;
-    ptr->cm_hdr.ch_extid = 1;
-  }
-  ret = write(canfd, msgs, 17 * CAN_MSGLEN(8));
-  printf("%d bytes written\n", ret);
-  fflush(stdout);
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  param.sched_priority = priority;
+  pthread_attr_setschedparam(&attr, &param);
+
+  ret = pthread_create(thread, &attr, entry, arg);
+  pthread_attr_destroy(&attr);
+  return ret;
 }
 
 /****************************************************************************
- * Name: test_poll_bug
+ * Name: stress_start
  *
  * Description:
- *   Continually blocks in read() on the CAN device file to demonstrate the
- *   poll setup bug.
+ *   Creates one stress test thread at the requested SCHED_FIFO priority.
  ****************************************************************************/
 
-static void *test_poll_bug(void *arg)
+static int stress_start(FAR struct stress_thread_s *thd,
+                        FAR void *(*entry)(FAR void *), int priority)
 {
-  int canfd = (int)arg;
-  struct can_msg_s msg;
-  while (true)
+  return fifo_thread_start(&thd->th_thread, entry, thd, priority);
+}
+
+/****************************************************************************
+ * Name: test_poll_stress
+ *
+ * Description:
+ *   Multi-threaded wakeup stress test for the CAN driver's read() and
+ *   poll() paths (originally written to chase a can_poll() setup bug).
+ *   Reader, poller and writer threads share one descriptor. Writers send
+ *   sequence-numbered frames, which come back through loopback mode (or
+ *   from a peer that echoes them), and every frame is accounted for: lost
+ *   and duplicated frames, poll() timeouts while traffic was flowing, and
+ *   the wakeup latency are reported together with a pass/fail verdict.
+ *
+ * Input parameters:
+ *   canfd - Open file descriptor for the CAN device (not related to FDCAN).
+ ****************************************************************************/
+
+static void test_poll_stress(int canfd)
+{
+  FAR struct stress_s *st = &g_stress;
+  FAR struct stress_thread_s *thd;
+  struct canioc_connmodes_s saved;
+  struct lathist_s latency;
+  struct can_msg_s stopmsg;
+  struct timespec pause = {0, 10 * 1000 * 1000};
+  bool loopback = false;
+  uint32_t missed = 0;
+  uint32_t overflows = 0;
+  uint32_t errors = 0;
+  uint32_t lost = 0;
+  long nreaders;
+  long npollers;
+  long nwriters;
+  long prio_r;
+  long prio_p;
+  long prio_w;
+  long duration;
+  int nthreads;
+  int ret;
+  int i;
+  int b;
+
+  memset(st, 0, sizeof(*st));
+  memset(&latency, 0, sizeof(latency));
+
+  nreaders = prompt_long("Reader threads", 1);
+  npollers = prompt_long("Poller threads", 2);
+  nwriters = prompt_long("Writer threads", 1);
+  prio_r = prompt_long("Reader priority",
+                       CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY);
+  prio_p = prompt_long("Poller priority",
+                       CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY);
+  prio_w = prompt_long("Writer priority",
+                       CONFIG_INDUSTRY_ETCETERA_TOOLS_PRIORITY);
+  st->ss_rate = prompt_long("Frames/s per writer", 200);
+  duration = prompt_long("Duration in seconds", 10);
+
+  if (nreaders < 0 || npollers < 0 || nwriters < 1 ||
+      nreaders + npollers < 1 ||
+      nreaders + npollers + nwriters > STRESS_MAX_THREADS)
     {
-      read(canfd, &msg, sizeof(struct can_msg_s));
+      printf("Need at least one writer and one reader or poller, and at "
+             "most %d threads.\n", STRESS_MAX_THREADS);
+      return;
     }
-  
-  return NULL;
+
+  if (st->ss_rate < 1 || duration < 1)
+    {
+      puts("Rate and duration must be positive.");
+      return;
+    }
+
+  if (prompt_long("Use loopback mode (1/0)", 1) != 0)
+    {
+      if (can_set_loopback(canfd, true, &saved) < 0)
+        {
+          printf("Loopback not supported (%d); a peer must echo the "
+                 "frames.\n", errno);
+        }
+      else
+        {
+          loopback = true;
+        }
+    }
+
+  st->ss_fd = canfd;
+  pthread_mutex_init(&st->ss_lock, NULL);
+  sem_init(&g_poll_test_sem, 0, 0);
+
+  /* Threads block on g_poll_test_sem until all of them exist */
+
+  nthreads = 0;
+  for (i = 0; i < nreaders + npollers + nwriters; ++i)
+    {
+      thd = &st->ss_threads[i];
+      thd->th_test = st;
+
+      if (i < nreaders)
+        {
+          thd->th_role = "reader";
+          ret = stress_start(thd, stress_reader, prio_r);
+        }
+      else if (i < nreaders + npollers)
+        {
+          thd->th_role = "poller";
+          ret = stress_start(thd, stress_poller, prio_p);
+        }
+      else
+        {
+          thd->th_role = "writer";
+          ret = stress_start(thd, stress_writer, prio_w);
+        }
+
+      if (ret != 0)
+        {
+          printf("Error creating %s thread: %d\n", thd->th_role, ret);
+          break;
+        }
+
+      ++nthreads;
+    }
+
+  printf("Running %d threads for %ld s...\n", nthreads, duration);
+  fflush(stdout);
+
+  st->ss_start_us = now_us() + 10000;
+  st->ss_end_us = st->ss_start_us + (uint64_t)duration * 1000000;
+
+  for (i = 0; i < nthreads; ++i)
+    {
+      sem_post(&g_poll_test_sem);
+    }
+
+  /* Writers finish on their own; give the last frames time to arrive */
+
+  for (i = nreaders + npollers; i < nthreads; ++i)
+    {
+      pthread_join(st->ss_threads[i].th_thread, NULL);
+    }
+
+  usleep(STRESS_POLL_TIMEOUT_MS * 1000);
+  st->ss_stop = true;
+
+  /* Readers may still be blocked in read(). Kick them with frames that
+   * come back in loopback, and cancel any that are still stuck.
+   */
+
+  memset(&stopmsg, 0, sizeof(stopmsg));
+  stopmsg.cm_hdr.ch_id = STRESS_ID + 1;
+
+  for (i = 0; i < nreaders + npollers && i < nthreads; ++i)
+    {
+      for (b = 0; b < 100 && !st->ss_threads[i].th_done; ++b)
+        {
+          write(canfd, &stopmsg, CAN_MSGLEN(0));
+          nanosleep(&pause, NULL);
+        }
+
+      if (!st->ss_threads[i].th_done)
+        {
+          pthread_cancel(st->ss_threads[i].th_thread);
+        }
+
+      pthread_join(st->ss_threads[i].th_thread, NULL);
+    }
+
+  if (loopback)
+    {
+      ioctl(canfd, CANIOC_SET_CONNMODES, &saved);
+    }
+
+  /* Results */
+
+  for (i = 0; i < st->ss_sent; ++i)
+    {
+      if (!(st->ss_seen[i / 32] & (1ul << (i % 32))))
+        {
+          ++lost;
+        }
+    }
+
+  for (i = 0; i < nthreads; ++i)
+    {
+      thd = &st->ss_threads[i];
+      printf("%s %d: %" PRIu32 " frames, %" PRIu32 " wakeups, %" PRIu32
+             " missed wakeups, %" PRIu32 " errors\n", thd->th_role, i,
+             thd->th_frames, thd->th_wakeups, thd->th_missed,
+             thd->th_errors);
+
+      missed += thd->th_missed;
+      overflows += thd->th_overflows;
+      errors += thd->th_errors;
+
+      for (b = 0; b < LATHIST_BUCKETS; ++b)
+        {
+          latency.lh_buckets[b] += thd->th_latency.lh_buckets[b];
+        }
+
+      if (thd->th_latency.lh_count > 0)
+        {
+          if (latency.lh_count == 0 ||
+              thd->th_latency.lh_min < latency.lh_min)
+            {
+              latency.lh_min = thd->th_latency.lh_min;
+            }
+
+          if (thd->th_latency.lh_max > latency.lh_max)
+            {
+              latency.lh_max = thd->th_latency.lh_max;
+            }
+
+          latency.lh_count += thd->th_latency.lh_count;
+          latency.lh_sum += thd->th_latency.lh_sum;
+        }
+    }
+
+  printf("Sent %" PRIu32 ", received %" PRIu32 ", lost %" PRIu32
+         ", duplicated %" PRIu32 ", RX overflow reports %" PRIu32 "\n",
+         st->ss_sent, st->ss_received, lost, st->ss_duplicates, overflows);
+#ifdef CONFIG_CAN_TIMESTAMP
+  lathist_print(&latency, "Arrival to wakeup latency");
+#else
+  lathist_print(&latency, "Send to wakeup latency");
+#endif
+
+  if (st->ss_duplicates == 0 && missed == 0 && errors == 0 && lost == 0)
+    {
+      puts("PASS");
+    }
+  else
+    {
+      printf("FAIL: %" PRIu32 " lost, %" PRIu32 " duplicated, %" PRIu32
+             " missed wakeups, %" PRIu32 " errors\n", lost,
+             st->ss_duplicates, missed, errors);
+      if (lost > 0 && overflows > 0)
+        {
+          puts("The driver reported RX overflows; rerun at a lower rate to "
+               "tell overflow\nlosses from lost frames.");
+        }
+    }
+
+  pthread_mutex_destroy(&st->ss_lock);
+  sem_destroy(&g_poll_test_sem);
 }
 
 /****************************************************************************
@@ -935,16 +10663,25 @@ int main(int argc, char **argv)
   /* For getopt_long */
   int opt;
   int opt_idx = 0;
-  const char short_opts[] = "hd:";
+  const char short_opts[] = "hd:c:ar:s:";
   static const struct option long_opts[] =
     {
-      { "help", no_argument,        NULL, 'h' },
-      { "dev",  required_argument,  NULL, 'd' },
+      { "help",    no_argument,        NULL, 'h' },
+      { "dev",     required_argument,  NULL, 'd' },
+      { "capture", required_argument,  NULL, 'c' },
+      { "all",     no_argument,        NULL, 'a' },
+      { "replay",  required_argument,  NULL, 'r' },
+      { "speed",   required_argument,  NULL, 's' },
       { 0, 0, 0, 0}
     };
 
   uint32_t flags = 0;
-  char   dev[10] = "/dev/";
+  char   dev[CANDEV_NAMELEN] = "/dev/";
+  char   devs[MULTIBUS_MAX][CANDEV_NAMELEN];
+  FAR const char *capture_path = NULL;
+  FAR const char *replay_path = NULL;
+  uint32_t replay_speed = 100;
+  bool   all_devs = false;
   int         fd;
   int         ret;
   int         exitcode = OK;
@@ -957,7 +10694,26 @@ int main(int argc, char **argv)
             flags |= FLAG_HELP;
             break;
           case 'd':
-            strncpy(dev, optarg, 9);
+            if (strlen(optarg) >= CANDEV_NAMELEN)
+              {
+                printf("Device path \"%s\" is too long.\n", optarg);
+                flags |= FLAG_GETOPT_ERR;
+                break;
+              }
+
+            strncpy(dev, optarg, CANDEV_NAMELEN - 1);
+            break;
+          case 'c':
+            capture_path = optarg;
+            break;
+          case 'a':
+            all_devs = true;
+            break;
+          case 'r':
+            replay_path = optarg;
+            break;
+          case 's':
+            replay_speed = strtoul(optarg, NULL, 10);
             break;
           case '?':
             if (optopt)
@@ -999,11 +10755,10 @@ int main(int argc, char **argv)
     return OK;
 
   /* CAN device selection ***************************************************/
-  if (strncmp(dev, "/dev/", 9) == 0)
+  if (all_devs || strncmp(dev, "/dev/", 9) == 0)
     {
-      struct dirent **devs;
       int numdevs;
-      numdevs = scandir("/dev", &devs, filter_candevs, alphasort);
+      numdevs = find_candevs(devs, MULTIBUS_MAX);
 
       if (numdevs == -1)
         {
@@ -1015,15 +10770,13 @@ int main(int argc, char **argv)
           printf("No CAN devices found in /dev.\n");
           return ENODEV;
         }
+      else if (all_devs)
+        {
+          return test_multibus(devs, numdevs);
+        }
       else
         {
-          strncat(dev, devs[0]->d_name, 4);
-
-          for (int i = 0; i < numdevs; ++i)
-            {
-              free(devs[i]);
-            }
-          free(devs);
+          strncpy(dev, devs[0], CANDEV_NAMELEN);
         }
     }
 
@@ -1037,9 +10790,23 @@ int main(int argc, char **argv)
       return errno;
     }
 
+  if (capture_path != NULL)
+    {
+      exitcode = run_capture(fd, capture_path);
+      close(fd);
+      return exitcode;
+    }
+
+  if (replay_path != NULL)
+    {
+      exitcode = run_replay(fd, replay_path, replay_speed);
+      close(fd);
+      return exitcode;
+    }
+
   while (true)
     {
-      char selection[3] = {0};
+      char selection[4] = {0};
 
 
       printf("Type Q to quit or select a test to run:\n"
@@ -1050,13 +10817,29 @@ int main(int argc, char **argv)
              " 5. Remove standard filters\n"
              " 6. Remove extended filters\n"
              " 7. Perform a remote-request-response transaction\n"
-             " 8. Send a burst of TX messages\n"
-             " 9. Test for can_poll() bug\n"
+             " 8. TX traffic generator\n"
+             " 9. Multi-threaded read()/poll() wakeup stress test\n"
+             "10. High-throughput (batched) receive\n"
+             "11. Bus load and per-ID statistics (cantop)\n"
+             "12. Remote-request latency benchmark\n"
+             "13. Compile an ID list into mask filters\n"
+             "14. Error-frame monitor\n"
+             "15. Decode signals with a DBC file\n"
+             "16. Pre/post-trigger capture\n"
+             "17. Change-only per-ID table (sniffer)\n"
+             "18. CAN-to-CAN gateway\n"
+             "19. Sequence-checked receive (loss measurement)\n"
+             "20. Loopback throughput self-test\n"
+             "21. Driver RX queueing delay (timestamps)\n"
+             "22. Real-time receive thread with printer thread\n"
+             "23. Cyclic multi-message transmit scheduler\n"
+             "24. ISO-TP segmented transfer benchmark\n"
+             "25. Fuzzing load test with status monitoring\n"
              "\n\n");
 
-      fputs("Please select an option (1/2/3/4/5/6/7/8/9/Q): ", stdout);
+      fputs("Please select an option (1-25/Q): ", stdout);
       fflush(stdout);
-      ret = std_readline(selection, 3);
+      ret = std_readline(selection, 4);
 
       if (ret < 0)
       {
@@ -1074,7 +10857,7 @@ int main(int argc, char **argv)
       }
       else if (strcmp(selection, "2\n") == 0)
       {
-        puts("Not implemented yet.");
+        test_setup_info(fd);
       }
       else if (strcmp(selection, "3\n") == 0)
       {
@@ -1102,15 +10885,75 @@ int main(int argc, char **argv)
       }
       else if (strcmp(selection, "8\n") == 0)
       {
-        test_tx_burst(fd);
+        test_tx_generator(fd);
       }
       else if (strcmp(selection, "9\n") == 0)
       {
-        pthread_t poll_test_thd;
-        sem_init(&g_poll_test_sem, 0, 0);
-        pthread_create(&poll_test_thd, NULL, test_poll_bug, (void *)fd);
-        pthread_yield();
-        test_basic_receive(fd);
+        test_poll_stress(fd);
+      }
+      else if (strcmp(selection, "10\n") == 0)
+      {
+        test_batched_receive(fd);
+      }
+      else if (strcmp(selection, "11\n") == 0)
+      {
+        test_cantop(fd);
+      }
+      else if (strcmp(selection, "12\n") == 0)
+      {
+        test_rtr_benchmark(fd);
+      }
+      else if (strcmp(selection, "13\n") == 0)
+      {
+        test_filter_optimizer(fd);
+      }
+      else if (strcmp(selection, "14\n") == 0)
+      {
+        test_error_monitor(fd);
+      }
+      else if (strcmp(selection, "15\n") == 0)
+      {
+        test_dbc_decode(fd);
+      }
+      else if (strcmp(selection, "16\n") == 0)
+      {
+        test_trigger_capture(fd);
+      }
+      else if (strcmp(selection, "17\n") == 0)
+      {
+        test_sniffer(fd);
+      }
+      else if (strcmp(selection, "18\n") == 0)
+      {
+        test_gateway(fd);
+      }
+      else if (strcmp(selection, "19\n") == 0)
+      {
+        test_seq_receive(fd);
+      }
+      else if (strcmp(selection, "20\n") == 0)
+      {
+        test_loopback_selftest(fd);
+      }
+      else if (strcmp(selection, "21\n") == 0)
+      {
+        test_rx_latency(fd);
+      }
+      else if (strcmp(selection, "22\n") == 0)
+      {
+        test_rt_receive(fd);
+      }
+      else if (strcmp(selection, "23\n") == 0)
+      {
+        test_cyclic_tx(fd);
+      }
+      else if (strcmp(selection, "24\n") == 0)
+      {
+        test_isotp(fd);
+      }
+      else if (strcmp(selection, "25\n") == 0)
+      {
+        test_fuzz_load(fd);
       }
       else
       {
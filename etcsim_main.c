@@ -0,0 +1,834 @@
+/****************************************************************************
+ * apps/industry/ETCetera-tools/etcsim_main.c
+ * Electronic Throttle Controller program - drive-cycle input simulator
+ *
+ * Copyright (C) 2022  Matthew Trescott <matthewtrescott@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ****************************************************************************/
+
+/****************************************************************************
+ * Included Files
+ ****************************************************************************/
+
+#include <nuttx/config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <nuttx/can/can.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/****************************************************************************
+ * Pre-processor Definitions
+ ****************************************************************************/
+
+#ifndef CONFIG_INDUSTRY_ETCETERA_ETCSIM_BASEID
+#  define CONFIG_INDUSTRY_ETCETERA_ETCSIM_BASEID 0x200
+#endif
+
+#define FLAG_HELP         1
+#define FLAG_UNRECOGNIZED 2
+#define FLAG_GETOPT_ERR   4
+
+/* Simulated messages. All signals are little-endian and unsigned.
+ *
+ * ENGINE (base + 0): bytes 0-1 engine speed, 1 rpm/bit; byte 2 gear
+ *   (0 neutral, 1-6 forward, 0xff reverse)
+ * WHEELS (base + 1): bytes 0-1, 2-3, 4-5, 6-7 wheel speed FL, FR, RL, RR,
+ *   0.01 km/h per bit
+ * BRAKE (base + 2): bytes 0-1 brake line pressure, 0.01 bar per bit
+ */
+
+#define ETCSIM_ENGINE_ID  (CONFIG_INDUSTRY_ETCETERA_ETCSIM_BASEID + 0)
+#define ETCSIM_WHEELS_ID  (CONFIG_INDUSTRY_ETCETERA_ETCSIM_BASEID + 1)
+#define ETCSIM_BRAKE_ID   (CONFIG_INDUSTRY_ETCETERA_ETCSIM_BASEID + 2)
+
+#define ETCSIM_ENGINE_PERIOD_US 10000
+#define ETCSIM_WHEELS_PERIOD_US 10000
+#define ETCSIM_BRAKE_PERIOD_US  20000
+#define ETCSIM_NMSGS      3
+
+/* Longest profile line, status line interval, and delay before the first
+ * frames so that their deadlines are not already missed
+ */
+
+#define ETCSIM_LINE_MAX   160
+#define ETCSIM_STATUS_US  1000000
+#define ETCSIM_LEAD_US    10000
+
+/****************************************************************************
+ * Private Types
+ ****************************************************************************/
+
+/* One row of the drive-cycle profile. The CSV columns are, in order:
+ * time_s,rpm,gear,ws_fl_kmh,ws_fr_kmh,ws_rl_kmh,ws_rr_kmh,brake_bar
+ */
+
+struct etcsim_sample_s
+{
+  uint64_t      es_t_us;        /* Time since the start of the cycle */
+  float         es_rpm;
+  float         es_ws[4];       /* FL, FR, RL, RR in km/h */
+  float         es_brake;       /* bar */
+  int           es_gear;        /* -1 reverse, 0 neutral */
+};
+
+/* Profile reader. Only the two samples bracketing the current time are
+ * kept, so memory use does not depend on the length of the cycle.
+ */
+
+struct etcsim_profile_s
+{
+  FAR FILE     *ep_file;
+  uint32_t      ep_line;        /* Line number of ep_next */
+  uint32_t      ep_samples;     /* Samples read */
+  bool          ep_eof;
+  struct etcsim_sample_s ep_prev;
+  struct etcsim_sample_s ep_next;
+};
+
+/****************************************************************************
+ * Private Function Prototypes
+ ****************************************************************************/
+
+static void print_help(void);
+static uint64_t now_us(void);
+static int profile_read(FAR struct etcsim_profile_s *ep,
+                        FAR struct etcsim_sample_s *sample);
+static int profile_rewind(FAR struct etcsim_profile_s *ep);
+static int profile_seek(FAR struct etcsim_profile_s *ep, uint64_t t_us);
+static float lerp(float a, float b, float frac);
+static void profile_interpolate(FAR const struct etcsim_profile_s *ep,
+                                uint64_t t_us,
+                                FAR struct etcsim_sample_s *out);
+static uint32_t to_fixed(float val);
+static void put_u16(FAR uint8_t *dst, float val);
+static size_t build_msg(int which, FAR const struct etcsim_sample_s *s,
+                        FAR uint8_t *dst);
+static bool stdin_quit(void);
+static int run_sim(int canfd, FAR struct etcsim_profile_s *ep,
+                   uint32_t speed, bool loop, bool verbose);
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+static const uint32_t g_msg_ids[ETCSIM_NMSGS] =
+{
+  ETCSIM_ENGINE_ID, ETCSIM_WHEELS_ID, ETCSIM_BRAKE_ID
+};
+
+static const uint32_t g_msg_periods[ETCSIM_NMSGS] =
+{
+  ETCSIM_ENGINE_PERIOD_US, ETCSIM_WHEELS_PERIOD_US, ETCSIM_BRAKE_PERIOD_US
+};
+
+static struct etcsim_profile_s g_profile;
+static uint8_t g_txbuf[ETCSIM_NMSGS * CAN_MSGLEN(8)];
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: print_help
+ ****************************************************************************/
+
+static void print_help(void)
+{
+  printf("etcsim - play a drive-cycle profile as ETCetera input messages.\n"
+         "Usage: etcsim [--help|-h] [--dev|-d <device>]\n"
+         "              [--speed|-s <percent>] [--loop|-l] [--verbose|-v]\n"
+         "              <profile.csv>\n"
+         "       --help:    Print this information.\n"
+         "       --dev:     Use CAN device <device> (default /dev/can0).\n"
+         "       --speed:   Playback speed in percent of real time\n"
+         "                  (default 100).\n"
+         "       --loop:    Start over at the end of the profile until Q is\n"
+         "                  entered.\n"
+         "       --verbose: Print the simulated inputs once per second.\n"
+         "The profile is CSV with the columns\n"
+         "  time_s,rpm,gear,ws_fl_kmh,ws_fr_kmh,ws_rl_kmh,ws_rr_kmh,"
+         "brake_bar\n"
+         "in increasing time order. A header line and lines starting with #\n"
+         "are skipped. Gear -1 is reverse.\n");
+}
+
+/****************************************************************************
+ * Name: now_us
+ *
+ * Description:
+ *   Monotonic time in microseconds.
+ ****************************************************************************/
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/****************************************************************************
+ * Name: profile_read
+ *
+ * Description:
+ *   Reads the next sample from the profile, skipping blank lines, comments
+ *   and a header line.
+ *
+ * Returned value:
+ *   1 if a sample was read, 0 at end of file, or -EINVAL for a malformed
+ *   line (which is reported).
+ ****************************************************************************/
+
+static int profile_read(FAR struct etcsim_profile_s *ep,
+                        FAR struct etcsim_sample_s *sample)
+{
+  char line[ETCSIM_LINE_MAX];
+  FAR char *p;
+  FAR char *end;
+  double vals[8];
+  int i;
+
+  while (fgets(line, sizeof(line), ep->ep_file) != NULL)
+    {
+      ++ep->ep_line;
+
+      p = line + strspn(line, " \t");
+      if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#')
+        {
+          continue;
+        }
+
+      for (i = 0; i < 8; ++i)
+        {
+          /* Double, so time keeps microsecond resolution in long cycles */
+
+          vals[i] = strtod(p, &end);
+          if (end == p)
+            {
+              break;
+            }
+
+          p = end + strspn(end, " \t");
+          if (*p == ',')
+            {
+              ++p;
+            }
+        }
+
+      if (i == 0 && ep->ep_samples == 0)
+        {
+          continue;   /* Header */
+        }
+
+      if (i < 8 || vals[0] < 0)
+        {
+          printf("Profile line %" PRIu32 ": expected 8 numeric columns\n",
+                 ep->ep_line);
+          return -EINVAL;
+        }
+
+      sample->es_t_us = (uint64_t)(vals[0] * 1000000.0 + 0.5);
+      sample->es_rpm = vals[1];
+      sample->es_gear = (int)vals[2];
+      sample->es_ws[0] = vals[3];
+      sample->es_ws[1] = vals[4];
+      sample->es_ws[2] = vals[5];
+      sample->es_ws[3] = vals[6];
+      sample->es_brake = vals[7];
+
+      ++ep->ep_samples;
+      return 1;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Name: profile_rewind
+ *
+ * Description:
+ *   Goes back to the start of the profile and loads the first two samples.
+ *   A profile needs at least two, one to interpolate from and one to.
+ *
+ * Returned value:
+ *   0 on success, or a negated errno value.
+ ****************************************************************************/
+
+static int profile_rewind(FAR struct etcsim_profile_s *ep)
+{
+  int ret;
+
+  rewind(ep->ep_file);
+  ep->ep_line = 0;
+  ep->ep_samples = 0;
+  ep->ep_eof = false;
+
+  ret = profile_read(ep, &ep->ep_prev);
+  if (ret <= 0)
+    {
+      if (ret == 0)
+        {
+          puts("Profile contains no samples.");
+        }
+
+      return ret < 0 ? ret : -EINVAL;
+    }
+
+  ret = profile_read(ep, &ep->ep_next);
+  if (ret < 0)
+    {
+      return ret;
+    }
+  else if (ret == 0)
+    {
+      puts("Profile needs at least two samples.");
+      return -EINVAL;
+    }
+  else if (ep->ep_next.es_t_us <= ep->ep_prev.es_t_us)
+    {
+      printf("Profile line %" PRIu32 ": time does not increase\n",
+             ep->ep_line);
+      return -EINVAL;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Name: profile_seek
+ *
+ * Description:
+ *   Advances through the profile until ep_prev and ep_next bracket t_us.
+ *
+ * Returned value:
+ *   1 while t_us is within the profile, 0 once it is past the last sample,
+ *   or a negated errno value.
+ ****************************************************************************/
+
+static int profile_seek(FAR struct etcsim_profile_s *ep, uint64_t t_us)
+{
+  struct etcsim_sample_s sample;
+  int ret;
+
+  while (t_us >= ep->ep_next.es_t_us)
+    {
+      if (ep->ep_eof)
+        {
+          return 0;
+        }
+
+      ret = profile_read(ep, &sample);
+      if (ret < 0)
+        {
+          return ret;
+        }
+      else if (ret == 0)
+        {
+          ep->ep_eof = true;
+          return 0;
+        }
+
+      if (sample.es_t_us <= ep->ep_next.es_t_us)
+        {
+          printf("Profile line %" PRIu32 ": time does not increase\n",
+                 ep->ep_line);
+          return -EINVAL;
+        }
+
+      ep->ep_prev = ep->ep_next;
+      ep->ep_next = sample;
+    }
+
+  return 1;
+}
+
+/****************************************************************************
+ * Name: lerp
+ ****************************************************************************/
+
+static float lerp(float a, float b, float frac)
+{
+  return a + (b - a) * frac;
+}
+
+/****************************************************************************
+ * Name: profile_interpolate
+ *
+ * Description:
+ *   Linearly interpolates the continuous signals between the bracketing
+ *   samples. The gear is a step signal and keeps the earlier sample's
+ *   value.
+ ****************************************************************************/
+
+static void profile_interpolate(FAR const struct etcsim_profile_s *ep,
+                                uint64_t t_us,
+                                FAR struct etcsim_sample_s *out)
+{
+  FAR const struct etcsim_sample_s *a = &ep->ep_prev;
+  FAR const struct etcsim_sample_s *b = &ep->ep_next;
+  float frac = 0.0f;
+  int i;
+
+  if (b->es_t_us > a->es_t_us && t_us > a->es_t_us)
+    {
+      frac = (float)(t_us - a->es_t_us) / (float)(b->es_t_us - a->es_t_us);
+      if (frac > 1.0f)
+        {
+          frac = 1.0f;
+        }
+    }
+
+  out->es_t_us = t_us;
+  out->es_rpm = lerp(a->es_rpm, b->es_rpm, frac);
+  out->es_gear = a->es_gear;
+  out->es_brake = lerp(a->es_brake, b->es_brake, frac);
+
+  for (i = 0; i < 4; ++i)
+    {
+      out->es_ws[i] = lerp(a->es_ws[i], b->es_ws[i], frac);
+    }
+}
+
+/****************************************************************************
+ * Name: to_fixed
+ *
+ * Description:
+ *   Rounds a scaled signal to an unsigned integer, saturating at 0 and at
+ *   999999999 (so that it also prints in nine digits).
+ ****************************************************************************/
+
+static uint32_t to_fixed(float val)
+{
+  if (val <= 0.0f)
+    {
+      return 0;
+    }
+  else if (val >= 999999999.0f)
+    {
+      return 999999999;
+    }
+
+  return (uint32_t)(val + 0.5f);
+}
+
+/****************************************************************************
+ * Name: put_u16
+ *
+ * Description:
+ *   Stores a scaled signal as a little-endian unsigned 16-bit value,
+ *   rounding and saturating.
+ ****************************************************************************/
+
+static void put_u16(FAR uint8_t *dst, float val)
+{
+  uint32_t raw = to_fixed(val);
+
+  if (raw > UINT16_MAX)
+    {
+      raw = UINT16_MAX;
+    }
+
+  dst[0] = raw & 0xff;
+  dst[1] = raw >> 8;
+}
+
+/****************************************************************************
+ * Name: build_msg
+ *
+ * Description:
+ *   Encodes one of the simulated messages (index into g_msg_ids).
+ *
+ * Returned value:
+ *   Length of the message in bytes.
+ ****************************************************************************/
+
+static size_t build_msg(int which, FAR const struct etcsim_sample_s *s,
+                        FAR uint8_t *dst)
+{
+  FAR struct can_msg_s *msg = (FAR struct can_msg_s *)dst;
+  int i;
+
+  memset(msg, 0, CAN_MSGLEN(8));
+  msg->cm_hdr.ch_id = g_msg_ids[which];
+
+  switch (which)
+    {
+      case 0:
+        put_u16(&msg->cm_data[0], s->es_rpm);
+        msg->cm_data[2] = s->es_gear < 0 ? 0xff : s->es_gear;
+        msg->cm_hdr.ch_dlc = 3;
+        break;
+
+      case 1:
+        for (i = 0; i < 4; ++i)
+          {
+            put_u16(&msg->cm_data[2 * i], s->es_ws[i] * 100.0f);
+          }
+
+        msg->cm_hdr.ch_dlc = 8;
+        break;
+
+      default:
+        put_u16(&msg->cm_data[0], s->es_brake * 100.0f);
+        msg->cm_hdr.ch_dlc = 2;
+        break;
+    }
+
+  return CAN_MSGLEN(msg->cm_hdr.ch_dlc);
+}
+
+/****************************************************************************
+ * Name: stdin_quit
+ *
+ * Description:
+ *   Checks without blocking whether the user typed Q.
+ ****************************************************************************/
+
+static bool stdin_quit(void)
+{
+  struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0};
+  char input;
+
+  if (poll(&pfd, 1, 0) > 0 && read(STDIN_FILENO, &input, 1) == 1)
+    {
+      return input == 'Q' || input == 'q';
+    }
+
+  return false;
+}
+
+/****************************************************************************
+ * Name: run_sim
+ *
+ * Description:
+ *   Plays the profile. Each message has its own period; at each deadline
+ *   the profile is interpolated at the corresponding cycle time and every
+ *   message due is sent with one write(). Deadlines are absolute, so a
+ *   late wakeup does not shift the following ones. The device is
+ *   non-blocking: frames the TX queue does not accept (for example with
+ *   no other node on the bus to acknowledge them) are counted as rejected
+ *   rather than stalling the simulation.
+ *
+ * Input parameters:
+ *   canfd   - Open CAN device
+ *   ep      - Profile, positioned at its start
+ *   speed   - Playback speed in percent of real time
+ *   loop    - Start over at the end of the profile
+ *   verbose - Print the simulated inputs once per second
+ *
+ * Returned value:
+ *   0 on success, or a positive errno value.
+ ****************************************************************************/
+
+static int run_sim(int canfd, FAR struct etcsim_profile_s *ep,
+                   uint32_t speed, bool loop, bool verbose)
+{
+  struct etcsim_sample_s cur;
+  struct timespec deadline;
+  uint64_t due[ETCSIM_NMSGS];
+  uint64_t start;
+  uint64_t next;
+  uint64_t now;
+  uint64_t next_status;
+  uint64_t late;
+  uint64_t late_max = 0;
+  uint32_t frames = 0;
+  uint32_t rejected = 0;
+  uint32_t cycles = 0;
+  size_t len;
+  size_t done;
+  ssize_t ret;
+  int err = 0;
+  int i;
+
+  start = now_us() + ETCSIM_LEAD_US;
+  next_status = start;
+  for (i = 0; i < ETCSIM_NMSGS; ++i)
+    {
+      due[i] = start;
+    }
+
+  while (true)
+    {
+      next = due[0];
+      for (i = 1; i < ETCSIM_NMSGS; ++i)
+        {
+          if (due[i] < next)
+            {
+              next = due[i];
+            }
+        }
+
+      deadline.tv_sec = next / 1000000;
+      deadline.tv_nsec = (next % 1000000) * 1000;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                             NULL) == EINTR);
+
+      now = now_us();
+      late = now - next;
+      if (late > late_max)
+        {
+          late_max = late;
+        }
+
+      /* Interpolate at the nominal deadline, not the wakeup time, so the
+       * signals do not pick up scheduling jitter.
+       */
+
+      ret = profile_seek(ep, (next - start) * speed / 100);
+      if (ret < 0)
+        {
+          err = -ret;
+          break;
+        }
+      else if (ret == 0)
+        {
+          ++cycles;
+          if (!loop)
+            {
+              break;
+            }
+
+          ret = profile_rewind(ep);
+          if (ret < 0)
+            {
+              err = -ret;
+              break;
+            }
+
+          start = next;
+        }
+
+      profile_interpolate(ep, (next - start) * speed / 100, &cur);
+
+      len = 0;
+      for (i = 0; i < ETCSIM_NMSGS; ++i)
+        {
+          if (due[i] <= next)
+            {
+              len += build_msg(i, &cur, g_txbuf + len);
+
+              /* After a stall, skip the missed periods instead of sending
+               * a burst of stale frames.
+               */
+
+              due[i] += g_msg_periods[i];
+              if (due[i] <= now)
+                {
+                  due[i] += (now - due[i]) / g_msg_periods[i] *
+                            g_msg_periods[i] + g_msg_periods[i];
+                }
+            }
+        }
+
+      ret = write(canfd, g_txbuf, len);
+      if (ret < 0)
+        {
+          if (errno != EAGAIN)
+            {
+              err = errno;
+              printf("write() of CAN device failed: %d\n", err);
+              break;
+            }
+
+          ret = 0;
+        }
+
+      for (done = 0; done < len; )
+        {
+          if (done < (size_t)ret)
+            {
+              ++frames;
+            }
+          else
+            {
+              ++rejected;
+            }
+
+          done += CAN_MSGLEN(((FAR struct can_msg_s *)(g_txbuf + done))
+                             ->cm_hdr.ch_dlc);
+        }
+
+      if (now >= next_status)
+        {
+          next_status += ETCSIM_STATUS_US;
+          if (verbose)
+            {
+              /* Fixed point, so no floating-point printf is needed */
+
+              printf("t %5" PRIu32 ".%02" PRIu32 " s  %5" PRIu32 " rpm  "
+                     "gear %2d  wheels", (uint32_t)(cur.es_t_us / 1000000),
+                     (uint32_t)(cur.es_t_us / 10000 % 100),
+                     to_fixed(cur.es_rpm), cur.es_gear);
+              for (i = 0; i < 4; ++i)
+                {
+                  printf(" %3" PRIu32 ".%02" PRIu32,
+                         to_fixed(cur.es_ws[i] * 100.0f) / 100,
+                         to_fixed(cur.es_ws[i] * 100.0f) % 100);
+                }
+
+              printf(" km/h  brake %3" PRIu32 ".%02" PRIu32 " bar, "
+                     "%" PRIu32 " rejected\n",
+                     to_fixed(cur.es_brake * 100.0f) / 100,
+                     to_fixed(cur.es_brake * 100.0f) % 100, rejected);
+            }
+        }
+
+      if (stdin_quit())
+        {
+          puts("Quit.");
+          break;
+        }
+    }
+
+  printf("%" PRIu32 " frames sent, %" PRIu32 " rejected by the TX queue, "
+         "%" PRIu32 " complete cycles, %" PRIu32 " samples read, worst "
+         "wakeup lateness %" PRIu32 " us\n", frames, rejected, cycles,
+         ep->ep_samples, (uint32_t)late_max);
+  return err;
+}
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+/****************************************************************************
+ * Name: main
+ *
+ * Description:
+ *   etcsim main function
+ *
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+  int opt;
+  int opt_idx = 0;
+  const char short_opts[] = "hd:s:lv";
+  static const struct option long_opts[] =
+    {
+      { "help",    no_argument,        NULL, 'h' },
+      { "dev",     required_argument,  NULL, 'd' },
+      { "speed",   required_argument,  NULL, 's' },
+      { "loop",    no_argument,        NULL, 'l' },
+      { "verbose", no_argument,        NULL, 'v' },
+      { 0, 0, 0, 0}
+    };
+
+  FAR struct etcsim_profile_s *ep = &g_profile;
+  FAR const char *dev = "/dev/can0";
+  uint32_t flags = 0;
+  uint32_t speed = 100;
+  bool loop = false;
+  bool verbose = false;
+  int fd;
+  int ret;
+
+  while (-1 != (opt = getopt_long(argc, argv, short_opts, long_opts,
+                                  &opt_idx)))
+    {
+      switch (opt)
+        {
+          case 'h':
+            flags |= FLAG_HELP;
+            break;
+          case 'd':
+            dev = optarg;
+            break;
+          case 's':
+            speed = strtoul(optarg, NULL, 10);
+            break;
+          case 'l':
+            loop = true;
+            break;
+          case 'v':
+            verbose = true;
+            break;
+          case '?':
+            flags |= FLAG_UNRECOGNIZED;
+            break;
+          default:
+            flags |= FLAG_GETOPT_ERR;
+            break;
+        }
+    }
+
+  if (!(flags & FLAG_HELP) && optind != argc - 1)
+    {
+      printf("Exactly one profile file is required.\n");
+      flags |= FLAG_UNRECOGNIZED;
+    }
+
+  if (speed == 0)
+    {
+      printf("Speed must be at least 1 percent.\n");
+      flags |= FLAG_UNRECOGNIZED;
+    }
+
+  if (flags & FLAG_HELP)
+    {
+      print_help();
+      return OK;
+    }
+  else if (flags & (FLAG_UNRECOGNIZED | FLAG_GETOPT_ERR))
+    {
+      printf("Use --help for a list of options.\n");
+      return EINVAL;
+    }
+
+  memset(ep, 0, sizeof(*ep));
+  ep->ep_file = fopen(argv[optind], "r");
+  if (ep->ep_file == NULL)
+    {
+      printf("Error opening profile %s: %d\n", argv[optind], errno);
+      return errno;
+    }
+
+  ret = profile_rewind(ep);
+  if (ret < 0)
+    {
+      fclose(ep->ep_file);
+      return -ret;
+    }
+
+  fd = open(dev, O_WRONLY | O_NONBLOCK);
+  if (fd < 0)
+    {
+      printf("Error opening CAN device %s: %d\n", dev, errno);
+      fclose(ep->ep_file);
+      return errno;
+    }
+
+  printf("Playing %s on %s at %" PRIu32 "%% speed; enter Q to stop.\n",
+         argv[optind], dev, speed);
+  fflush(stdout);
+
+  ret = run_sim(fd, ep, speed, loop, verbose);
+
+  close(fd);
+  fclose(ep->ep_file);
+  return ret;
+}